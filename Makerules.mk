@@ -179,17 +179,20 @@ FORCE:
 
 .PHONY: run_tests
 run_tests:
-	@for f in $(RUN_TESTS); do \
+	@failed=0; \
+	for f in $(RUN_TESTS); do \
 		echo -n "TEST $$f: "; \
 		./$$f > $$f.err 2>&1; \
 		if [ "$$?" -eq "0" ]; then \
 			echo PASS; \
 		else \
 			echo FAIL; \
+			failed=1; \
 		fi; \
 		cat $$f.err | sed 's/^/  /'; \
 		$(RM) -f $$f.err; \
-	done 2>/dev/null
+	done 2>/dev/null; \
+	exit $$failed
 
 # NOTE: 'sinclude' is "silent-include".  This suppresses a warning if
 # .depend does not exist.  Since Makefile includes this file, and this
@@ -0,0 +1,164 @@
+/*
+ *  action.c - rule action strings, compiled once and expanded per MCE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "action.h"
+
+/*
+ * A compiled action string.  The 'action' value is broken into literal
+ * spans and '%' field references once, when the rule is loaded, so that
+ * each MCE only needs a straight walk over the ops.
+ */
+struct action_op {
+	const char *lit;	/* literal text (points into src), or NULL */
+	size_t len;		/* length of the literal text */
+	mced_field_fn put;	/* the field to expand, if lit is NULL */
+};
+struct mced_action {
+	char *src;		/* the original action string */
+	struct action_op *ops;
+	int nops;
+	size_t max_len;		/* upper bound on the expanded length */
+};
+
+/* append an op to a compiled action, merging adjacent literals */
+static int
+add_op(struct mced_action *action, const char *lit, size_t len, char field)
+{
+	struct action_op *op;
+	size_t max_len = 0;
+
+	if (lit && action->nops > 0) {
+		op = &action->ops[action->nops - 1];
+		if (op->lit && op->lit + op->len == lit) {
+			op->len += len;
+			action->max_len += len;
+			return 0;
+		}
+	}
+
+	op = realloc(action->ops, (action->nops + 1) * sizeof(*op));
+	if (!op) {
+		mced_perror(LOG_ERR, "ERR: realloc()");
+		return -1;
+	}
+	action->ops = op;
+	op = &action->ops[action->nops++];
+	op->lit = lit;
+	op->len = len;
+	op->put = lit ? NULL : mced_field_formatter(field, &max_len);
+	action->max_len += lit ? len : max_len;
+
+	return 0;
+}
+
+/* break an action string into ops */
+struct mced_action *
+mced_action_compile(const char *src)
+{
+	struct mced_action *action;
+	const char *p;
+
+	action = calloc(1, sizeof(*action));
+	if (!action) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	action->src = strdup(src);
+	if (!action->src) {
+		mced_perror(LOG_ERR, "ERR: strdup()");
+		mced_action_free(action);
+		return NULL;
+	}
+
+	p = action->src;
+	while (*p) {
+		const char *start = p;
+		int r;
+
+		if (*p != '%') {
+			/* a run of literal text */
+			while (*p && *p != '%') {
+				p++;
+			}
+			r = add_op(action, start, p - start, 0);
+		} else if (p[1] == '\0') {
+			/* a trailing '%' is just a '%' */
+			r = add_op(action, p, 1, 0);
+			p++;
+		} else if (mced_field_formatter(p[1], NULL)) {
+			r = add_op(action, NULL, 0, p[1]);
+			p += 2;
+		} else {
+			/* just assume a literal */
+			r = add_op(action, p + 1, 1, 0);
+			p += 2;
+		}
+		if (r < 0) {
+			mced_action_free(action);
+			return NULL;
+		}
+	}
+	mced_debug(3, "DBG:    compiled action into %d op%s\n",
+	           action->nops, (action->nops == 1) ? "" : "s");
+
+	return action;
+}
+
+void
+mced_action_free(struct mced_action *action)
+{
+	free(action->src);
+	free(action->ops);
+	free(action);
+}
+
+/* produce a malloc()ed commandline for an MCE */
+char *
+mced_action_expand(const struct mced_action *action, const struct mce *mce)
+{
+	char *buf;
+	char *p;
+	int i;
+
+	buf = malloc(action->max_len + 1);
+	if (!buf) {
+		mced_perror(LOG_ERR, "ERR: malloc()");
+		return NULL;
+	}
+
+	p = buf;
+	for (i = 0; i < action->nops; i++) {
+		const struct action_op *op = &action->ops[i];
+		if (op->lit) {
+			memcpy(p, op->lit, op->len);
+			p += op->len;
+		} else {
+			p += op->put(p, mce);
+		}
+	}
+	*p = '\0';
+
+	if (mced_log_events) {
+		mced_debug(2, "DBG: expanded \"%s\" -> \"%s\"\n",
+		           action->src, buf);
+	}
+
+	return buf;
+}
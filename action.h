@@ -0,0 +1,21 @@
+#ifndef MCED_ACTION_H__
+#define MCED_ACTION_H__
+
+#include "mced.h"
+
+/*
+ * A rule's action string, compiled when the rule is loaded.  Valid
+ * expansions are '%' and a letter in MCE_FIELDS (see fields.h).  Any
+ * other character after a '%' (including '%') is taken literally, and so
+ * is a '%' at the end of the string.
+ */
+struct mced_action;
+
+extern struct mced_action *mced_action_compile(const char *src);
+extern void mced_action_free(struct mced_action *action);
+
+/* produce a malloc()ed commandline for an MCE, or NULL */
+extern char *mced_action_expand(const struct mced_action *action,
+                                const struct mce *mce);
+
+#endif  /* MCED_ACTION_H__ */
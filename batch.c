@@ -0,0 +1,193 @@
+/*
+ *  batch.c - batched command rules
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "action.h"
+#include "batch.h"
+
+struct mced_batch *
+mced_batch_new(void)
+{
+	struct mced_batch *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	b->fd = -1;
+	b->timer.fd = -1;
+
+	return b;
+}
+
+void
+mced_batch_stop(struct mced_batch *b)
+{
+	/* whatever it has collected is not lost */
+	mced_batch_run(b);
+
+	if (b->timer.fd >= 0) {
+		mced_unwatch(&b->timer);
+		close(b->timer.fd);
+		/* an event still pending for it reads nothing */
+		b->timer.fd = -1;
+	}
+}
+
+void
+mced_batch_free(struct mced_batch *b)
+{
+	mced_batch_stop(b);
+	free(b);
+}
+
+/* the window of a batch has passed */
+static void
+batch_event(struct mced_watcher *w, uint32_t events __attribute__((unused)))
+{
+	struct mced_batch *b;
+	uint64_t expirations;
+
+	b = (struct mced_batch *)((char *)w - offsetof(struct mced_batch,
+	                                               timer));
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious */
+		return;
+	}
+	mced_batch_run(b);
+}
+
+int
+mced_batch_start(struct mced_batch *b, const struct mced_action *action,
+                 const char *origin)
+{
+	b->action = action;
+	b->origin = origin;
+	if (!b->window_ms) {
+		b->window_ms = MCED_BATCH_WINDOW_MS;
+	}
+	b->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (b->timer.fd < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_create()");
+		return -1;
+	}
+	b->timer.handler = batch_event;
+	if (mced_watch(&b->timer, EPOLLIN) < 0) {
+		close(b->timer.fd);
+		b->timer.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+mced_batch_add(struct mced_batch *b, const struct mce *mce)
+{
+	char line[MCE_V2_MSG_MAX + 1];
+	size_t len;
+	size_t off;
+
+	if (b->fd < 0) {
+		struct itimerspec its;
+
+		b->fd = memfd_create("mced-batch", MFD_CLOEXEC);
+		if (b->fd < 0) {
+			mced_perror(LOG_ERR, "ERR: memfd_create()");
+			return -1;
+		}
+		b->cmd = mced_action_expand(b->action, mce);
+		if (!b->cmd) {
+			close(b->fd);
+			b->fd = -1;
+			return -1;
+		}
+
+		/* the window starts with the first MCE */
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = b->window_ms / 1000;
+		its.it_value.tv_nsec = (b->window_ms % 1000) * 1000000L;
+		if (timerfd_settime(b->timer.fd, 0, &its, NULL) < 0) {
+			mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+		}
+	}
+
+	len = mced_format_v2(mce, line);
+	for (off = 0; off < len; ) {
+		ssize_t r = write(b->fd, line + off, len - off);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0) {
+			mced_perror(LOG_ERR, "ERR: write(batch)");
+			/* run what we have, rather than lose it too */
+			return mced_batch_run(b);
+		}
+		off += r;
+	}
+	b->count++;
+	b->urgent |= MCED_MCE_URGENT(mce);
+
+	if (MCED_MCE_URGENT(mce) || (b->max && b->count >= b->max)) {
+		return mced_batch_run(b);
+	}
+	return 0;
+}
+
+int
+mced_batch_run(struct mced_batch *b)
+{
+	struct itimerspec its;
+	int r;
+
+	if (b->fd < 0) {
+		return 0;
+	}
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(b->timer.fd, 0, &its, NULL);
+
+	mced_debug(2, "DBG: running batch of %u MCE%s from %s\n", b->count,
+	           (b->count == 1) ? "" : "s", b->origin);
+	if (!b->count) {
+		/* nothing made it in */
+		close(b->fd);
+		free(b->cmd);
+		r = 0;
+	} else {
+		b->batches++;
+		b->events += b->count;
+		lseek(b->fd, 0, SEEK_SET);
+		r = mced_run_handler_input(b->cmd, b->fd, b->count, b->urgent);
+	}
+
+	b->fd = -1;
+	b->cmd = NULL;
+	b->count = 0;
+	b->urgent = 0;
+
+	return r;
+}
@@ -0,0 +1,53 @@
+#ifndef MCED_BATCH_H__
+#define MCED_BATCH_H__
+
+#include "mced.h"
+#include "action.h"
+
+/*
+ * A command rule with batch_window_ms or batch_max runs its action once
+ * for a burst of MCEs, rather than once for each.  The v2 lines of the
+ * MCEs it matches are collected in a memfd, which becomes the action's
+ * stdin when the window has passed since the first of them, when the
+ * batch is full, or as soon as an urgent MCE joins it.  The action's '%'
+ * expansions are those of the first MCE.
+ */
+struct mced_batch {
+	const struct mced_action *action;
+	const char *origin;		/* the rule's, for messages */
+	unsigned window_ms;
+	unsigned max;			/* 0 for no limit */
+	int fd;				/* the memfd, or -1 while empty */
+	unsigned count;			/* MCEs in it */
+	int urgent;			/* any of them urgent */
+	char *cmd;			/* expanded for the first MCE */
+	struct mced_watcher timer;	/* a timerfd, for the window */
+	unsigned long long batches;	/* batches run */
+	unsigned long long events;	/* MCEs in them */
+};
+#define MCED_BATCH_WINDOW_MS	1000	/* if only batch_max is given */
+
+/* an empty batch, for a rule's file to set 'window_ms' and 'max' in */
+extern struct mced_batch *mced_batch_new(void);
+
+/*
+ * Run whatever a batch has collected, and stop its timer.  It collects no
+ * more, but may be freed after an event for the timer has been handled.
+ */
+extern void mced_batch_stop(struct mced_batch *b);
+
+/* whatever it has collected is run before it is freed */
+extern void mced_batch_free(struct mced_batch *b);
+
+/* get a batch ready to collect MCEs for 'action' */
+extern int mced_batch_start(struct mced_batch *b,
+                            const struct mced_action *action,
+                            const char *origin);
+
+/* add an MCE to a batch, and run it if it is ready */
+extern int mced_batch_add(struct mced_batch *b, const struct mce *mce);
+
+/* run the action on the MCEs a batch has collected, if any */
+extern int mced_batch_run(struct mced_batch *b);
+
+#endif  /* MCED_BATCH_H__ */
@@ -0,0 +1,341 @@
+/*
+ *  bench_fmt.c - time the MCE formatters and converters
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "kmce.h"
+#include "action.h"
+#include "old_fmt.h"
+
+/* what action.c needs from mced.c */
+int mced_log_events;
+
+int
+mced_log(int level __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+int
+mced_debug(int min_dbg_lvl __attribute__((unused)),
+           const char *fmt __attribute__((unused)), ...)
+{
+	return 0;
+}
+
+int
+mced_perror(int level __attribute__((unused)), const char *str)
+{
+	perror(str);
+	return 0;
+}
+
+/* enough to be quick in 'make check'; 'make bench' runs more */
+#define DEFAULT_LOOPS	100000
+
+/* the time a batch was read, for records without one */
+#define NOW		1700000000123456ULL
+
+static long loops;
+
+/* where results go, so the loops can not be optimized away */
+static volatile size_t sink;
+
+/* every field letter, from the table */
+#define FIELD_LETTER(letter, name, value, kind)	letter,
+static const char letters[] = { MCE_FIELDS(FIELD_LETTER) '\0' };
+#undef FIELD_LETTER
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the nanoseconds each loop took since 'start' */
+static double
+per_loop(uint64_t start)
+{
+	return (double)(now_ns() - start) / loops;
+}
+
+static void
+report(const char *what, double ns, double old_ns)
+{
+	if (old_ns > 0) {
+		printf("%-20s %8.1f ns, %8.1f ns with snprintf() (%.1fx)\n",
+		       what, ns, old_ns, old_ns / ns);
+	} else {
+		printf("%-20s %8.1f ns\n", what, ns);
+	}
+}
+
+/* the v1 and v2 socket lines */
+static void
+bench_lines(struct mce *m)
+{
+	char buf[MCE_V2_MSG_MAX + 1];
+	uint64_t start;
+	double ns;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		sink += mced_format_v1(m, buf);
+	}
+	ns = per_loop(start);
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		old_v1(m, buf, sizeof(buf));
+		sink += buf[0];
+	}
+	report("v1 line", ns, per_loop(start));
+
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		sink += mced_format_v2(m, buf);
+	}
+	ns = per_loop(start);
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		old_v2(m, buf, sizeof(buf));
+		sink += buf[0];
+	}
+	report("v2 line", ns, per_loop(start));
+}
+
+/* each '%' field on its own */
+static void
+bench_fields(struct mce *m)
+{
+	char buf[MCE_KIND_MAX_CPUS + 1];
+	char what[32];
+	const char *c;
+	mced_field_fn fn;
+	size_t max_len;
+	uint64_t start;
+	double ns;
+	long i;
+
+	for (c = letters; *c; c++) {
+		fn = mced_field_formatter(*c, &max_len);
+		start = now_ns();
+		for (i = 0; i < loops; i++) {
+			m->seq = i;
+			sink += fn(buf, m);
+		}
+		ns = per_loop(start);
+		start = now_ns();
+		for (i = 0; i < loops; i++) {
+			m->seq = i;
+			old_expansion(*c, m, buf, sizeof(buf));
+			sink += buf[0];
+		}
+		snprintf(what, sizeof(what), "field %%%c", *c);
+		report(what, ns, per_loop(start));
+	}
+}
+
+/* how an action used to be expanded: snprintf() for each field */
+static char *
+old_expand(const char *src, const struct mce *m)
+{
+	char buf[4096];
+	size_t len = 0;
+
+	for (; *src && len < sizeof(buf) - 1; src++) {
+		if (src[0] == '%' && src[1]) {
+			old_expansion(*++src, m, buf + len, sizeof(buf) - len);
+			len += strlen(buf + len);
+		} else {
+			buf[len++] = *src;
+		}
+	}
+	buf[len] = '\0';
+	return strdup(buf);
+}
+
+/* a command line, the way a rule's action is run */
+static void
+bench_action(const char *what, const char *src, struct mce *m)
+{
+	struct mced_action *action;
+	char *cmd;
+	uint64_t start;
+	double ns;
+	long i;
+
+	action = mced_action_compile(src);
+	if (!action) {
+		printf("can't compile \"%s\"\n", src);
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		cmd = mced_action_expand(action, m);
+		sink += cmd[0];
+		free(cmd);
+	}
+	ns = per_loop(start);
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		cmd = old_expand(src, m);
+		sink += cmd[0];
+		free(cmd);
+	}
+	report(what, ns, per_loop(start));
+	mced_action_free(action);
+}
+
+/* to the v3 wire format and back */
+static void
+bench_v3(struct mce *m)
+{
+	struct mce_v3_record rec;
+	struct mce back;
+	uint64_t start;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		m->seq = i;
+		mced_mce_to_v3(m, &rec);
+		sink += rec.seq;
+	}
+	report("mce to v3", per_loop(start), 0);
+
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		rec.seq = i;
+		mced_v3_to_mce(&rec, &back);
+		sink += back.seq;
+	}
+	report("v3 to mce", per_loop(start), 0);
+}
+
+/* a kernel record, with each layout that reads it */
+static void
+bench_kmce(void)
+{
+	struct kernel_mce k;
+	struct mce m;
+	char what[32];
+	uint64_t start;
+	long i;
+	int l;
+
+	memset(&k, 0, sizeof(k));
+	k.status = 0x9c00000000010151ULL;
+	k.addr = 0x12345678abcULL;
+	k.misc = 0x8c;
+	k.mcgstatus = 0x5;
+	k.time = 1700000000;
+	k.cpuvendor = VENDOR_INTEL;
+	k.bank = 12;
+	k.extcpu = 42;
+	k.socketid = 3;
+	k.finished = 1;
+
+	for (l = 0; l < kmce_nlayouts; l++) {
+		start = now_ns();
+		for (i = 0; i < loops; i++) {
+			k.tsc = i;
+			kmce_layouts[l].convert(&k, NOW, &m);
+			sink += m.tsc;
+		}
+		snprintf(what, sizeof(what), "kmce %zu bytes",
+		         kmce_layouts[l].len);
+		report(what, per_loop(start), 0);
+	}
+}
+
+/* the formatters must still say what snprintf() did, or the times lie */
+static int
+check_same(const struct mce *m)
+{
+	char got[MCE_V2_MSG_MAX + 1];
+	char want[MCE_V2_MSG_MAX + 1];
+	size_t len;
+
+	len = mced_format_v1(m, got);
+	old_v1(m, want, sizeof(want));
+	if (len != strlen(want) || memcmp(got, want, len)) {
+		printf("FAIL: the v1 line differs from snprintf()\n");
+		return -1;
+	}
+	len = mced_format_v2(m, got);
+	old_v2(m, want, sizeof(want));
+	if (len != strlen(want) || memcmp(got, want, len)) {
+		printf("FAIL: the v2 line differs from snprintf()\n");
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mce m;
+
+	loops = (argc > 1) ? atol(argv[1]) : DEFAULT_LOOPS;
+	if (loops <= 0) {
+		fprintf(stderr, "usage: %s [loops]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* a typical MCE */
+	memset(&m, 0, sizeof(m));
+	m.mci_status = 0x9c00000000010151ULL;
+	m.mci_address = 0x12345678abcULL;
+	m.mci_misc = 0x8c;
+	m.mcg_status = 0x5;
+	m.time = 1700000000123456ULL;
+	m.cpu = 42;
+	m.socket = 3;
+	m.bank = 12;
+	m.vendor = VENDOR_INTEL;
+	if (check_same(&m) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%ld loops of each, per MCE:\n", loops);
+	bench_lines(&m);
+	bench_fields(&m);
+	bench_action("mce_decode action", "mce_decode %c %b %g %s %a %m", &m);
+	bench_action("action of %q only", "echo %q", &m);
+	bench_v3(&m);
+	bench_kmce();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+ *  bench_ingest.c - time the conversion of a read of kernel MCE records
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mced.h"
+#include "kmce.h"
+
+/* records converted at each batch size: quick in 'make check' */
+#define DEFAULT_LOOPS	200000
+
+/* the most records one read of the kernel's log returns */
+#define MAX_BATCH	32
+
+static long loops;
+
+/* where results go, so the loops can not be optimized away */
+static volatile uint64_t sink;
+
+/* hand an MCE on, as the rings would, so none of it is optimized away */
+static void
+consume(const struct mce *mce, int urgent)
+{
+	__asm__ volatile("" : : "r"(mce) : "memory");
+	sink += urgent;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * What the read loop used to do with each record: copy it out with the
+ * part we don't know zeroed, take the time, and convert it with a branch
+ * on the version of the record.
+ */
+static void
+old_kmce_to_mce(const struct kernel_mce *kmce, struct mce *mce)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	memset(mce, 0, sizeof(*mce));
+	mce->bank = kmce->bank;
+	mce->mci_status = kmce->status;
+	mce->mci_address = kmce->addr;
+	mce->mci_misc = kmce->misc;
+	mce->mci_synd = kmce->synd;
+	mce->mci_ipid = kmce->ipid;
+	mce->mcg_status = kmce->mcgstatus;
+	mce->tsc = kmce->tsc;
+	mce->cs = kmce->cs;
+	mce->ip = kmce->rip;
+	if (kmce->time != 0) {
+		mce->time = kmce->time * 1000000ULL;
+	} else {
+		mce->time = (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	}
+	mce->cpu = kmce->extcpu;
+	mce->socket = kmce->socketid;
+	mce->vendor = kmce->cpuvendor;
+	mce->cpuid_eax = kmce->cpuid;
+	mce->init_apic_id = kmce->apicid;
+	mce->mcg_cap = kmce->mcgcap;
+}
+
+static void
+old_read(const uint8_t *raw, int n, size_t record_len)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct kernel_mce kmce;
+		struct mce mce;
+
+		memcpy(&kmce, &raw[i * record_len], record_len);
+		memset((uint8_t *)&kmce + record_len, 0,
+		       sizeof(kmce) - record_len);
+		old_kmce_to_mce(&kmce, &mce);
+		consume(&mce, (mce.mci_status & MCI_STATUS_UC) != 0);
+	}
+}
+
+/* one timestamp and one classifying pass per batch, converted in place */
+static void
+new_read(struct kmce_batch *b, const uint8_t *raw, int n, size_t record_len,
+         const struct kmce_layout *layout)
+{
+	struct timeval tv;
+	uint64_t now;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	now = (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	kmce_batch_fill(b, raw, n, record_len, layout, now);
+	for (i = 0; i < n; i++) {
+		struct mce mce;
+
+		layout->convert((const struct kernel_mce *)
+		                &raw[i * record_len], b->now, &mce);
+		consume(&mce, (b->class[i] & KMCE_UC) != 0);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int sizes[] = { 1, 2, 3, 4, 8, 15, 16, 17, 24, 31, 32 };
+	const size_t record_len = sizeof(struct kernel_mce);
+	const struct kmce_layout *layout;
+	uint8_t raw[MAX_BATCH * sizeof(struct kernel_mce)];
+	struct kmce_batch b;
+	uint64_t start;
+	double old_ns, new_ns;
+	long reads, r;
+	unsigned s;
+	int i;
+
+	loops = (argc > 1) ? atol(argv[1]) : DEFAULT_LOOPS;
+	if (loops <= 0) {
+		fprintf(stderr, "usage: %s [loops]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	layout = mced_kmce_layout(record_len);
+	if (!layout || kmce_batch_alloc(&b, MAX_BATCH) < 0) {
+		printf("FAIL: can't set up a batch\n");
+		return EXIT_FAILURE;
+	}
+
+	/* a read of corrected and uncorrected errors on a few CPUs */
+	memset(raw, 0, sizeof(raw));
+	for (i = 0; i < MAX_BATCH; i++) {
+		struct kernel_mce *k;
+
+		k = (struct kernel_mce *)&raw[i * record_len];
+		k->status = MCI_STATUS_VAL | MCI_STATUS_ADDRV | 0x0151;
+		if (i % 5 == 0) {
+			k->status |= MCI_STATUS_UC | MCI_STATUS_PCC;
+		}
+		k->addr = 0x12345000 + i * 0x40;
+		k->misc = 0x8c;
+		k->time = 1700000000 + i;
+		k->cpuvendor = VENDOR_INTEL;
+		k->bank = i % 20;
+		k->extcpu = i % 8;
+		k->socketid = i % 2;
+		k->finished = 1;
+	}
+
+	printf("%ld records at each size, per record:\n", loops);
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+
+		reads = (loops + n - 1) / n;
+		start = now_ns();
+		for (r = 0; r < reads; r++) {
+			old_read(raw, n, record_len);
+		}
+		old_ns = (double)(now_ns() - start) / (reads * n);
+		start = now_ns();
+		for (r = 0; r < reads; r++) {
+			new_read(&b, raw, n, record_len, layout);
+		}
+		new_ns = (double)(now_ns() - start) / (reads * n);
+		printf("batch of %2d %8.1f ns, %8.1f ns one at a time (%.1fx)\n",
+		       n, new_ns, old_ns, old_ns / new_ns);
+	}
+
+	kmce_batch_free(&b);
+	return EXIT_SUCCESS;
+}
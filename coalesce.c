@@ -0,0 +1,291 @@
+/*
+ *  coalesce.c - fold storms of repeated corrected MCEs into summaries
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mced.h"
+
+/*
+ * A failing DIMM can raise thousands of identical corrected errors a
+ * minute.  Each distinct error (socket, bank, status and address page)
+ * gets a slot in a fixed hash table.  Its first occurrence is handled as
+ * usual and opens a window; repeats within the window are only counted,
+ * and when the window closes they are handled as one summary MCE, which
+ * opens another window.  A window with no repeats frees the slot.
+ *
+ * Uncorrected errors are never coalesced.
+ */
+
+/* a lookup gives up after this many slots, and evicts the oldest */
+#define COALESCE_PROBES		8
+
+/* CPUs below this are tracked exactly; above it they may be overcounted */
+#define COALESCE_CPU_BITS	1024
+
+/* Intel's corrected error count, which changes from one repeat to the next */
+#define MCI_STATUS_INTEL_CEC	(0x7fffULL << 38)
+
+struct coalesce_slot {
+	int used;
+	int32_t socket;
+	uint8_t bank;
+	uint64_t status;		/* with the changing bits masked */
+	uint64_t page;
+	uint64_t due;			/* when the window closes (msecs) */
+	uint32_t count;			/* repeats in this window */
+	uint64_t first_time;		/* when the first repeat was seen */
+	uint32_t ncpus;			/* distinct CPUs of the repeats */
+	uint32_t cpus[MCE_SUMMARY_CPUS];
+	uint64_t cpu_seen[COALESCE_CPU_BITS / 64];
+	struct mce last;		/* the latest repeat */
+};
+
+static struct coalesce_slot *slots;
+static int window_ms;
+static void (*emit_summary)(struct mce *mce);
+
+static unsigned long long coalesced;
+static unsigned long long summaries;
+static unsigned long long evictions;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int
+mced_coalesce_init(int window, void (*emit)(struct mce *mce))
+{
+	window_ms = window;
+	emit_summary = emit;
+	if (window_ms <= 0) {
+		return 0;
+	}
+	slots = calloc(MCED_COALESCE_SLOTS, sizeof(*slots));
+	if (!slots) {
+		mced_log(LOG_ERR,
+		         "ERR: can't allocate the coalescing table\n");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t
+coalesce_status(const struct mce *mce)
+{
+	uint64_t status = mce->mci_status & ~MCI_STATUS_OVER;
+
+	if (mce->vendor == VENDOR_INTEL) {
+		status &= ~MCI_STATUS_INTEL_CEC;
+	}
+	return status;
+}
+
+static unsigned
+coalesce_hash(int32_t socket, uint8_t bank, uint64_t status, uint64_t page)
+{
+	uint64_t h = status ^ (page * 0x9e3779b97f4a7c15ULL);
+
+	h ^= ((uint64_t)(uint32_t)socket << 8) | bank;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h % MCED_COALESCE_SLOTS;
+}
+
+/* hand the repeats counted in a slot on as a summary */
+static void
+flush_slot(struct coalesce_slot *s)
+{
+	struct mce summary = s->last;
+
+	summary.repeats = s->count;
+	summary.first_time = s->first_time;
+	summary.ncpus = s->ncpus;
+	memcpy(summary.cpus, s->cpus, sizeof(summary.cpus));
+	s->count = 0;
+	s->ncpus = 0;
+	memset(s->cpu_seen, 0, sizeof(s->cpu_seen));
+	summaries++;
+	emit_summary(&summary);
+}
+
+static void
+note_cpu(struct coalesce_slot *s, uint32_t cpu)
+{
+	if (cpu < COALESCE_CPU_BITS) {
+		uint64_t bit = 1ULL << (cpu % 64);
+		if (s->cpu_seen[cpu / 64] & bit) {
+			return;
+		}
+		s->cpu_seen[cpu / 64] |= bit;
+	} else {
+		int i;
+		for (i = 0; i < MCE_SUMMARY_CPUS && i < (int)s->ncpus; i++) {
+			if (s->cpus[i] == cpu) {
+				return;
+			}
+		}
+	}
+	if (s->ncpus < MCE_SUMMARY_CPUS) {
+		s->cpus[s->ncpus] = cpu;
+	}
+	s->ncpus++;
+}
+
+/*
+ * Offer an MCE for coalescing.  Returns 1 if it was counted as a repeat,
+ * or 0 if it should be handled now.
+ */
+int
+mced_coalesce(const struct mce *mce)
+{
+	struct coalesce_slot *s, *free_slot = NULL, *victim = NULL;
+	uint64_t status, page, now;
+	unsigned h;
+	int i;
+
+	if (!slots || (mce->mci_status & MCI_STATUS_UC)) {
+		return 0;
+	}
+
+	status = coalesce_status(mce);
+	page = mce->mci_address >> 12;
+	h = coalesce_hash(mce->socket, mce->bank, status, page);
+	now = now_ms();
+
+	/* slots are freed in place, so always look at every probe */
+	for (i = 0; i < COALESCE_PROBES; i++) {
+		s = &slots[(h + i) % MCED_COALESCE_SLOTS];
+		if (!s->used) {
+			if (!free_slot) {
+				free_slot = s;
+			}
+			continue;
+		}
+		if (s->socket == mce->socket && s->bank == mce->bank
+		 && s->status == status && s->page == page) {
+			if (now >= s->due) {
+				/* the timer hasn't caught up with this one */
+				if (s->count) {
+					flush_slot(s);
+				}
+				s->due = now + window_ms;
+				return 0;
+			}
+			if (!s->count) {
+				s->first_time = mce->time;
+			}
+			s->count++;
+			note_cpu(s, mce->cpu);
+			s->last = *mce;
+			coalesced++;
+			return 1;
+		}
+		if (!victim || s->due < victim->due) {
+			victim = s;
+		}
+	}
+
+	s = free_slot;
+	if (!s) {
+		/* no room nearby: make some */
+		s = victim;
+		if (s->count) {
+			flush_slot(s);
+		}
+		evictions++;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->used = 1;
+	s->socket = mce->socket;
+	s->bank = mce->bank;
+	s->status = status;
+	s->page = page;
+	s->due = now + window_ms;
+	return 0;
+}
+
+/*
+ * Hand on the summaries whose windows have closed.  Returns the msecs
+ * until the next window closes, or -1 if none is open.
+ */
+long long
+mced_coalesce_expire(void)
+{
+	uint64_t now, next = 0;
+	int i;
+
+	if (!slots) {
+		return -1;
+	}
+
+	now = now_ms();
+	for (i = 0; i < MCED_COALESCE_SLOTS; i++) {
+		struct coalesce_slot *s = &slots[i];
+
+		if (!s->used) {
+			continue;
+		}
+		if (now >= s->due) {
+			if (!s->count) {
+				/* the storm is over */
+				s->used = 0;
+				continue;
+			}
+			flush_slot(s);
+			s->due = now + window_ms;
+		}
+		if (!next || s->due < next) {
+			next = s->due;
+		}
+	}
+	return next ? (long long)(next - now) : -1;
+}
+
+/* hand on every summary with repeats, before the daemon exits */
+void
+mced_coalesce_flush(void)
+{
+	int i;
+
+	if (!slots) {
+		return;
+	}
+	for (i = 0; i < MCED_COALESCE_SLOTS; i++) {
+		if (slots[i].used && slots[i].count) {
+			flush_slot(&slots[i]);
+		}
+	}
+}
+
+void
+mced_dump_coalesce_stats(void)
+{
+	if (!slots) {
+		return;
+	}
+	mced_log(LOG_INFO, "coalesce: window=%dms coalesced=%llu "
+	         "summaries=%llu evictions=%llu\n",
+	         window_ms, coalesced, summaries, evictions);
+}
@@ -2,6 +2,7 @@
 #include <glib.h>
 #include <dbus/dbus-glib.h>
 #include "mced.h"
+#include "fields.h"
 #include "dbus.h"
 #include "dbus_asv.h"
 #include "auto.dbus_server.h"
@@ -97,6 +98,37 @@ static DBusGConnection *dbus_connection_instance = NULL;
 /* The McedGObject that will serve all requsts. */
 static McedGObject *mced_gobject_instance = NULL;
 
+/*
+ * The keys of the fields are their expansions, such as "%c".  The table
+ * keeps them alive for as long as a dbus_asv might point at them.
+ */
+enum {
+#define FIELD_INDEX(letter, name, value, kind)	DBUS_FIELD_##name,
+	MCE_FIELDS(FIELD_INDEX)
+#undef FIELD_INDEX
+};
+static const char dbus_keys[][3] = {
+#define FIELD_KEY(letter, name, value, kind)	{ '%', letter, '\0' },
+	MCE_FIELDS(FIELD_KEY)
+#undef FIELD_KEY
+};
+
+/*
+ * The key, type and value of each kind of field, as dbus_asv_new() wants
+ * them.  There is no list type, so %P is not sent.
+ */
+#define DBUS_ASV_DEC32(name, value) \
+	dbus_keys[DBUS_FIELD_##name], G_TYPE_INT, (int32_t)(value),
+#define DBUS_ASV_UDEC32(name, value) \
+	dbus_keys[DBUS_FIELD_##name], G_TYPE_UINT, (uint32_t)(value),
+#define DBUS_ASV_HEX16			DBUS_ASV_UDEC32
+#define DBUS_ASV_HEX32			DBUS_ASV_UDEC32
+#define DBUS_ASV_UDEC64(name, value) \
+	dbus_keys[DBUS_FIELD_##name], G_TYPE_UINT64, (uint64_t)(value),
+#define DBUS_ASV_HEX64			DBUS_ASV_UDEC64
+#define DBUS_ASV_CPUS(name, value)
+#define FIELD_ASV(letter, name, value, kind)	DBUS_ASV_##kind(name, value)
+
 /*
  * Emit a DBUS signal for a single MCE.
  */
@@ -106,25 +138,11 @@ dbus_send_mce(struct mce *mce)
 	/* to access the signal ids, we need the class structure first */
 	McedGObjectClass *klass = MCED_OBJECT_GET_CLASS(mced_gobject_instance);
 
+	/* the field table's values are written in terms of 'm' */
+	const struct mce *m = mce;
+
 	/* convert a 'struct mce' into a 'dbus_asv' */
-	dbus_asv *payload = dbus_asv_new(
-	    "%B", G_TYPE_INT,    (int32_t)mce->boot,
-	    "%c", G_TYPE_UINT,   (uint32_t)mce->cpu,
-	    "%S", G_TYPE_INT,    (int32_t)mce->socket,
-	    "%p", G_TYPE_UINT,   (uint32_t)mce->init_apic_id,
-	    "%v", G_TYPE_INT,    (int32_t)mce->vendor,
-	    "%A", G_TYPE_UINT,   (int32_t)mce->cpuid_eax,
-	    "%b", G_TYPE_UINT,   (uint32_t)mce->bank,
-	    "%s", G_TYPE_UINT64, (uint64_t)mce->mci_status,
-	    "%a", G_TYPE_UINT64, (uint64_t)mce->mci_address,
-	    "%m", G_TYPE_UINT64, (uint64_t)mce->mci_misc,
-	    "%g", G_TYPE_UINT64, (uint64_t)mce->mcg_status,
-	    "%G", G_TYPE_UINT,   (uint32_t)mce->mcg_cap,
-	    "%t", G_TYPE_UINT64, (uint64_t)mce->time,
-	    "%T", G_TYPE_UINT64, (uint64_t)mce->tsc,
-	    "%C", G_TYPE_UINT,   (uint32_t)mce->cs,
-	    "%I", G_TYPE_UINT64, (uint64_t)mce->ip,
-	    NULL);
+	dbus_asv *payload = dbus_asv_new(MCE_FIELDS(FIELD_ASV) NULL);
 
 	/* send the signal */
 	g_signal_emit(mced_gobject_instance, klass->signals[MCED_SIGNAL_MCE],
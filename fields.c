@@ -0,0 +1,220 @@
+/*
+ *  fields.c - formatters and converters generated from the field table
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "fmt.h"
+
+/* write one value of each kind */
+static inline int
+put_DEC32(char *buf, int32_t val)
+{
+	return mced_fmt_dec(buf, val);
+}
+
+static inline int
+put_UDEC32(char *buf, uint32_t val)
+{
+	return mced_fmt_udec(buf, val);
+}
+
+static inline int
+put_UDEC64(char *buf, uint64_t val)
+{
+	return mced_fmt_udec(buf, val);
+}
+
+static inline int
+put_HEX16(char *buf, uint16_t val)
+{
+	return mced_fmt_hex(buf, val, 4);
+}
+
+static inline int
+put_HEX32(char *buf, uint32_t val)
+{
+	return mced_fmt_hex(buf, val, 8);
+}
+
+static inline int
+put_HEX64(char *buf, uint64_t val)
+{
+	return mced_fmt_hex(buf, val, 16);
+}
+
+/*
+ * The CPUs a summary's repeats were seen on, with a '+' if there were more
+ * than it lists.  An MCE which is not a summary was only seen on its own.
+ */
+static inline int
+put_CPUS(char *buf, const struct mce *mce)
+{
+	unsigned i, n;
+	int len = 0;
+
+	if (!mce->repeats) {
+		return mced_fmt_udec(buf, mce->cpu);
+	}
+	n = (mce->ncpus < MCE_SUMMARY_CPUS) ? mce->ncpus : MCE_SUMMARY_CPUS;
+	for (i = 0; i < n; i++) {
+		if (i) {
+			buf[len++] = ',';
+		}
+		len += mced_fmt_udec(buf + len, mce->cpus[i]);
+	}
+	if (mce->ncpus > n) {
+		buf[len++] = '+';
+	}
+	return len;
+}
+
+/* one formatter for each field */
+#define FIELD_FN(letter, name, value, kind) \
+static int \
+format_##name(char *buf, const struct mce *m) \
+{ \
+	return put_##kind(buf, value); \
+}
+MCE_FIELDS(FIELD_FN)
+#undef FIELD_FN
+
+/* and a table of them, indexed by letter */
+static const struct {
+	mced_field_fn fn;
+	size_t max_len;
+} formatters[256] = {
+#define FIELD_ENTRY(letter, name, value, kind) \
+	[(unsigned char)letter] = { format_##name, MCE_KIND_MAX_##kind },
+	MCE_FIELDS(FIELD_ENTRY)
+#undef FIELD_ENTRY
+};
+
+mced_field_fn
+mced_field_formatter(char field, size_t *max_len)
+{
+	unsigned char i = field;
+
+	if (max_len) {
+		*max_len = formatters[i].max_len;
+	}
+	return formatters[i].fn;
+}
+
+/* the v1 line is the handful of fields the first socket clients knew */
+size_t
+mced_format_v1(const struct mce *mce, char *buf)
+{
+	char *p = buf;
+
+	p += mced_fmt_udec(p, mce->cpu);
+	*p++ = ' ';
+	p += mced_fmt_udec(p, mce->bank);
+	*p++ = ' ';
+	p += mced_fmt_hex(p, mce->mci_status, 16);
+	*p++ = ' ';
+	p += mced_fmt_hex(p, mce->mci_address, 16);
+	*p++ = ' ';
+	p += mced_fmt_hex(p, mce->mci_misc, 16);
+	*p++ = ' ';
+	p += mced_fmt_hex(p, mce->mcg_status, 16);
+	*p++ = ' ';
+	p += mced_fmt_hex(p, mce->time, 16);
+	*p++ = ' ';
+	p += mced_fmt_dec(p, mce->boot);
+	*p++ = '\n';
+	*p = '\0';
+
+	return p - buf;
+}
+
+/*
+ * The v2 line is written straight through, field by field.  Every field
+ * but the first is preceded by a space.
+ */
+size_t
+mced_format_v2(const struct mce *m, char *buf)
+{
+	char *p = buf;
+
+#define FIELD_V2(letter, name, value, kind) \
+	*p = ' '; \
+	p += (p != buf); \
+	p[0] = '%'; \
+	p[1] = letter; \
+	p[2] = '='; \
+	p += 3; \
+	p += put_##kind(p, value);
+	MCE_FIELDS(FIELD_V2)
+#undef FIELD_V2
+	*p++ = '\n';
+	*p = '\0';
+
+	return p - buf;
+}
+
+/* convert each kind of v3 field to and from little-endian */
+#define TO_LE_U64(dst, src)	((dst) = htole64(src))
+#define TO_LE_U32(dst, src)	((dst) = htole32(src))
+#define TO_LE_U16(dst, src)	((dst) = htole16(src))
+#define TO_LE_U8(dst, src)	((dst) = (src))
+#define TO_LE_CPUS(dst, src) \
+	do { \
+		int i_; \
+		for (i_ = 0; i_ < MCE_SUMMARY_CPUS; i_++) { \
+			(dst)[i_] = htole32((src)[i_]); \
+		} \
+	} while (0)
+#define FROM_LE_U64(dst, src)	((dst) = le64toh(src))
+#define FROM_LE_U32(dst, src)	((dst) = le32toh(src))
+#define FROM_LE_U16(dst, src)	((dst) = le16toh(src))
+#define FROM_LE_U8(dst, src)	((dst) = (src))
+#define FROM_LE_CPUS(dst, src) \
+	do { \
+		int i_; \
+		for (i_ = 0; i_ < MCE_SUMMARY_CPUS; i_++) { \
+			(dst)[i_] = le32toh((src)[i_]); \
+		} \
+	} while (0)
+
+/* the table must cover every byte of the record */
+#define V3_FIELD_SIZE(member, kind) \
+	+ sizeof(((struct mce_v3_record *)0)->member)
+_Static_assert(0 MCE_V3_FIELDS(V3_FIELD_SIZE)
+               == sizeof(struct mce_v3_record),
+               "MCE_V3_FIELDS does not match struct mce_v3_record");
+#undef V3_FIELD_SIZE
+
+/* convert an MCE to the v3 wire format */
+void
+mced_mce_to_v3(const struct mce *mce, struct mce_v3_record *rec)
+{
+#define V3_FIELD_TO(member, kind)	TO_LE_##kind(rec->member, mce->member);
+	MCE_V3_FIELDS(V3_FIELD_TO)
+#undef V3_FIELD_TO
+}
+
+/* convert an MCE back from the v3 wire format */
+void
+mced_v3_to_mce(const struct mce_v3_record *rec, struct mce *mce)
+{
+	memset(mce, 0, sizeof(*mce));
+#define V3_FIELD_FROM(member, kind)	FROM_LE_##kind(mce->member, rec->member);
+	MCE_V3_FIELDS(V3_FIELD_FROM)
+#undef V3_FIELD_FROM
+}
@@ -0,0 +1,125 @@
+#ifndef MCED_FIELDS_H__
+#define MCED_FIELDS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mced.h"
+
+/*
+ * The one list of an MCE's fields.  Everything which writes them out -
+ * action expansions, the v2 socket line, mce_listen and D-Bus - is
+ * generated from it, so they can not drift apart.
+ *
+ * X(letter, name, value, kind): 'letter' is its expansion, 'name' names the
+ * code generated for it, 'value' is evaluated with 'm' pointing at the
+ * struct mce, and 'kind' says how it is written.  The order is that of
+ * the v2 line, and new fields only ever go on the end.
+ */
+#define MCE_FIELDS(X) \
+	X('B', boot,		m->boot,		DEC32) \
+	X('c', cpu,		m->cpu,			UDEC32) \
+	X('S', socket,		m->socket,		DEC32) \
+	X('p', init_apic_id,	m->init_apic_id,	HEX32) \
+	X('v', vendor,		m->vendor,		DEC32) \
+	X('A', cpuid_eax,	m->cpuid_eax,		HEX32) \
+	X('b', bank,		m->bank,		UDEC32) \
+	X('s', mci_status,	m->mci_status,		HEX64) \
+	X('a', mci_address,	m->mci_address,		HEX64) \
+	X('m', mci_misc,	m->mci_misc,		HEX64) \
+	X('y', mci_synd,	m->mci_synd,		HEX64) \
+	X('i', mci_ipid,	m->mci_ipid,		HEX64) \
+	X('g', mcg_status,	m->mcg_status,		HEX64) \
+	X('G', mcg_cap,		m->mcg_cap,		HEX32) \
+	X('t', time,		m->time,		HEX64) \
+	X('T', tsc,		m->tsc,			HEX64) \
+	X('C', cs,		m->cs,			HEX16) \
+	X('I', ip,		m->ip,			HEX64) \
+	X('q', seq,		m->seq,			UDEC64) \
+	X('R', repeats,		m->repeats,		UDEC32) \
+	X('F', first_time,	mce_first_time(m),	HEX64) \
+	X('P', cpus,		m,			CPUS) \
+	X('N', ppin,		m->ppin,		HEX64) \
+	X('M', microcode,	m->microcode,		HEX32)
+
+/* the longest string each kind can produce */
+#define MCE_KIND_MAX_DEC32	11	/* %d */
+#define MCE_KIND_MAX_UDEC32	10	/* %u */
+#define MCE_KIND_MAX_UDEC64	20	/* %llu */
+#define MCE_KIND_MAX_HEX16	6	/* 0x%04x */
+#define MCE_KIND_MAX_HEX32	10	/* 0x%08lx */
+#define MCE_KIND_MAX_HEX64	18	/* 0x%016llx */
+#define MCE_KIND_MAX_CPUS	(MCE_SUMMARY_CPUS * 11)	/* %u,%u,...+ */
+
+/* the longest v2 line: " %X=" and a value for each field, and a newline */
+#define MCE_V2_FIELD_MAX(letter, name, value, kind) \
+	+ 4 + MCE_KIND_MAX_##kind
+enum { MCE_V2_MSG_MAX = 1 MCE_FIELDS(MCE_V2_FIELD_MAX) };
+
+/* the longest v1 line: cpu, bank, five hex fields, boot and a newline */
+enum {
+	MCE_V1_MSG_MAX = 2 * (1 + MCE_KIND_MAX_UDEC32)
+	               + 5 * (1 + MCE_KIND_MAX_HEX64)
+	               + MCE_KIND_MAX_DEC32 + 1
+};
+
+/*
+ * The fields of the v3 record, in the order of struct mce_v3_record.
+ * X(member, kind), where 'kind' is how it is converted to little-endian.
+ */
+#define MCE_V3_FIELDS(X) \
+	X(mci_status,	U64) \
+	X(mci_address,	U64) \
+	X(mci_misc,	U64) \
+	X(mci_synd,	U64) \
+	X(mci_ipid,	U64) \
+	X(mcg_status,	U64) \
+	X(tsc,		U64) \
+	X(time,		U64) \
+	X(ip,		U64) \
+	X(boot,		U32) \
+	X(cpu,		U32) \
+	X(cpuid_eax,	U32) \
+	X(init_apic_id,	U32) \
+	X(socket,	U32) \
+	X(mcg_cap,	U32) \
+	X(cs,		U16) \
+	X(bank,		U8) \
+	X(vendor,	U8) \
+	X(seq,		U64) \
+	X(repeats,	U32) \
+	X(ncpus,	U32) \
+	X(cpus,		CPUS) \
+	X(first_time,	U64) \
+	X(ppin,		U64) \
+	X(microcode,	U32)
+
+/* when the MCEs a summary stands for started */
+static inline uint64_t
+mce_first_time(const struct mce *mce)
+{
+	return mce->repeats ? mce->first_time : mce->time;
+}
+
+/* writes one field into 'buf', which must be big enough, and no NUL */
+typedef int (*mced_field_fn)(char *buf, const struct mce *mce);
+
+/*
+ * Find the formatter for an expansion letter, and the longest string it
+ * can produce.  Returns NULL if the letter is not a field.
+ */
+extern mced_field_fn mced_field_formatter(char field, size_t *max_len);
+
+/*
+ * Write the v1 line for an MCE, with its newline and a NUL.  'buf' must
+ * hold MCE_V1_MSG_MAX + 1 bytes.  Returns the length of the line.
+ */
+extern size_t mced_format_v1(const struct mce *mce, char *buf);
+
+/*
+ * Write the v2 line for an MCE, with its newline and a NUL.  'buf' must
+ * hold MCE_V2_MSG_MAX + 1 bytes.  Returns the length of the line.
+ */
+extern size_t mced_format_v2(const struct mce *mce, char *buf);
+
+#endif  /* MCED_FIELDS_H__ */
@@ -0,0 +1,106 @@
+/*
+ *  fmt.c - fast fixed-width hex and decimal formatting
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fmt.h"
+
+/*
+ * Every event writes a dozen or so fixed-width hex fields.  snprintf() has
+ * to parse its format each time; these only do the arithmetic, two digits
+ * at a time from a table.
+ */
+
+static const char hex_pairs[256][2] = {
+#define HEX_ROW(hi) \
+	{ hi, '0' }, { hi, '1' }, { hi, '2' }, { hi, '3' }, \
+	{ hi, '4' }, { hi, '5' }, { hi, '6' }, { hi, '7' }, \
+	{ hi, '8' }, { hi, '9' }, { hi, 'a' }, { hi, 'b' }, \
+	{ hi, 'c' }, { hi, 'd' }, { hi, 'e' }, { hi, 'f' }
+	HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+	HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+	HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('a'), HEX_ROW('b'),
+	HEX_ROW('c'), HEX_ROW('d'), HEX_ROW('e'), HEX_ROW('f'),
+#undef HEX_ROW
+};
+
+static const char dec_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+int
+mced_fmt_hex(char *buf, uint64_t val, int width)
+{
+	int ndigits = val ? (64 - __builtin_clzll(val) + 3) / 4 : 1;
+	char *p;
+
+	if (ndigits < width) {
+		ndigits = width;
+	}
+	buf[0] = '0';
+	buf[1] = 'x';
+	p = buf + 2 + ndigits;
+	while (p - buf > 3) {
+		p -= 2;
+		memcpy(p, hex_pairs[val & 0xff], 2);
+		val >>= 8;
+	}
+	if (p - buf == 3) {
+		*--p = hex_pairs[val & 0xf][1];
+	}
+	return 2 + ndigits;
+}
+
+int
+mced_fmt_udec(char *buf, uint64_t val)
+{
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	int len;
+
+	while (val >= 100) {
+		p -= 2;
+		memcpy(p, &dec_pairs[(val % 100) * 2], 2);
+		val /= 100;
+	}
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, &dec_pairs[val * 2], 2);
+	} else {
+		*--p = '0' + val;
+	}
+	len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
+	return len;
+}
+
+int
+mced_fmt_dec(char *buf, int64_t val)
+{
+	if (val < 0) {
+		buf[0] = '-';
+		/* negate as unsigned, so INT64_MIN survives */
+		return 1 + mced_fmt_udec(buf + 1, -(uint64_t)val);
+	}
+	return mced_fmt_udec(buf, val);
+}
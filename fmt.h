@@ -0,0 +1,21 @@
+#ifndef MCED_FMT_H__
+#define MCED_FMT_H__
+
+#include <stdint.h>
+
+/*
+ * Fast replacements for the printf() conversions that MCE fields are
+ * written with.  Each writes exactly the bytes printf() would, without
+ * a terminating NUL, and returns how many it wrote.
+ */
+
+/* "0x%0*llx": "0x" and at least 'width' (at most 16) lowercase digits */
+extern int mced_fmt_hex(char *buf, uint64_t val, int width);
+
+/* "%llu" */
+extern int mced_fmt_udec(char *buf, uint64_t val);
+
+/* "%lld" */
+extern int mced_fmt_dec(char *buf, int64_t val);
+
+#endif  /* MCED_FMT_H__ */
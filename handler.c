@@ -0,0 +1,400 @@
+/*
+ *  handler.c - asynchronous execution of rule actions
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "mced.h"
+
+extern char **environ;
+
+/*
+ * Rule actions are run via /bin/sh without waiting for them.  At most
+ * 'max_running' run at once; the rest wait in a bounded FIFO.  Actions for
+ * urgent MCEs have a FIFO of their own, which is always started first.
+ * Children are reaped when the main loop reads SIGCHLD from its signalfd.
+ * Co-processes for pipe_action rules are started here too, but they are
+ * run for as long as their rule lasts.
+ */
+
+/*
+ * A command to run.  A batched rule's command reads its MCEs from
+ * 'input', and is told how many there are in MCED_COUNT.
+ */
+struct handler_job {
+	char *cmd;
+	int input;		/* stdin for the command, or -1 */
+	unsigned count;		/* MCEs in 'input' */
+};
+
+struct handler_proc {
+	pid_t pid;
+	char *cmd;
+};
+
+static struct handler_proc *running;
+static int max_running;
+static int nrunning;
+
+struct handler_queue {
+	struct handler_job *jobs;
+	int head;
+	int count;
+};
+
+static struct handler_queue queue;
+static struct handler_queue urgent_queue;
+static int max_queued;
+
+/* counters */
+static unsigned long long nspawned;
+static unsigned long long ncompleted;
+static unsigned long long ndropped;
+static int queue_high_water;
+
+int
+mced_handler_init(int nrun, int nqueue)
+{
+	max_running = (nrun > 0) ? nrun : 1;
+	max_queued = (nqueue > 0) ? nqueue : 0;
+
+	running = calloc(max_running, sizeof(*running));
+	queue.jobs = calloc(max_queued ? max_queued : 1,
+	                    sizeof(struct handler_job));
+	urgent_queue.jobs = calloc(max_queued ? max_queued : 1,
+	                           sizeof(struct handler_job));
+	if (!running || !queue.jobs || !urgent_queue.jobs) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Build the environment of a handler which is told how many MCEs it gets:
+ * ours, with MCED_COUNT set.  This is done before fork(), as the child
+ * must not malloc(), and without setenv(), as the ingest thread may be
+ * reading our environment.  Free the result with free_job_env().
+ */
+static char **
+job_env(unsigned count)
+{
+	static const char name[] = "MCED_COUNT=";
+	char **envp;
+	int n = 0;
+	int i;
+
+	while (environ[n]) {
+		n++;
+	}
+	envp = malloc((n + 2) * sizeof(*envp));
+	if (!envp) {
+		return NULL;
+	}
+	envp[0] = malloc(sizeof(name) + 10);
+	if (!envp[0]) {
+		free(envp);
+		return NULL;
+	}
+	snprintf(envp[0], sizeof(name) + 10, "%s%u", name, count);
+	n = 1;
+	for (i = 0; environ[i]; i++) {
+		if (strncmp(environ[i], name, sizeof(name) - 1)) {
+			envp[n++] = environ[i];
+		}
+	}
+	envp[n] = NULL;
+
+	return envp;
+}
+
+static void
+free_job_env(char **envp)
+{
+	if (envp) {
+		free(envp[0]);
+		free(envp);
+	}
+}
+
+/*
+ * Run a command via /bin/sh in a newly forked child, with 'envp' as its
+ * environment, or ours if it is NULL.
+ */
+static void
+exec_child(const char *cmd, char **envp)
+{
+	char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+
+	sigset_t none;
+
+	/* reset signals */
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	execve("/bin/sh", argv, envp ? envp : environ);
+	/* should not get here */
+	_exit(127);
+}
+
+/* fork and exec a command, without waiting for it */
+static int
+spawn(struct handler_job *job)
+{
+	char **envp = NULL;
+	pid_t pid;
+	int i;
+
+	if (mced_log_events) {
+		mced_log(LOG_NOTICE, "executing action \"%s\"\n", job->cmd);
+		mced_log(LOG_NOTICE, "BEGIN HANDLER MESSAGES\n");
+	}
+
+	if (job->input >= 0) {
+		envp = job_env(job->count);
+		if (!envp) {
+			mced_perror(LOG_ERR, "ERR: malloc()");
+			free(job->cmd);
+			close(job->input);
+			return -1;
+		}
+	}
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		mced_perror(LOG_ERR, "ERR: fork()");
+		free(job->cmd);
+		free_job_env(envp);
+		if (job->input >= 0) {
+			close(job->input);
+		}
+		return -1;
+	case 0: /* child */
+		if (job->input >= 0 && dup2(job->input, STDIN_FILENO) < 0) {
+			_exit(127);
+		}
+		exec_child(job->cmd, envp);
+	}
+
+	/* parent */
+	free_job_env(envp);
+	if (job->input >= 0) {
+		close(job->input);
+	}
+	for (i = 0; i < max_running; i++) {
+		if (running[i].pid == 0) {
+			running[i].pid = pid;
+			running[i].cmd = job->cmd;
+			break;
+		}
+	}
+	nrunning++;
+	nspawned++;
+
+	return 0;
+}
+
+/*
+ * Run a command via /bin/sh, with 'input' as its stdin and 'count' in
+ * MCED_COUNT, unless 'input' is -1.  This takes ownership of 'cmd', which
+ * must have been malloc()ed, and of 'input', which must be positioned at
+ * the start of what the command should read.  If too many handlers are
+ * already running, the command is queued, or dropped if its queue is full.
+ */
+int
+mced_run_handler_input(char *cmd, int input, unsigned count, int urgent)
+{
+	struct handler_queue *q = urgent ? &urgent_queue : &queue;
+	struct handler_job job;
+
+	job.cmd = cmd;
+	job.input = input;
+	job.count = count;
+	if (nrunning < max_running) {
+		return spawn(&job);
+	}
+
+	if (q->count >= max_queued) {
+		static unsigned long long last_logged;
+		ndropped++;
+		/* log the first drop and then every 1000th */
+		if (mced_log_events || ndropped - last_logged >= 1000
+		 || last_logged == 0) {
+			last_logged = ndropped;
+			mced_log(LOG_WARNING,
+			         "handler queue full, dropped %llu action%s\n",
+			         ndropped, (ndropped == 1) ? "" : "s");
+		}
+		free(cmd);
+		if (input >= 0) {
+			close(input);
+		}
+		return -1;
+	}
+
+	q->jobs[(q->head + q->count) % max_queued] = job;
+	q->count++;
+	if (queue.count + urgent_queue.count > queue_high_water) {
+		queue_high_water = queue.count + urgent_queue.count;
+	}
+	mced_debug(2, "DBG: queued %saction (%d waiting)\n",
+	           urgent ? "urgent " : "", q->count);
+
+	return 0;
+}
+
+/* run a command for a single MCE; see mced_run_handler_input() */
+int
+mced_run_handler(char *cmd, int urgent)
+{
+	return mced_run_handler_input(cmd, -1, 0, urgent);
+}
+
+static void
+log_exit_status(pid_t pid, int status)
+{
+	if (!mced_log_events) {
+		return;
+	}
+
+	mced_log(LOG_NOTICE, "END HANDLER MESSAGES\n");
+	if (WIFEXITED(status)) {
+		mced_log(LOG_INFO, "action (pid %d) exited with status %d\n",
+		         (int)pid, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		mced_log(LOG_INFO, "action (pid %d) exited on signal %d\n",
+		         (int)pid, WTERMSIG(status));
+	} else {
+		mced_log(LOG_INFO, "action (pid %d) exited with status %d\n",
+		         (int)pid, status);
+	}
+}
+
+/*
+ * Start a co-process: a command which is kept running, and fed on its
+ * stdin.  The write end of its stdin is returned in 'fd', non-blocking,
+ * and is not inherited by anything else we run, so the co-process sees
+ * EOF as soon as we close it.  It leads a process group of its own.  It
+ * is reaped like any other child, and mced_coproc_exited() is told when
+ * it is.
+ */
+pid_t
+mced_spawn_coproc(const char *cmd, int *fd)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		mced_perror(LOG_ERR, "ERR: pipe2()");
+		return -1;
+	}
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		mced_perror(LOG_ERR, "ERR: fork()");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	case 0: /* child */
+		if (dup2(fds[0], STDIN_FILENO) < 0) {
+			_exit(127);
+		}
+		/* a group of its own, so whatever it starts can be stopped */
+		setpgid(0, 0);
+		exec_child(cmd, NULL);
+	}
+
+	/* parent */
+	setpgid(pid, pid);
+	close(fds[0]);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	*fd = fds[1];
+	mced_debug(1, "DBG: started co-process %d \"%s\"\n", (int)pid, cmd);
+
+	return pid;
+}
+
+/* reap any finished children, and start queued commands */
+void
+mced_reap_handlers(void)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		int i;
+
+		for (i = 0; i < max_running; i++) {
+			if (running[i].pid == pid) {
+				break;
+			}
+		}
+		if (i == max_running) {
+			if (!mced_coproc_exited(pid, status)) {
+				mced_debug(1, "DBG: reaped unknown child %d\n",
+				           (int)pid);
+			}
+			continue;
+		}
+
+		log_exit_status(pid, status);
+		free(running[i].cmd);
+		running[i].pid = 0;
+		running[i].cmd = NULL;
+		nrunning--;
+		ncompleted++;
+	}
+
+	/* start whatever we now have room for, urgent actions first */
+	while (nrunning < max_running) {
+		struct handler_queue *q = urgent_queue.count ? &urgent_queue
+		                                             : &queue;
+		struct handler_job job;
+
+		if (!q->count) {
+			break;
+		}
+		job = q->jobs[q->head];
+		q->head = (q->head + 1) % max_queued;
+		q->count--;
+		spawn(&job);
+	}
+}
+
+void
+mced_dump_handler_stats(void)
+{
+	mced_log(LOG_INFO,
+	         "handlers: running=%d/%d queued=%d/%d urgent=%d/%d "
+	         "high_water=%d spawned=%llu completed=%llu dropped=%llu\n",
+	         nrunning, max_running, queue.count, max_queued,
+	         urgent_queue.count, max_queued,
+	         queue_high_water, nspawned, ncompleted, ndropped);
+}
@@ -0,0 +1,284 @@
+/*
+ *  kmce.c - conversion of the kernel's MCE records, for each record size
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mced.h"
+#include "kmce.h"
+
+/*
+ * The fields each size of record added, at the offsets the kernel put them.
+ * X(member, offset, mce_member, kind): 'member' of struct kernel_mce, at
+ * 'offset', is converted to 'mce_member' of struct mce as 'kind' says.
+ */
+
+/* the historical layout, before 2.6.31 */
+#define KMCE72_FIELDS(X) \
+	X(status,	0,	mci_status,	COPY) \
+	X(misc,		8,	mci_misc,	COPY) \
+	X(addr,		16,	mci_address,	COPY) \
+	X(mcgstatus,	24,	mcg_status,	COPY) \
+	X(rip,		32,	ip,		COPY) \
+	X(tsc,		40,	tsc,		COPY) \
+	X(cs,		64,	cs,		COPY) \
+	X(bank,		65,	bank,		COPY) \
+	X(cpu,		66,	cpu,		COPY)
+
+/* 2.6.31 added the time, the CPU's identity and MCG_CAP */
+#define KMCE88_FIELDS(X) \
+	X(time,		48,	time,		SECS) \
+	X(cpuvendor,	56,	vendor,		COPY) \
+	X(cpuid,	60,	cpuid_eax,	COPY) \
+	X(extcpu,	68,	cpu,		COPY) \
+	X(socketid,	72,	socket,		COPY) \
+	X(apicid,	76,	init_apic_id,	COPY) \
+	X(mcgcap,	80,	mcg_cap,	COPY)
+
+/* then came the SMCA syndrome */
+#define KMCE96_FIELDS(X) \
+	X(synd,		88,	mci_synd,	COPY)
+
+/* and IPID */
+#define KMCE104_FIELDS(X) \
+	X(ipid,		96,	mci_ipid,	COPY)
+
+/* and the PPIN */
+#define KMCE112_FIELDS(X) \
+	X(ppin,		104,	ppin,		COPY)
+
+/* and the microcode revision */
+#define KMCE120_FIELDS(X) \
+	X(microcode,	112,	microcode,	COPY)
+
+/* 5.10 appended kflags, which is only for the kernel's own use */
+#define KMCE128_FIELDS(X) \
+	X(kflags,	120,	none,		NONE)
+
+/*
+ * X(len, prev, last): the sizes of record we know, smallest first, each
+ * with the size before it and the last field it has.  Newer kernels only
+ * ever append fields, so each layout is the one before it and its own.
+ */
+#define KMCE_LAYOUTS(X) \
+	X(72,	0,	cpu) \
+	X(88,	72,	mcgcap) \
+	X(96,	88,	synd) \
+	X(104,	96,	ipid) \
+	X(112,	104,	ppin) \
+	X(120,	112,	microcode) \
+	X(128,	120,	kflags)
+
+/* how each kind of field is converted */
+#define KMCE_COPY(dst, src)	(dst) = (src);
+#define KMCE_SECS(dst, src)	if ((src) != 0) { (dst) = (src) * 1000000ULL; }
+#define KMCE_NONE(dst, src)
+
+/* what a record too small to have a field leaves in it */
+static void
+kmce0_to_mce(const struct kernel_mce *kmce __attribute__((unused)),
+             uint64_t now, struct mce *mce)
+{
+	memset(mce, 0, sizeof(*mce));
+	mce->time = now;
+	mce->socket = -1;
+	mce->vendor = VENDOR_UNKNOWN;
+	mce->cpuid_eax = 0;
+	mce->init_apic_id = (uint32_t)-1U;
+}
+
+/*
+ * Each converter is the one for the size before it, and then the fields
+ * its own size added, each checked to be where the table says and to fit
+ * in the record.  So it only reads the fields a record of its size has.
+ */
+#define KMCE_CONVERT(member, offset, mce_member, kind) \
+	_Static_assert(offsetof(struct kernel_mce, member) == (offset) \
+	               && (offset) + sizeof(kmce->member) <= layout_len, \
+	               #member " is not where its layout has it"); \
+	KMCE_##kind(mce->mce_member, kmce->member)
+#define KMCE_CONVERTER(len, prev, last) \
+static void \
+kmce##len##_to_mce(const struct kernel_mce *kmce, uint64_t now, \
+                   struct mce *mce) \
+{ \
+	enum { layout_len = len }; \
+	kmce##prev##_to_mce(kmce, now, mce); \
+	KMCE##len##_FIELDS(KMCE_CONVERT) \
+}
+KMCE_LAYOUTS(KMCE_CONVERTER)
+#undef KMCE_CONVERTER
+#undef KMCE_CONVERT
+
+const struct kmce_layout kmce_layouts[] = {
+#define KMCE_LAYOUT(len, prev, last)	{ len, #last, kmce##len##_to_mce },
+	KMCE_LAYOUTS(KMCE_LAYOUT)
+#undef KMCE_LAYOUT
+};
+const int kmce_nlayouts = sizeof(kmce_layouts) / sizeof(kmce_layouts[0]);
+
+_Static_assert(sizeof(struct kernel_mce) == 128,
+               "struct kernel_mce is not the newest layout");
+
+const struct kmce_layout *
+mced_kmce_layout(size_t record_len)
+{
+	const struct kmce_layout *layout = NULL;
+	int i;
+
+	/* records are read in place, so they must keep their alignment */
+	if (record_len % sizeof(uint64_t)) {
+		return NULL;
+	}
+	for (i = 0; i < kmce_nlayouts; i++) {
+		if (kmce_layouts[i].len <= record_len) {
+			layout = &kmce_layouts[i];
+		}
+	}
+	return layout;
+}
+
+/* the size of record which moved the CPU from 'cpu' to 'extcpu' */
+#define KMCE_EXTCPU_LEN		88
+
+/* round up to whole blocks */
+static int
+batch_blocks(int n)
+{
+	return (n + KMCE_BATCH_BLOCK - 1) & ~(KMCE_BATCH_BLOCK - 1);
+}
+
+int
+kmce_batch_alloc(struct kmce_batch *b, int size)
+{
+	int padded = batch_blocks(size);
+	uint8_t *p;
+
+	memset(b, 0, sizeof(*b));
+	b->mem_size = padded * (3 * sizeof(uint64_t) + sizeof(uint32_t)
+	                        + 2 * sizeof(uint8_t));
+	b->mem = calloc(1, b->mem_size);
+	if (!b->mem) {
+		return -1;
+	}
+	b->size = size;
+
+	/* the widest columns first, so each stays aligned */
+	p = b->mem;
+	b->status = (uint64_t *)p;
+	p += padded * sizeof(uint64_t);
+	b->addr = (uint64_t *)p;
+	p += padded * sizeof(uint64_t);
+	b->misc = (uint64_t *)p;
+	p += padded * sizeof(uint64_t);
+	b->cpu = (uint32_t *)p;
+	p += padded * sizeof(uint32_t);
+	b->bank = p;
+	p += padded;
+	b->class = p;
+	return 0;
+}
+
+void
+kmce_batch_free(struct kmce_batch *b)
+{
+	free(b->mem);
+	memset(b, 0, sizeof(*b));
+}
+
+/* the status bits a record is classified by */
+#define KMCE_CLASS_BITS \
+	(KMCE_VAL | KMCE_OVER | KMCE_UC | KMCE_ADDRV | KMCE_PCC)
+
+/*
+ * Classify 'n' records by their status, a block at a time.  The padding
+ * has a status of 0, so its class is 0.
+ */
+static void
+batch_classify(const uint64_t *restrict status, uint8_t *restrict class,
+               int n)
+{
+	const uint8_t bits = KMCE_CLASS_BITS;
+	int i, j;
+
+	/*
+	 * Less than a block is done a record at a time: the vector loads
+	 * would stall on statuses which are still being stored, and cost
+	 * more than they save.
+	 */
+	if (n < KMCE_BATCH_BLOCK) {
+		for (i = 0; i < n; i++) {
+			class[i] = (status[i] >> 56) & bits;
+		}
+		for (; i < KMCE_BATCH_BLOCK; i++) {
+			class[i] = 0;
+		}
+		return;
+	}
+	for (i = 0; i < n; i += KMCE_BATCH_BLOCK) {
+		for (j = 0; j < KMCE_BATCH_BLOCK; j++) {
+			class[i+j] = (status[i+j] >> 56) & bits;
+		}
+	}
+}
+
+void
+kmce_batch_fill(struct kmce_batch *b, const uint8_t *raw, int n,
+                size_t record_len, const struct kmce_layout *layout,
+                uint64_t now)
+{
+	int end = batch_blocks(n);
+	int last = b->n;
+	int extcpu = layout->len >= KMCE_EXTCPU_LEN;
+	int i;
+
+	b->n = n;
+	b->now = now;
+	for (i = 0; i < n; i++) {
+		const struct kernel_mce *k;
+
+		k = (const struct kernel_mce *)&raw[i * record_len];
+		b->status[i] = k->status;
+		b->addr[i] = k->addr;
+		b->misc[i] = k->misc;
+		b->bank[i] = k->bank;
+		b->cpu[i] = extcpu ? k->extcpu : k->cpu;
+	}
+	/*
+	 * Clear what an earlier, bigger batch left in the padding.  Only
+	 * that: the classifying pass would stall on loads of statuses which
+	 * are still being stored.
+	 */
+	for (; i < end && i < last; i++) {
+		b->status[i] = 0;
+	}
+	batch_classify(b->status, b->class, n);
+}
+
+int
+kmce_batch_count(const struct kmce_batch *b, uint8_t class)
+{
+	int i, j;
+	int count = 0;
+
+	for (i = 0; i < b->n; i += KMCE_BATCH_BLOCK) {
+		for (j = 0; j < KMCE_BATCH_BLOCK; j++) {
+			count += (b->class[i+j] & class) != 0;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,85 @@
+#ifndef MCED_KMCE_H__
+#define MCED_KMCE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mced.h"
+
+/*
+ * Convert a kernel MCE record to our MCE struct.  There is one converter
+ * for each size of record the kernel has used, which only reads the fields
+ * a record of that size has.  'now' is the time the batch was read (usecs
+ * since epoch), for records which have none.  The boot number is left
+ * for the caller to fill in.
+ */
+typedef void (*kmce_converter)(const struct kernel_mce *kmce, uint64_t now,
+                               struct mce *mce);
+
+struct kmce_layout {
+	size_t len;		/* bytes in each record */
+	const char *last;	/* the last field it has */
+	kmce_converter convert;
+};
+
+/* the sizes of record we know, smallest first */
+extern const struct kmce_layout kmce_layouts[];
+extern const int kmce_nlayouts;
+
+/*
+ * Find the layout to read records of 'record_len' bytes with: the largest
+ * which fits in them.  Returns NULL if there is none, or if records of
+ * that size would not stay aligned.
+ */
+extern const struct kmce_layout *mced_kmce_layout(size_t record_len);
+
+/*
+ * A record's class: the top byte of its MCi_STATUS, which holds the bits
+ * that decide what is done with it.
+ */
+#define KMCE_CLASS(bit)		((uint8_t)((bit) >> 56))
+#define KMCE_VAL		KMCE_CLASS(MCI_STATUS_VAL)
+#define KMCE_OVER		KMCE_CLASS(MCI_STATUS_OVER)
+#define KMCE_UC			KMCE_CLASS(MCI_STATUS_UC)
+#define KMCE_ADDRV		KMCE_CLASS(MCI_STATUS_ADDRV)
+#define KMCE_PCC		KMCE_CLASS(MCI_STATUS_PCC)
+
+/*
+ * The records of one read, with the fields looked at before they are
+ * converted pulled out into columns.  The columns are padded to whole
+ * blocks of KMCE_BATCH_BLOCK records, with nothing in the padding, so the
+ * passes over them have no records left over, and gcc vectorizes them at
+ * -O2.
+ */
+#define KMCE_BATCH_BLOCK	16
+
+struct kmce_batch {
+	int n;			/* records in the batch */
+	int size;		/* records it has room for */
+	uint64_t now;		/* when it was read (usecs since epoch) */
+	uint64_t *status;	/* MCi_STATUS of each record */
+	uint64_t *addr;		/* MCi_ADDR */
+	uint64_t *misc;		/* MCi_MISC */
+	uint32_t *cpu;
+	uint8_t *bank;
+	uint8_t *class;		/* KMCE_* bits of each status */
+	void *mem;		/* all of the columns */
+	size_t mem_size;
+};
+
+/* make room for batches of up to 'size' records; returns 0 or -1 */
+extern int kmce_batch_alloc(struct kmce_batch *b, int size);
+extern void kmce_batch_free(struct kmce_batch *b);
+
+/*
+ * Fill the columns from 'n' records of 'record_len' bytes, read with
+ * 'layout' at 'now', and classify each.
+ */
+extern void kmce_batch_fill(struct kmce_batch *b, const uint8_t *raw, int n,
+                            size_t record_len,
+                            const struct kmce_layout *layout, uint64_t now);
+
+/* how many records in the batch have any of the 'class' bits */
+extern int kmce_batch_count(const struct kmce_batch *b, uint8_t class);
+
+#endif  /* MCED_KMCE_H__ */
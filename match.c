@@ -0,0 +1,626 @@
+/*
+ *  match.c - match predicates for rules, and an index to dispatch them
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "mced.h"
+#include "match.h"
+
+static const struct {
+	const char *name;
+	int vendor;
+} vendor_names[] = {
+	{ "unknown",	VENDOR_UNKNOWN },
+	{ "intel",	VENDOR_INTEL },
+	{ "cyrix",	VENDOR_CYRIX },
+	{ "amd",	VENDOR_AMD },
+	{ "umc",	VENDOR_UMC },
+	{ "centaur",	VENDOR_CENTAUR },
+	{ "transmeta",	VENDOR_TRANSMETA },
+	{ "nsc",	VENDOR_NSC },
+};
+#define NVENDOR_NAMES	(sizeof(vendor_names) / sizeof(vendor_names[0]))
+
+void
+mced_match_init(struct mced_match *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->uncorrected = -1;
+	m->severity = -1;
+}
+
+void
+mced_match_free(struct mced_match *m)
+{
+	free(m->cpus);
+	free(m->sockets);
+	mced_match_init(m);
+}
+
+/* parse a number, returning a pointer past it, or NULL */
+static const char *
+parse_number(const char *p, long long min, long long max, long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoll(p, &end, 0);
+	if (end == p || errno || *val < min || *val > max) {
+		return NULL;
+	}
+	return end;
+}
+
+/*
+ * Parse a list of values and ranges, such as "0,2,4-7", into a new array.
+ * Returns the number of ranges, or -1 on error.
+ */
+static int
+parse_ranges(const char *val, long long min, long long max,
+             struct mced_range **rangesp)
+{
+	struct mced_range *ranges = NULL;
+	int n = 0;
+	const char *p = val;
+
+	while (*p) {
+		struct mced_range r;
+		struct mced_range *tmp;
+
+		while (isspace(*p) || *p == ',') {
+			p++;
+		}
+		if (!*p) {
+			break;
+		}
+		p = parse_number(p, min, max, &r.lo);
+		if (!p) {
+			goto fail;
+		}
+		r.hi = r.lo;
+		if (*p == '-') {
+			p = parse_number(p + 1, r.lo, max, &r.hi);
+			if (!p) {
+				goto fail;
+			}
+		}
+		if (*p && !isspace(*p) && *p != ',') {
+			goto fail;
+		}
+
+		tmp = realloc(ranges, (n + 1) * sizeof(*ranges));
+		if (!tmp) {
+			mced_perror(LOG_ERR, "ERR: realloc()");
+			goto fail;
+		}
+		ranges = tmp;
+		ranges[n++] = r;
+	}
+	if (n == 0) {
+		goto fail;
+	}
+
+	*rangesp = ranges;
+	return n;
+
+ fail:
+	free(ranges);
+	return -1;
+}
+
+static int
+in_ranges(const struct mced_range *ranges, int n, long long val)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (val >= ranges[i].lo && val <= ranges[i].hi) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+parse_banks(struct mced_match *m, const char *val)
+{
+	struct mced_range *ranges;
+	int n;
+	int i;
+	long long b;
+
+	n = parse_ranges(val, 0, 255, &ranges);
+	if (n < 0) {
+		return -1;
+	}
+	memset(m->banks, 0, sizeof(m->banks));
+	for (i = 0; i < n; i++) {
+		for (b = ranges[i].lo; b <= ranges[i].hi; b++) {
+			m->banks[b >> 6] |= 1ULL << (b & 63);
+		}
+	}
+	free(ranges);
+
+	m->keys |= MCED_MATCH_BANK;
+	return 0;
+}
+
+static int
+parse_vendors(struct mced_match *m, const char *val)
+{
+	uint64_t vendors = 0;
+	const char *p = val;
+
+	while (*p) {
+		const char *start;
+		size_t len;
+		size_t i;
+		long long v;
+
+		while (isspace(*p) || *p == ',') {
+			p++;
+		}
+		if (!*p) {
+			break;
+		}
+		start = p;
+		while (*p && !isspace(*p) && *p != ',') {
+			p++;
+		}
+		len = p - start;
+
+		for (i = 0; i < NVENDOR_NAMES; i++) {
+			if (strlen(vendor_names[i].name) == len
+			 && !strncasecmp(vendor_names[i].name, start, len)) {
+				break;
+			}
+		}
+		if (i < NVENDOR_NAMES) {
+			v = vendor_names[i].vendor;
+		} else if (parse_number(start, -1, 62, &v) != p) {
+			return -1;
+		}
+		vendors |= 1ULL << (v + 1);
+	}
+	if (!vendors) {
+		return -1;
+	}
+
+	m->vendors = vendors;
+	m->keys |= MCED_MATCH_VENDOR;
+	return 0;
+}
+
+static int
+parse_u64(const char *val, uint64_t *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtoull(val, &end, 0);
+	if (end == val || *end || errno) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+parse_bool(const char *val)
+{
+	if (!strcasecmp(val, "yes") || !strcasecmp(val, "true")
+	 || !strcasecmp(val, "on") || !strcmp(val, "1")) {
+		return 1;
+	}
+	if (!strcasecmp(val, "no") || !strcasecmp(val, "false")
+	 || !strcasecmp(val, "off") || !strcmp(val, "0")) {
+		return 0;
+	}
+	return -1;
+}
+
+static const char *severity_names[] = {
+	[MCED_SEV_CORRECTED] = "corrected",
+	[MCED_SEV_UNCORRECTED] = "uncorrected",
+	[MCED_SEV_FATAL] = "fatal",
+};
+#define NSEVERITY_NAMES	(sizeof(severity_names) / sizeof(severity_names[0]))
+
+static int
+parse_severity(const char *val)
+{
+	size_t i;
+
+	for (i = 0; i < NSEVERITY_NAMES; i++) {
+		if (!strcasecmp(val, severity_names[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int
+mced_match_set(struct mced_match *m, const char *key, const char *val)
+{
+	struct mced_range *ranges;
+	int n;
+
+	if (!strcasecmp(key, "bank")) {
+		return parse_banks(m, val);
+	} else if (!strcasecmp(key, "cpu")) {
+		n = parse_ranges(val, 0, UINT32_MAX, &ranges);
+		if (n < 0) {
+			return -1;
+		}
+		free(m->cpus);
+		m->cpus = ranges;
+		m->ncpus = n;
+		m->keys |= MCED_MATCH_CPU;
+		return 0;
+	} else if (!strcasecmp(key, "socket")) {
+		n = parse_ranges(val, -1, INT32_MAX, &ranges);
+		if (n < 0) {
+			return -1;
+		}
+		free(m->sockets);
+		m->sockets = ranges;
+		m->nsockets = n;
+		m->keys |= MCED_MATCH_SOCKET;
+		return 0;
+	} else if (!strcasecmp(key, "vendor")) {
+		return parse_vendors(m, val);
+	} else if (!strcasecmp(key, "status_mask")) {
+		return parse_u64(val, &m->user_mask);
+	} else if (!strcasecmp(key, "status_value")) {
+		if (parse_u64(val, &m->user_value) < 0) {
+			return -1;
+		}
+		m->user_value_set = 1;
+		return 0;
+	} else if (!strcasecmp(key, "uncorrected")) {
+		m->uncorrected = parse_bool(val);
+		return (m->uncorrected < 0) ? -1 : 0;
+	} else if (!strcasecmp(key, "severity")) {
+		m->severity = parse_severity(val);
+		return (m->severity < 0) ? -1 : 0;
+	}
+
+	return 1;
+}
+
+/* add a mask and value to a status predicate, unless they contradict it */
+static int
+merge_status(uint64_t *mask, uint64_t *value, uint64_t mask2,
+             uint64_t value2)
+{
+	if ((*mask & mask2) & (*value ^ value2)) {
+		return -1;
+	}
+	*mask |= mask2;
+	*value |= value2;
+	return 0;
+}
+
+int
+mced_match_finish(struct mced_match *m)
+{
+	uint64_t mask = m->user_mask;
+	uint64_t value;
+
+	if (m->user_value_set) {
+		if (!mask) {
+			/* a value needs a mask to go with it */
+			return -1;
+		}
+		value = m->user_value;
+	} else {
+		/* a mask alone means those bits must be set */
+		value = mask;
+	}
+	if (value & ~mask) {
+		return -1;
+	}
+
+	if (m->uncorrected >= 0) {
+		uint64_t uc = m->uncorrected ? MCI_STATUS_UC : 0;
+		if (merge_status(&mask, &value, MCI_STATUS_UC, uc) < 0) {
+			return -1;
+		}
+	}
+	/* a minimum severity: each one implies the bits of those below */
+	if (m->severity >= MCED_SEV_UNCORRECTED
+	 && merge_status(&mask, &value, MCI_STATUS_UC, MCI_STATUS_UC) < 0) {
+		return -1;
+	}
+	if (m->severity >= MCED_SEV_FATAL
+	 && merge_status(&mask, &value, MCI_STATUS_PCC, MCI_STATUS_PCC) < 0) {
+		return -1;
+	}
+
+	m->status_mask = mask;
+	m->status_value = value;
+	if (mask) {
+		m->keys |= MCED_MATCH_STATUS;
+	} else {
+		m->keys &= ~MCED_MATCH_STATUS;
+	}
+	return 0;
+}
+
+/* the keys which the index does not cover */
+#define MATCH_REST_KEYS	(MCED_MATCH_CPU|MCED_MATCH_SOCKET|MCED_MATCH_VENDOR)
+
+static int
+match_rest(const struct mced_match *m, const struct mce *mce)
+{
+	if (!(m->keys & MATCH_REST_KEYS)) {
+		return 1;
+	}
+	if ((m->keys & MCED_MATCH_CPU)
+	 && !in_ranges(m->cpus, m->ncpus, mce->cpu)) {
+		return 0;
+	}
+	if ((m->keys & MCED_MATCH_SOCKET)
+	 && !in_ranges(m->sockets, m->nsockets, mce->socket)) {
+		return 0;
+	}
+	if (m->keys & MCED_MATCH_VENDOR) {
+		int v = mce->vendor + 1;
+		if (v < 0 || v > 63 || !(m->vendors & (1ULL << v))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int
+mced_match_mce(const struct mced_match *m, const struct mce *mce)
+{
+	if ((m->keys & MCED_MATCH_BANK)
+	 && !(m->banks[mce->bank >> 6] & (1ULL << (mce->bank & 63)))) {
+		return 0;
+	}
+	if ((m->keys & MCED_MATCH_STATUS)
+	 && (mce->mci_status & m->status_mask) != m->status_value) {
+		return 0;
+	}
+	return match_rest(m, mce);
+}
+
+/*
+ * The index.  Bitsets have one bit per match, in the order the matches
+ * were given.
+ */
+struct status_value {
+	uint64_t value;
+	uint64_t *set;		/* the matches which want this value */
+};
+struct status_group {
+	uint64_t mask;
+	struct status_value *values;	/* sorted by value */
+	int nvalues;
+};
+struct mced_match_index {
+	const struct mced_match **matches;
+	int n;
+	int nwords;
+	uint64_t *bank_sets;		/* a bitset for each of 256 banks */
+	uint64_t *any_status;		/* matches with no status predicate */
+	struct status_group *groups;	/* one per distinct status mask */
+	int ngroups;
+	uint64_t *scratch;
+};
+
+#define SET_BIT(set, i)	((set)[(i) >> 6] |= 1ULL << ((i) & 63))
+
+static struct status_group *
+find_group(struct mced_match_index *idx, uint64_t mask)
+{
+	struct status_group *g;
+	int i;
+
+	for (i = 0; i < idx->ngroups; i++) {
+		if (idx->groups[i].mask == mask) {
+			return &idx->groups[i];
+		}
+	}
+
+	g = realloc(idx->groups, (idx->ngroups + 1) * sizeof(*g));
+	if (!g) {
+		mced_perror(LOG_ERR, "ERR: realloc()");
+		return NULL;
+	}
+	idx->groups = g;
+	g = &idx->groups[idx->ngroups++];
+	g->mask = mask;
+	g->values = NULL;
+	g->nvalues = 0;
+	return g;
+}
+
+static struct status_value *
+find_value(struct mced_match_index *idx, struct status_group *g,
+           uint64_t value)
+{
+	struct status_value *v;
+	int i;
+
+	for (i = 0; i < g->nvalues; i++) {
+		if (g->values[i].value == value) {
+			return &g->values[i];
+		}
+	}
+
+	v = realloc(g->values, (g->nvalues + 1) * sizeof(*v));
+	if (!v) {
+		mced_perror(LOG_ERR, "ERR: realloc()");
+		return NULL;
+	}
+	g->values = v;
+	v = &g->values[g->nvalues];
+	v->value = value;
+	v->set = calloc(idx->nwords, sizeof(uint64_t));
+	if (!v->set) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	g->nvalues++;
+	return v;
+}
+
+static int
+cmp_status_value(const void *a, const void *b)
+{
+	const struct status_value *va = a;
+	const struct status_value *vb = b;
+
+	return (va->value > vb->value) - (va->value < vb->value);
+}
+
+struct mced_match_index *
+mced_match_index_build(const struct mced_match *const *matches, int n)
+{
+	struct mced_match_index *idx;
+	int i;
+	int b;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	idx->n = n;
+	idx->nwords = (n + 63) / 64;
+	if (idx->nwords == 0) {
+		idx->nwords = 1;
+	}
+
+	idx->matches = malloc((n ? n : 1) * sizeof(*idx->matches));
+	idx->bank_sets = calloc(256 * idx->nwords, sizeof(uint64_t));
+	idx->any_status = calloc(idx->nwords, sizeof(uint64_t));
+	idx->scratch = calloc(idx->nwords, sizeof(uint64_t));
+	if (!idx->matches || !idx->bank_sets || !idx->any_status
+	 || !idx->scratch) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct mced_match *m = matches[i];
+
+		idx->matches[i] = m;
+		for (b = 0; b < 256; b++) {
+			if (!(m->keys & MCED_MATCH_BANK)
+			 || (m->banks[b >> 6] & (1ULL << (b & 63)))) {
+				SET_BIT(idx->bank_sets + b * idx->nwords, i);
+			}
+		}
+
+		if (m->keys & MCED_MATCH_STATUS) {
+			struct status_group *g;
+			struct status_value *v;
+
+			g = find_group(idx, m->status_mask);
+			if (!g) {
+				goto fail;
+			}
+			v = find_value(idx, g, m->status_value);
+			if (!v) {
+				goto fail;
+			}
+			SET_BIT(v->set, i);
+		} else {
+			SET_BIT(idx->any_status, i);
+		}
+	}
+
+	for (i = 0; i < idx->ngroups; i++) {
+		qsort(idx->groups[i].values, idx->groups[i].nvalues,
+		      sizeof(struct status_value), cmp_status_value);
+	}
+
+	return idx;
+
+ fail:
+	mced_match_index_free(idx);
+	return NULL;
+}
+
+void
+mced_match_index_free(struct mced_match_index *idx)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < idx->ngroups; i++) {
+		for (j = 0; j < idx->groups[i].nvalues; j++) {
+			free(idx->groups[i].values[j].set);
+		}
+		free(idx->groups[i].values);
+	}
+	free(idx->groups);
+	free(idx->matches);
+	free(idx->bank_sets);
+	free(idx->any_status);
+	free(idx->scratch);
+	free(idx);
+}
+
+int
+mced_match_index_find(struct mced_match_index *idx, const struct mce *mce,
+                      int *hits)
+{
+	const uint64_t *bank_set;
+	uint64_t *cand = idx->scratch;
+	int nhits = 0;
+	int w;
+	int i;
+
+	/* the matches which allow this MCE's status */
+	memcpy(cand, idx->any_status, idx->nwords * sizeof(uint64_t));
+	for (i = 0; i < idx->ngroups; i++) {
+		const struct status_group *g = &idx->groups[i];
+		struct status_value key;
+		const struct status_value *v;
+
+		key.value = mce->mci_status & g->mask;
+		v = bsearch(&key, g->values, g->nvalues,
+		            sizeof(struct status_value), cmp_status_value);
+		if (v) {
+			for (w = 0; w < idx->nwords; w++) {
+				cand[w] |= v->set[w];
+			}
+		}
+	}
+
+	/* ...and its bank, and whatever else they ask for */
+	bank_set = idx->bank_sets + mce->bank * idx->nwords;
+	for (w = 0; w < idx->nwords; w++) {
+		uint64_t bits = cand[w] & bank_set[w];
+		while (bits) {
+			i = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if (match_rest(idx->matches[i], mce)) {
+				hits[nhits++] = i;
+			}
+		}
+	}
+
+	return nhits;
+}
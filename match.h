@@ -0,0 +1,91 @@
+#ifndef MCED_MATCH_H__
+#define MCED_MATCH_H__
+
+#include <stdint.h>
+
+#include "mced.h"
+
+/*
+ * Match predicates: which MCEs a rule cares about.
+ *
+ * Every key which is set must match, and a key given a list of values
+ * matches any one of them.  A match with no keys set matches every MCE.
+ */
+#define MCED_MATCH_BANK		0x01
+#define MCED_MATCH_CPU		0x02
+#define MCED_MATCH_SOCKET	0x04
+#define MCED_MATCH_VENDOR	0x08
+#define MCED_MATCH_STATUS	0x10
+
+/* an inclusive range of values */
+struct mced_range {
+	long long lo;
+	long long hi;
+};
+
+struct mced_match {
+	unsigned keys;			/* MCED_MATCH_* which are set */
+	uint64_t banks[4];		/* bitmap of banks 0-255 */
+	struct mced_range *cpus;
+	int ncpus;
+	struct mced_range *sockets;
+	int nsockets;
+	uint64_t vendors;		/* bitmap of (vendor + 1) */
+	uint64_t status_mask;		/* (mci_status & mask) == value */
+	uint64_t status_value;
+
+	/* parse state, resolved by mced_match_finish() */
+	uint64_t user_mask;
+	uint64_t user_value;
+	int user_value_set;
+	int uncorrected;		/* -1 if not given */
+	int severity;			/* MCED_SEV_*, or -1 if not given */
+};
+
+/* the severity of an MCE, from its status */
+enum {
+	MCED_SEV_CORRECTED = 0,
+	MCED_SEV_UNCORRECTED,		/* UC */
+	MCED_SEV_FATAL,			/* UC and PCC */
+};
+
+extern void mced_match_init(struct mced_match *m);
+extern void mced_match_free(struct mced_match *m);
+
+/*
+ * Set a match key from its string value.  Returns 0 on success, 1 if 'key'
+ * is not a match key, or -1 if 'val' is not valid for it.
+ */
+extern int mced_match_set(struct mced_match *m, const char *key,
+                          const char *val);
+
+/*
+ * Resolve the keys into their final form, once they are all set.  Returns
+ * 0 on success, or -1 if they contradict each other.
+ */
+extern int mced_match_finish(struct mced_match *m);
+
+/* does 'mce' match? */
+extern int mced_match_mce(const struct mced_match *m, const struct mce *mce);
+
+/*
+ * A dispatch index over a list of matches.  Each bank has a bitset of the
+ * matches which allow it, and the status predicates are grouped by mask,
+ * so finding the matches for an MCE costs one bitset AND plus one lookup
+ * per distinct mask, and only the survivors are checked in full.
+ */
+struct mced_match_index;
+
+/* the matches must outlive the index */
+extern struct mced_match_index *
+mced_match_index_build(const struct mced_match *const *matches, int n);
+extern void mced_match_index_free(struct mced_match_index *idx);
+
+/*
+ * Find the matches for 'mce'.  Their positions are stored in 'hits' (which
+ * must have room for every match), in order, and the number is returned.
+ */
+extern int mced_match_index_find(struct mced_match_index *idx,
+                                 const struct mce *mce, int *hits);
+
+#endif  /* MCED_MATCH_H__ */
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <endian.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -36,10 +37,15 @@
 #include <ctype.h>
 #include <time.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <grp.h>
 #include <signal.h>
+#include <stdatomic.h>
 
 #include "mced.h"
+#include "fields.h"
 #include "util.h"
 #include "cmdline.h"
 #include "ud_socket.h"
@@ -55,6 +61,11 @@ static cmdline_string socketfile = NULL;
 static cmdline_int max_events = -1;
 static cmdline_int time_limit = -1;
 static cmdline_bool use_v1_socket = 0;
+static cmdline_bool use_v3_socket = 0;
+static cmdline_bool use_shm = 0;
+static cmdline_string query = NULL;
+static cmdline_int resume = -1;
+static cmdline_string filter = NULL;
 
 #if ENABLE_DBUS
 static cmdline_bool use_dbus = 0;
@@ -79,6 +90,31 @@ static struct cmdline_opt cmdline_opts[] = {
 		CMDLINE_OPT_BOOL, &use_v1_socket,
 		"", "Make socket behavior compatible with mced v1.x"
 	},
+	{
+		"B", "binary",
+		CMDLINE_OPT_BOOL, &use_v3_socket,
+		"", "Use the binary (v3) socket protocol"
+	},
+	{
+		NULL, "shm",
+		CMDLINE_OPT_BOOL, &use_shm,
+		"", "Read events from mced's shared-memory ring"
+	},
+	{
+		"q", "query",
+		CMDLINE_OPT_STRING, &query,
+		"<predicates>", "Query mced's database instead of listening"
+	},
+	{
+		"r", "resume",
+		CMDLINE_OPT_INT, &resume,
+		"<seq>", "Replay events from the given sequence number on"
+	},
+	{
+		"F", "filter",
+		CMDLINE_OPT_STRING, &filter,
+		"<predicates>", "Only receive events which match"
+	},
 	{
 		"t", "time",
 		CMDLINE_OPT_INT, &time_limit,
@@ -148,9 +184,26 @@ handle_cmdline(int *argc, const char ***argv)
 	if (time_limit > 0) {
 		alarm(time_limit);
 	}
+	if ((query || resume >= 0) && use_shm) {
+		fprintf(stderr, "--query and --resume can't be used "
+		        "with --shm\n");
+		exit(EXIT_FAILURE);
+	}
+	if (query && resume >= 0) {
+		fprintf(stderr, "--query and --resume can't be used "
+		        "together\n");
+		exit(EXIT_FAILURE);
+	}
+	if (filter && (query || use_shm || use_v1_socket || use_v3_socket)) {
+		fprintf(stderr, "--filter can only be used with the normal "
+		        "socket, and not with --query\n");
+		exit(EXIT_FAILURE);
+	}
 	if (socketfile == NULL) {
 		if (use_v1_socket) {
 			socketfile = MCED_SOCKETFILE_V1;
+		} else if (use_v3_socket) {
+			socketfile = MCED_SOCKETFILE_V3;
 		} else {
 			socketfile = MCED_SOCKETFILE_V2;
 		}
@@ -173,11 +226,271 @@ do_version(const struct cmdline_opt *opt __attribute__((unused)), ...)
 	exit(EXIT_SUCCESS);
 }
 
+/*
+ * Read exactly 'len' bytes.  Returns 0 on success, or -1 with errno set
+ * (EPIPE for EOF).
+ */
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			return -1;
+		} else if (r == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* decode a v3 record of 'rec_size' bytes */
+static void
+v3_to_mce(const void *buf, size_t rec_size, struct mce *mce)
+{
+	struct mce_v3_record rec;
+
+	/* fields this version doesn't know about are skipped */
+	memset(&rec, 0, sizeof(rec));
+	if (rec_size > sizeof(rec)) {
+		rec_size = sizeof(rec);
+	}
+	memcpy(&rec, buf, rec_size);
+	mced_v3_to_mce(&rec, mce);
+}
+
+/* print an MCE the same way the v2 socket does */
+static void
+print_mce(const struct mce *mce)
+{
+	char line[MCE_V2_MSG_MAX + 1];
+
+	mced_format_v2(mce, line);
+	fputs(line, stdout);
+}
+
+/*
+ * Read one v3 frame and print its records.  Returns 0 when the event
+ * count is reached, 1 to keep going, or -1 on error.
+ */
+static int
+read_v3_frame(int sock_fd)
+{
+	struct mce_v3_header hdr;
+	size_t hdr_size;
+	size_t rec_size;
+	uint32_t count;
+	unsigned flags;
+	static int resumed;
+	static char *buf;
+	static size_t buf_size;
+	uint32_t i;
+
+	if (read_full(sock_fd, &hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+	if (le32toh(hdr.magic) != MCE_V3_MAGIC) {
+		fprintf(stderr, "bad frame magic 0x%08x\n",
+		        (unsigned)le32toh(hdr.magic));
+		errno = EPROTO;
+		return -1;
+	}
+	hdr_size = le16toh(hdr.hdr_size);
+	rec_size = le16toh(hdr.rec_size);
+	count = le32toh(hdr.count);
+	flags = le16toh(hdr.flags);
+	if (hdr_size < sizeof(hdr) || rec_size == 0) {
+		fprintf(stderr, "bad frame header\n");
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* skip any header fields we don't know about */
+	if (hdr_size + rec_size * count - sizeof(hdr) > buf_size) {
+		char *new_buf;
+		size_t new_size = hdr_size + rec_size * count - sizeof(hdr);
+		new_buf = realloc(buf, new_size);
+		if (!new_buf) {
+			return -1;
+		}
+		buf = new_buf;
+		buf_size = new_size;
+	}
+	if (read_full(sock_fd, buf, hdr_size - sizeof(hdr)) < 0
+	 || read_full(sock_fd, buf, rec_size * count) < 0) {
+		return -1;
+	}
+
+	/* live MCEs sent before our query started are not results */
+	if (query && !(flags & MCE_V3_F_QUERY)) {
+		return 1;
+	}
+	/* and any sent before the replay started are repeated in it */
+	if (flags & MCE_V3_F_RESUME) {
+		resumed = 1;
+		return 1;
+	}
+	if (resume >= 0 && !resumed) {
+		return 1;
+	}
+
+	if (flags & MCE_V3_F_GAP) {
+		for (i = 0; i < count; i++) {
+			struct mce_v3_gap gap;
+			memset(&gap, 0, sizeof(gap));
+			memcpy(&gap, buf + i * rec_size,
+			       (rec_size < sizeof(gap)) ? rec_size : sizeof(gap));
+			printf("gap %llu %llu\n",
+			       (unsigned long long)le64toh(gap.first),
+			       (unsigned long long)le64toh(gap.count));
+		}
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct mce mce;
+
+		v3_to_mce(buf + i * rec_size, rec_size, &mce);
+		print_mce(&mce);
+		if (max_events > 0 && --max_events == 0) {
+			return 0;
+		}
+	}
+
+	if (flags & MCE_V3_F_ERROR) {
+		fprintf(stderr, "%s: query failed\n", cmdline_progname);
+		exit(EXIT_FAILURE);
+	}
+	return (flags & MCE_V3_F_END) ? 0 : 1;
+}
+
+/* map the shared event ring and read events from it until done */
+static int
+shm_client(int sock_fd)
+{
+	char buf[64];
+	int shm_fd = -1;
+	struct stat st;
+	struct mce_shm_header *hdr;
+	const char *slots;
+	uint64_t next;
+
+	/* ask for the ring, and skip any events sent before the answer */
+	if (write(sock_fd, "shm\n", 4) != 4) {
+		fprintf(stderr, "can't request event ring: %s\n",
+		        strerror(errno));
+		return 1;
+	}
+	while (shm_fd < 0) {
+		int r = ud_recv_fd(sock_fd, buf, sizeof(buf), &shm_fd);
+		if (r <= 0) {
+			fprintf(stderr, "no event ring from mced\n");
+			return 1;
+		}
+	}
+
+	if (fstat(shm_fd, &st) < 0) {
+		fprintf(stderr, "fstat(): %s\n", strerror(errno));
+		return 1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, shm_fd, 0);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "mmap(): %s\n", strerror(errno));
+		return 1;
+	}
+	close(shm_fd);
+	if (hdr->magic != MCE_SHM_MAGIC || hdr->version != MCE_SHM_VERSION
+	 || (size_t)st.st_size < hdr->slots_offset
+	                         + (size_t)hdr->nslots * hdr->slot_size) {
+		fprintf(stderr, "bad event ring header\n");
+		return 1;
+	}
+	slots = (const char *)hdr + hdr->slots_offset;
+
+	/* start with whatever is published next */
+	next = atomic_load_explicit(&hdr->head, memory_order_acquire);
+	while (1) {
+		uint32_t futex = atomic_load_explicit(&hdr->futex,
+		                                      memory_order_acquire);
+		uint64_t head = atomic_load_explicit(&hdr->head,
+		                                     memory_order_acquire);
+
+		if (next == head) {
+			/* the kernel re-checks the value, so no wakeup is lost */
+			syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futex,
+			        NULL, NULL, 0);
+			continue;
+		}
+		if (head - next > hdr->nslots) {
+			fprintf(stderr, "lost %llu events\n",
+			        (unsigned long long)(head - next - hdr->nslots));
+			next = head - hdr->nslots;
+		}
+
+		while (next != head) {
+			const struct mce_shm_slot *slot;
+			char rec[sizeof(struct mce_v3_record)];
+			uint64_t seq;
+			struct mce mce;
+
+			slot = (const struct mce_shm_slot *)(slots
+			       + (size_t)(next % hdr->nslots) * hdr->slot_size);
+			seq = atomic_load_explicit(&slot->seq,
+			                           memory_order_acquire);
+			memcpy(rec, (const char *)&slot->rec, sizeof(rec));
+			atomic_thread_fence(memory_order_acquire);
+			if (seq != next + 1 || atomic_load_explicit(&slot->seq,
+			                memory_order_relaxed) != seq) {
+				/* overwritten while we looked */
+				fprintf(stderr, "lost 1 event\n");
+				next++;
+				continue;
+			}
+			next++;
+
+			v3_to_mce(rec, hdr->rec_size, &mce);
+			print_mce(&mce);
+			if (max_events > 0 && --max_events == 0) {
+				return 0;
+			}
+		}
+	}
+}
+
+/* send mced a command line */
+static void
+send_command(int sock_fd, const char *name, const char *args)
+{
+	char cmd[256];
+	size_t len;
+
+	len = snprintf(cmd, sizeof(cmd), "%s %s\n", name, args);
+	if (len >= sizeof(cmd)) {
+		fprintf(stderr, "%s: %s is too long\n",
+		        cmdline_progname, name);
+		exit(EXIT_FAILURE);
+	}
+	if (write(sock_fd, cmd, len) != (ssize_t)len) {
+		fprintf(stderr, "%s: can't send command: %s\n",
+		        cmdline_progname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
 static int
 socket_client(void)
 {
 	int sock_fd;
 	int ret;
+	int in_results;
+	int filtered;
 
 	/* open the socket */
 	sock_fd = ud_connect(socketfile);
@@ -195,14 +508,70 @@ socket_client(void)
 	/* set stdout to be line buffered */
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
+	/* events come from shared memory, the socket just holds our place */
+	if (use_shm) {
+		return shm_client(sock_fd);
+	}
+
+	/* have mced filter what it sends, before any replay */
+	if (filter) {
+		send_command(sock_fd, "filter", filter);
+	}
+
+	/* ask for the matching MCEs from the database, or a replay */
+	if (query) {
+		send_command(sock_fd, "query", query);
+	} else if (resume >= 0) {
+		char seq[32];
+		snprintf(seq, sizeof(seq), "%lld", resume);
+		send_command(sock_fd, "resume", seq);
+	}
+
+	/* binary frames carry any number of events */
+	if (use_v3_socket) {
+		while ((ret = read_v3_frame(sock_fd)) > 0) {
+			continue;
+		}
+		if (ret < 0 && errno == EPIPE) {
+			fprintf(stderr, "connection closed\n");
+		} else if (ret < 0) {
+			fprintf(stderr, "read error: %s\n", strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+
 	/* main loop */
 	ret = 0;
+	in_results = 0;
+	filtered = 0;
 	while (1) {
 		char *event;
 
 		/* read and handle an event */
 		event = read_line(sock_fd);
-		if (event) {
+		if (event && (!strcmp(event, "error query")
+		           || !strcmp(event, "error resume")
+		           || !strcmp(event, "error filter"))) {
+			fprintf(stderr, "%s: %s failed\n", cmdline_progname,
+			        event + 6);
+			ret = 1;
+			break;
+		} else if (event && filter && !filtered) {
+			/* skip MCEs sent before the filter was set */
+			filtered = !strcmp(event, "filter");
+			continue;
+		} else if (event && query && !in_results) {
+			/* skip live MCEs sent before our query started */
+			in_results = !strcmp(event, "begin query");
+			continue;
+		} else if (event && resume >= 0 && !in_results) {
+			/* and those sent before the replay, which repeats them */
+			in_results = !strncmp(event, "resume ", 7);
+			continue;
+		} else if (event && query && !strncmp(event, "end query", 9)) {
+			break;
+		} else if (event) {
 			fprintf(stdout, "%s\n", event);
 		} else if (errno == EPIPE) {
 			fprintf(stderr, "connection closed\n");
@@ -40,10 +40,18 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <sys/ioctl.h>
-#include <sys/utsname.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "mced.h"
 #include "cmdline.h"
+#include "ring.h"
+#include "kmce.h"
 #if ENABLE_MCEDB
 #include "mcedb.h"
 #endif
@@ -61,20 +69,38 @@ int mced_log_events;
 /* the number of non-root clients that are connected */
 int mced_non_root_clients;
 
-/* the size of a kernel MCE record in bytes */
-size_t mced_kernel_record_len;
+/* the most bytes we will queue for a slow client */
+size_t mced_client_queue_len;
 
-/* how many bytes of kernel record to copy */
-size_t mced_copy_len;
+/* what to do when a client's queue is full (enum client_overflow) */
+int mced_client_overflow;
 
-/* how many bytes of mce structure to zero, if kernel record is smaller */
-size_t mced_zero_len;
+/* the number of MCEs in the shared event ring */
+int mced_shm_slots;
+
+/* the size of a kernel MCE record in bytes */
+size_t mced_kernel_record_len;
 
 #if ENABLE_MCEDB
 /* global database handle */
 struct mce_database *mced_db;
 #endif
 
+/* the sequence number for the next MCE */
+uint64_t mced_next_seq = 1;
+
+/* per-sink rate limits */
+struct mced_tbucket mced_cmd_limit;
+struct mced_tbucket mced_client_limit;
+struct mced_tbucket mced_shm_limit;
+
+/* a rate limit option, "mces_per_second[:burst]" */
+struct rate_limit_opt {
+	cmdline_string arg;
+	long long rate;		/* -1 for no limit */
+	long long burst;
+};
+
 /* statics */
 static const char *progname;
 static cmdline_int bootnum = -1;
@@ -84,9 +110,15 @@ static cmdline_string confdir = MCED_CONFDIR;
 static cmdline_string device = MCED_EVENTFILE;
 static cmdline_int max_interval_ms = MCED_MAX_INTERVAL;
 static cmdline_int min_interval_ms = MCED_MIN_INTERVAL;
-static cmdline_int mce_rate_limit = -1;
+static struct rate_limit_opt mce_rate_limit;
+static cmdline_int rate_burst = 1;
+static struct rate_limit_opt cmd_rate_limit;
+static struct rate_limit_opt client_rate_limit;
+static struct rate_limit_opt shm_rate_limit;
+static cmdline_int coalesce_ms = 0;
 static cmdline_string socketfile = MCED_SOCKETFILE_V2;
 static cmdline_string socketfile_compat = NULL;
+static cmdline_string socketfile_bin = NULL;
 static cmdline_bool nosocket = 0;
 static cmdline_string socketgroup = NULL;
 static cmdline_mode_t socketmode = MCED_SOCKETMODE;
@@ -95,21 +127,127 @@ static cmdline_string pidfile = MCED_PIDFILE;
 static cmdline_int clientmax = MCED_CLIENTMAX;
 static cmdline_int overflow_suppress_time = MCED_OVERFLOW_SUPPRESS_TIME;
 static cmdline_bool retry_mcelog = 0;
+static cmdline_bool mlock_ingest = 0;
+static cmdline_int ring_size = MCED_RING_SIZE;
+static cmdline_int max_handlers = MCED_MAX_HANDLERS;
+static cmdline_int handler_queue = MCED_HANDLER_QUEUE;
+static cmdline_int client_queue = MCED_CLIENT_QUEUE;
+static cmdline_string client_overflow = "drop-oldest";
+static cmdline_int shm_slots = MCED_SHM_SLOTS;
+static cmdline_int retain_len = MCED_RETAIN;
 #if ENABLE_MCEDB
 static cmdline_string dbdir = MCED_DBDIR;
+static cmdline_int db_sync_ms = MCED_DB_SYNC_MS;
 #endif
 #if ENABLE_DBUS
 static cmdline_bool no_dbus = 0;
 static cmdline_bool use_session_dbus = 0;
+static struct rate_limit_opt dbus_rate_limit;
 #endif
 static int mcelog_poll_works = 0;
 static int log_is_open = 0;
 static int fake_dev_mcelog = 0;
-static enum {
-	KERNEL_MCE_UNKNOWN = 0,
-	KERNEL_MCE_V1,   /* the historical 'struct mce' layout */
-	KERNEL_MCE_V2,   /* 2.6.31 made 'struct mce' changes */
-} kernel_mce_version;
+/* the number of records the kernel log holds, read when it is opened */
+static int kernel_loglen;
+
+/*
+ * Everything one read of /dev/mcelog needs.  It is allocated when the
+ * device is opened, so draining it allocates nothing.
+ */
+static struct {
+	uint8_t *raw;		/* the records, as read */
+	size_t size;		/* bytes in 'raw' */
+	struct kmce_batch batch;	/* and their columns */
+} ingest_buf;
+
+/*
+ * The ingest thread drains /dev/mcelog into these rings, and the main
+ * thread dispatches from them.  Urgent MCEs have a ring of their own, which
+ * is always drained first.  The eventfd wakes the main thread.
+ */
+static struct mce_ring ingest_ring;
+static struct mce_ring urgent_ring;
+static int ingest_eventfd = -1;
+static atomic_int ingest_eof;
+/* MCEs lost before they reached the ingest ring */
+static atomic_ullong ingest_lost;
+static pthread_t ingest_thread;
+static int ingest_running;
+/* the main thread asks the ingest thread to finish with this eventfd */
+static int ingest_stop_fd = -1;
+static atomic_int ingest_stopping;
+/* the fake mcelog device's writer has gone away */
+static int fake_dev_closed;
+
+/*
+ * The ingest thread's scheduler.  It keeps a moving average of the MCE
+ * arrival rate, and wakes up often enough that the kernel's log should be
+ * no more than half full when it is read.  The counters are for stats.
+ */
+#define SCHED_RATE_TAU		1.0	/* secs the rate average spans */
+#define SCHED_TARGET_FILL	50	/* percent of the kernel log */
+#define SCHED_MAX_READS		64	/* reads per wakeup, at most */
+static struct {
+	struct timespec last;		/* when we last looked */
+	double rate;			/* MCEs per second */
+} sched;
+static struct {
+	atomic_int interval_ms;		/* the current wakeup interval */
+	atomic_int loglen;		/* records the kernel log holds */
+	atomic_ullong rate;		/* MCEs per 100 secs */
+	atomic_uint fill;		/* percent full, at the last read */
+	atomic_uint peak_fill;		/* ...and at the fullest read */
+	atomic_ullong reads;		/* reads which found MCEs */
+	atomic_ullong empty_reads;	/* ...and which found none */
+	atomic_ullong drains;		/* times the log was read until empty */
+	atomic_ullong wakeups;		/* returns from epoll_wait() */
+	atomic_ullong idle_wakeups;	/* wakeups which found none */
+} sched_stats;
+
+/*
+ * The main loop waits on a single epoll instance.  Signals are blocked and
+ * read from a signalfd, so their handlers run in the main loop like
+ * everything else.
+ */
+static int epoll_fd = -1;
+static struct mced_watcher signal_watch;
+static struct mced_watcher ingest_watch;
+
+/*
+ * The global rate limit.  MCEs over the limit wait in the ingest ring,
+ * and a timer resumes draining it when the next token is due.
+ */
+static struct mced_tbucket ingest_limit;
+static struct mced_watcher limit_watch;
+static int limit_armed;
+static unsigned long long limit_pauses;
+#if ENABLE_DBUS
+static struct mced_tbucket dbus_limit;
+#endif
+
+/*
+ * Repeats of a corrected MCE are coalesced into a summary, which is
+ * handled when this timer says its window has closed.
+ */
+static struct mced_watcher coalesce_watch;
+static int coalesce_armed;
+static struct mced_watcher sock_watch;
+static struct mced_watcher compat_sock_watch;
+static struct mced_watcher bin_sock_watch;
+static int main_loop_done;
+static unsigned long long main_wakeups;
+
+#if ENABLE_MCEDB
+/*
+ * Database appends are made durable once per drain of the ingest ring,
+ * but no more often than every --dbsync msecs.  A sync which is held back
+ * is done when this timer fires.
+ */
+static struct mced_watcher db_sync_watch;
+static struct timespec db_last_sync;
+static int db_sync_armed;
+#endif
+#define MCED_MAX_EVENTS		64
 
 /*
  * Helpers
@@ -117,6 +255,11 @@ static enum {
 
 static void do_help(const struct cmdline_opt *, ...);
 static void do_version(const struct cmdline_opt *, ...);
+static void stop_ingest(void);
+static void drain_ingested_mces(void);
+#if ENABLE_MCEDB
+static void db_commit(void);
+#endif
 static struct cmdline_opt mced_opts[] = {
 	#if ENABLE_MCEDB
 	{
@@ -124,6 +267,11 @@ static struct cmdline_opt mced_opts[] = {
 		CMDLINE_OPT_STRING, &dbdir,
 		"<dir>", "Set the database directory"
 	},
+	{
+		NULL, "dbsync",
+		CMDLINE_OPT_INT, &db_sync_ms,
+		"<num>", "Set the minimum time between database syncs (in msecs)"
+	},
 	#endif  /* ENABLE_MCEDB */
 	{
 		"d", "debug",
@@ -177,8 +325,58 @@ static struct cmdline_opt mced_opts[] = {
 	},
 	{
 		"r", "ratelimit",
-		CMDLINE_OPT_INT, &mce_rate_limit,
-		"<num>", "Limit the number of MCEs handled per second"
+		CMDLINE_OPT_STRING, &mce_rate_limit.arg,
+		"<num>[:<burst>]", "Limit the number of MCEs handled per second"
+	},
+	{
+		NULL, "rateburst",
+		CMDLINE_OPT_INT, &rate_burst,
+		"<num>", "Allow bursts of this many MCEs over the rate limits "
+		         "which do not set their own"
+	},
+	{
+		NULL, "cmdratelimit",
+		CMDLINE_OPT_STRING, &cmd_rate_limit.arg,
+		"<num>[:<burst>]",
+		"Limit the MCEs per second which run rule actions"
+	},
+	{
+		NULL, "clientratelimit",
+		CMDLINE_OPT_STRING, &client_rate_limit.arg,
+		"<num>[:<burst>]",
+		"Limit the MCEs per second sent to socket clients"
+	},
+	{
+		NULL, "shmratelimit",
+		CMDLINE_OPT_STRING, &shm_rate_limit.arg,
+		"<num>[:<burst>]",
+		"Limit the MCEs per second published in shared memory"
+	},
+	{
+		NULL, "coalesce",
+		CMDLINE_OPT_INT, &coalesce_ms,
+		"<num>", "Summarize repeated corrected MCEs over this window "
+		         "(in msecs)"
+	},
+	{
+		NULL, "ringsize",
+		CMDLINE_OPT_INT, &ring_size,
+		"<num>", "Set the number of MCEs buffered between threads"
+	},
+	{
+		NULL, "mlock",
+		CMDLINE_OPT_BOOL, &mlock_ingest,
+		"", "Lock the ingest buffers into memory"
+	},
+	{
+		NULL, "maxhandlers",
+		CMDLINE_OPT_INT, &max_handlers,
+		"<num>", "Limit the number of concurrently running actions"
+	},
+	{
+		NULL, "handlerqueue",
+		CMDLINE_OPT_INT, &handler_queue,
+		"<num>", "Limit the number of actions waiting to run"
 	},
 	{
 		"o", "oflowsuppress",
@@ -210,11 +408,36 @@ static struct cmdline_opt mced_opts[] = {
 		CMDLINE_OPT_INT, &clientmax,
 		"<num>", "Limit the number of non-root socket clients"
 	},
+	{
+		NULL, "clientqueue",
+		CMDLINE_OPT_INT, &client_queue,
+		"<bytes>", "Limit the output queued for each socket client"
+	},
+	{
+		NULL, "clientoverflow",
+		CMDLINE_OPT_STRING, &client_overflow,
+		"<policy>", "drop-oldest, drop-newest or disconnect"
+	},
+	{
+		NULL, "shmslots",
+		CMDLINE_OPT_INT, &shm_slots,
+		"<num>", "Set the number of MCEs in the shared event ring"
+	},
+	{
+		NULL, "retain",
+		CMDLINE_OPT_INT, &retain_len,
+		"<num>", "Set the number of recent MCEs kept for clients to resume"
+	},
 	{
 		"O", "oldsocket",
 		CMDLINE_OPT_STRING, &socketfile_compat,
 		"", "Use the specified v1-compatible socket file"
 	},
+	{
+		NULL, "binsocket",
+		CMDLINE_OPT_STRING, &socketfile_bin,
+		"<file>", "Also send binary (v3) records on the specified socket"
+	},
 	#if ENABLE_DBUS
 	{
 		NULL, "no-dbus",
@@ -226,6 +449,11 @@ static struct cmdline_opt mced_opts[] = {
 		CMDLINE_OPT_BOOL, &use_session_dbus,
 		"", "Use D-Bus session bus, instead of system bus"
 	},
+	{
+		NULL, "dbusratelimit",
+		CMDLINE_OPT_STRING, &dbus_rate_limit.arg,
+		"<num>[:<burst>]", "Limit the MCEs per second sent over D-Bus"
+	},
 	#endif
 	{
 		"v", "version",
@@ -255,6 +483,41 @@ usage(FILE *out)
 	fprintf(out, "\n");
 }
 
+/*
+ * Parse a rate limit option.  A rate of 0 or less, or none at all, is no
+ * limit, and a rate without a burst gets --rateburst.
+ */
+static int
+parse_rate_limit(const char *name, struct rate_limit_opt *opt)
+{
+	const char *p = opt->arg;
+	char *end;
+
+	opt->rate = -1;
+	opt->burst = rate_burst;
+	if (!p) {
+		return 0;
+	}
+	errno = 0;
+	opt->rate = strtoll(p, &end, 10);
+	if (end != p && !errno && *end == ':') {
+		p = end + 1;
+		opt->burst = strtoll(p, &end, 10);
+		if (opt->burst < 1) {
+			end = (char *)p;
+		}
+	}
+	if (end == p || errno || *end) {
+		fprintf(stderr, "Invalid rate limit for --%s: '%s'\n\n",
+		        name, opt->arg);
+		return -1;
+	}
+	if (opt->rate <= 0) {
+		opt->rate = -1;
+	}
+	return 0;
+}
+
 /*
  * Parse command line arguments.
  */
@@ -290,15 +553,71 @@ handle_cmdline(int *argc, const char ***argv)
 	if (clientmax < 0) {
 		clientmax = 0;
 	}
+	if (client_queue < 0) {
+		client_queue = 0;
+	}
+	mced_client_queue_len = client_queue;
+	if (!strcmp(client_overflow, "drop-oldest")) {
+		mced_client_overflow = CLIENT_OVERFLOW_DROP_OLDEST;
+	} else if (!strcmp(client_overflow, "drop-newest")) {
+		mced_client_overflow = CLIENT_OVERFLOW_DROP_NEWEST;
+	} else if (!strcmp(client_overflow, "disconnect")) {
+		mced_client_overflow = CLIENT_OVERFLOW_DISCONNECT;
+	} else {
+		fprintf(stderr, "Unknown client overflow policy: '%s'\n\n",
+		        client_overflow);
+		usage(stderr);
+		exit(EXIT_FAILURE);
+	}
 	if (overflow_suppress_time < 0) {
 		overflow_suppress_time = 0;
 	}
-	if (mce_rate_limit <= 0) {
-		mce_rate_limit = -1;
+	if (rate_burst < 1) {
+		rate_burst = 1;
+	}
+	if (parse_rate_limit("ratelimit", &mce_rate_limit) < 0
+	 || parse_rate_limit("cmdratelimit", &cmd_rate_limit) < 0
+	 || parse_rate_limit("clientratelimit", &client_rate_limit) < 0
+	 || parse_rate_limit("shmratelimit", &shm_rate_limit) < 0) {
+		usage(stderr);
+		exit(EXIT_FAILURE);
+	}
+	#if ENABLE_DBUS
+	if (parse_rate_limit("dbusratelimit", &dbus_rate_limit) < 0) {
+		usage(stderr);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+	if (ring_size <= 0) {
+		ring_size = MCED_RING_SIZE;
+	}
+	if (max_handlers <= 0) {
+		max_handlers = 1;
+	}
+	if (handler_queue < 0) {
+		handler_queue = 0;
+	}
+	#if ENABLE_MCEDB
+	if (db_sync_ms < 0) {
+		db_sync_ms = 0;
+	}
+	#endif
+	if (shm_slots <= 0) {
+		shm_slots = 1;
+	}
+	mced_shm_slots = shm_slots;
+	if (retain_len < 0) {
+		retain_len = 0;
+	}
+	if (coalesce_ms < 0) {
+		coalesce_ms = 0;
 	}
 	if (socketfile_compat && socketfile_compat[0] == '\0') {
 		socketfile_compat = MCED_SOCKETFILE_V1;
 	}
+	if (socketfile_bin && socketfile_bin[0] == '\0') {
+		socketfile_bin = MCED_SOCKETFILE_V3;
+	}
 
 	return 0;
 }
@@ -435,6 +754,15 @@ create_pidfile(void)
 static void
 clean_exit_with_status(int status)
 {
+	/* the MCEs already read from the kernel are not lost */
+	stop_ingest();
+	drain_ingested_mces();
+	/* nor are the repeats counted so far */
+	mced_coalesce_flush();
+	mced_flush_clients();
+	#if ENABLE_MCEDB
+	db_commit();
+	#endif
 	mced_cleanup_rules(1);
 	#if ENABLE_MCEDB
 	mcedb_close(mced_db);
@@ -452,13 +780,12 @@ clean_exit(int sig)
 }
 
 static void
-clean_exit_with_killer(int signum, siginfo_t *siginfo,
-                       void __attribute__((unused)) *context) {
+clean_exit_with_killer(int signum, pid_t killer) {
 	char fname[255];
 	char cmdline[1023];
 	int cmdline_success = 0;
 	mced_log(LOG_NOTICE, "caught signal %d\n", signum);
-	snprintf(fname, sizeof(fname)-1, "/proc/%u/cmdline", siginfo->si_pid);
+	snprintf(fname, sizeof(fname)-1, "/proc/%u/cmdline", (unsigned)killer);
 	FILE *cmdline_file = fopen(fname, "r");
 
 	if (cmdline_file) {
@@ -472,25 +799,81 @@ clean_exit_with_killer(int signum, siginfo_t *siginfo,
 		mced_log(
 			LOG_NOTICE,
 			"killed by process with pid %u and command line %.1022s\n",
-			siginfo->si_pid,
+			(unsigned)killer,
 			cmdline);
 	} else {
 		mced_log(
 			LOG_NOTICE,
 			"killed by process with pid %u and unknown command line\n",
-			siginfo->si_pid);
+			(unsigned)killer);
 	}
 	clean_exit_with_status(EXIT_SUCCESS);
 }
 
 static void
-reload_conf(int sig __attribute__((unused)))
+reload_conf(void)
 {
 	mced_log(LOG_NOTICE, "reloading configuration\n");
 	mced_cleanup_rules(0);
 	mced_read_conf(confdir);
 }
 
+/* log our internal counters */
+static void
+dump_stats(void)
+{
+	struct mce_ring_stats rs;
+	char interval[16];
+	int interval_ms;
+
+	mce_ring_get_stats(&ingest_ring, &rs);
+	mced_log(LOG_INFO,
+	         "ingest ring: size=%zu depth=%zu high_water=%zu "
+	         "pushed=%llu drops=%llu\n",
+	         rs.size, rs.depth, rs.high_water, rs.pushed, rs.drops);
+	interval_ms = atomic_load(&sched_stats.interval_ms);
+	if (interval_ms < 0) {
+		strcpy(interval, "none");
+	} else {
+		snprintf(interval, sizeof(interval), "%dms", interval_ms);
+	}
+	mced_log(LOG_INFO,
+	         "ingest scheduler: interval=%s rate=%llu.%02llu/s "
+	         "loglen=%d fill=%u%% peak_fill=%u%% reads=%llu "
+	         "empty_reads=%llu drains=%llu idle_wakeups=%llu\n",
+	         interval,
+	         atomic_load(&sched_stats.rate) / 100,
+	         atomic_load(&sched_stats.rate) % 100,
+	         atomic_load(&sched_stats.loglen),
+	         atomic_load(&sched_stats.fill),
+	         atomic_load(&sched_stats.peak_fill),
+	         atomic_load(&sched_stats.reads),
+	         atomic_load(&sched_stats.empty_reads),
+	         atomic_load(&sched_stats.drains),
+	         atomic_load(&sched_stats.idle_wakeups));
+	mced_log(LOG_INFO, "wakeups: main=%llu ingest=%llu\n",
+	         main_wakeups, atomic_load(&sched_stats.wakeups));
+	mce_ring_get_stats(&urgent_ring, &rs);
+	mced_log(LOG_INFO,
+	         "urgent ring: size=%zu depth=%zu high_water=%zu "
+	         "pushed=%llu drops=%llu\n",
+	         rs.size, rs.depth, rs.high_water, rs.pushed, rs.drops);
+	mced_log(LOG_INFO,
+	         "rate limits: pauses=%llu command_drops=%llu "
+	         "client_drops=%llu shm_drops=%llu\n",
+	         limit_pauses, mced_cmd_limit.limited,
+	         mced_client_limit.limited, mced_shm_limit.limited);
+	#if ENABLE_DBUS
+	mced_log(LOG_INFO, "rate limits: dbus_drops=%llu\n",
+	         dbus_limit.limited);
+	#endif
+	mced_dump_coalesce_stats();
+	mced_dump_rule_stats();
+	mced_dump_handler_stats();
+	mced_dump_client_stats();
+	mced_dump_shm_stats();
+}
+
 static int
 mced_vlog(int level, const char *fmt, va_list args)
 {
@@ -538,6 +921,52 @@ mced_perror(int level, const char *str)
 	return mced_log(level, "%s: %s\n", str, strerror(errno));
 }
 
+/* start waiting for events on a watcher's fd */
+int
+mced_watch(struct mced_watcher *w, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_ctl(ADD)");
+		return -1;
+	}
+	return 0;
+}
+
+/* change the events we wait for */
+int
+mced_rewatch(struct mced_watcher *w, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_ctl(MOD)");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop waiting on a watcher.  This must be done before closing the fd, as
+ * a forked child may briefly share it and keep it registered.
+ */
+void
+mced_unwatch(struct mced_watcher *w)
+{
+	/* old kernels want a non-NULL event, even for a delete */
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if (w->fd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, &ev);
+	}
+}
+
 static int
 open_socket(const char *path, mode_t mode, const char *group)
 {
@@ -577,54 +1006,8 @@ open_socket(const char *path, mode_t mode, const char *group)
 	return sock_fd;
 }
 
-/* convert a kernel MCE struct to our MCE struct */
-static void
-kmce_to_mce(struct kernel_mce *kmce, struct mce *mce)
-{
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-
-	/* common fields for all versions of 'struct kernel_mce' */
-	mce->boot = bootnum;
-	mce->bank = kmce->bank;
-	mce->mci_status = kmce->status;
-	mce->mci_address = kmce->addr;
-	mce->mci_misc = kmce->misc;
-	mce->mci_synd = kmce->synd;
-	mce->mci_ipid = kmce->ipid;
-	mce->mcg_status = kmce->mcgstatus;
-	mce->tsc = kmce->tsc;
-	mce->cs = kmce->cs;
-	mce->ip = kmce->rip;
-
-	if (kernel_mce_version == KERNEL_MCE_V1) {
-		mce->time = (tv.tv_sec * 1000000ULL) + tv.tv_usec;
-		mce->cpu = kmce->cpu;
-		mce->socket = -1;
-		mce->vendor = VENDOR_UNKNOWN;
-		mce->cpuid_eax = 0;
-		mce->init_apic_id = (uint32_t)-1U;
-		mce->mcg_status = 0;
-	} else if (kernel_mce_version == KERNEL_MCE_V2) {
-		if (kmce->time != 0) {
-			mce->time = kmce->time * 1000000ULL;
-		} else {
-			mce->time = (tv.tv_sec * 1000000ULL) + tv.tv_usec;
-		}
-		mce->cpu = kmce->extcpu;
-		mce->socket = kmce->socketid;
-		mce->vendor = kmce->cpuvendor;
-		mce->cpuid_eax = kmce->cpuid;
-		mce->init_apic_id = kmce->apicid;
-		mce->mcg_status = kmce->mcgcap;
-	} else {
-		/* this should never happen */
-		mced_log(LOG_EMERG,
-		         "FATAL: kernel_mce_version (%d) is unknown\n",
-		         kernel_mce_version);
-		clean_exit_with_status(EXIT_FAILURE);
-	}
-}
+/* the layout of the kernel's records, and its converter */
+static const struct kmce_layout *kmce_layout;
 
 /* this is used in a few places to throttle messages */
 struct rate_limit {
@@ -662,11 +1045,40 @@ apply_rate_limit(struct rate_limit *limit)
 	return 0;
 }
 
+/* hand a single MCE (or a summary of coalesced MCEs) to everyone */
+static void
+dispatch_mce(struct mce *mce)
+{
+	mce->seq = mced_next_seq++;
+	mced_retain(mce);
+
+	#if ENABLE_MCEDB
+	if (mcedb_append(mced_db, mce) < 0) {
+		mced_log(LOG_ERR,
+		    "ERR: failed to append MCE to database - not good!!\n");
+	} else {
+		mced_debug(1, "DBG: logged MCE #%lld\n", mcedb_end(mced_db)-1);
+	}
+	#endif
+	if (mced_log_events) {
+		mced_log(LOG_INFO, "starting MCE handlers\n");
+	}
+	mced_handle_mce(mce);
+	if (mced_log_events) {
+		mced_log(LOG_INFO, "completed MCE handlers\n");
+	}
+	#if ENABLE_DBUS
+	if (!no_dbus
+	 && (MCED_MCE_URGENT(mce) || mced_tbucket_take(&dbus_limit))) {
+		dbus_send_mce(mce);
+	}
+	#endif
+}
+
 /* process a single MCE */
 static int
-do_one_mce(struct kernel_mce *kmce)
+do_one_mce(struct mce *mce)
 {
-	struct mce mce;
 	static struct rate_limit hw_overflow_limit;
 	static int rate_limit_initialized = 0;
 
@@ -676,11 +1088,8 @@ do_one_mce(struct kernel_mce *kmce)
 		hw_overflow_limit.period.tv_sec = overflow_suppress_time;
 	}
 
-	/* convert the kernel's MCE struct to our own */
-	kmce_to_mce(kmce, &mce);
-
 	/* check for overflow */
-	if ((mce.mci_status & MCI_STATUS_OVER)
+	if ((mce->mci_status & MCI_STATUS_OVER)
 	 && (mced_log_events || !apply_rate_limit(&hw_overflow_limit))) {
 		mced_log(LOG_WARNING, "MCE overflow detected by hardware\n");
 		if (!mced_log_events && overflow_suppress_time) {
@@ -690,29 +1099,17 @@ do_one_mce(struct kernel_mce *kmce)
 		}
 	}
 
-	#if ENABLE_MCEDB
-	if (mcedb_append(mced_db, &mce) < 0) {
-		mced_log(LOG_ERR,
-		    "ERR: failed to append MCE to database - not good!!\n");
-	} else {
-		mced_debug(1, "DBG: logged MCE #%d\n", mcedb_end(mced_db)-1);
-	}
-	#endif
-	if (mced_log_events) {
-		mced_log(LOG_INFO, "starting MCE handlers\n");
-	}
-	mced_handle_mce(&mce);
-	if (mced_log_events) {
-		mced_log(LOG_INFO, "completed MCE handlers\n");
-	}
-	#if ENABLE_DBUS
-	if (!no_dbus) {
-		dbus_send_mce(&mce);
+	/* repeats of a recent corrected error wait for its summary */
+	if (mced_coalesce(mce)) {
+		return 0;
 	}
-	#endif
+	dispatch_mce(mce);
 	return 0;
 }
 
+/* the records the fake device's log holds: the kernel's MCE_LOG_LEN */
+#define FAKE_MCE_LOG_LEN	32
+
 /* get the MCE log length from the kernel */
 static int
 get_loglen(int mce_fd)
@@ -726,126 +1123,155 @@ get_loglen(int mce_fd)
 		}
 		return loglen;
 	} else {
-		return 1;
+		/* as big as the kernel's, so that reads are batched alike */
+		return FAKE_MCE_LOG_LEN;
+	}
+}
+
+/* wake the main thread */
+static void
+ingest_notify(void)
+{
+	uint64_t one = 1;
+
+	if (write(ingest_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		mced_perror(LOG_ERR, "ERR: write(eventfd)");
 	}
 }
 
-/* Convert seconds to microseconds. */
-static long int
-SEC_TO_USEC(long int sec)
+/* secs since the scheduler last looked, or 0 if it never has */
+static double
+sched_elapsed(void)
 {
-	return sec * 1000000;
+	struct timespec now;
+
+	if (!sched.last.tv_sec && !sched.last.tv_nsec) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - sched.last.tv_sec)
+	     + (now.tv_nsec - sched.last.tv_nsec) / 1e9;
 }
 
-/* Convert timeval to microseconds. */
-static long int
-TIMEVAL_TO_USEC(struct timeval *tv)
+/*
+ * The arrival rate, with 'nmces' arrivals over the last 'elapsed' secs
+ * folded in.  Each sample is weighed by the time it covers, so a long
+ * quiet spell decays the rate without any wakeups to sample it.
+ */
+static double
+sched_rate(int nmces, double elapsed)
 {
-  return SEC_TO_USEC(tv->tv_sec) + tv->tv_usec;
+	double alpha;
+
+	if (elapsed <= 0) {
+		return sched.rate;
+	}
+	alpha = elapsed / (elapsed + SCHED_RATE_TAU);
+	return sched.rate + alpha * (nmces / elapsed - sched.rate);
 }
 
+/*
+ * Estimate how many MCEs the kernel dropped when its log overflowed.  All
+ * we know is that more arrived than the log could hold, so we guess how
+ * many came in since we last looked at the recent rate, and say at least
+ * one.
+ */
+static unsigned long long
+track_arrivals(int nmces, int overflowed)
+{
+	unsigned long long lost = 0;
+	double elapsed;
+	double guess;
 
-/* Divide a timeval by an integer. The quotient is normalized. */
-static void
-timerdiv(const struct timeval *tv, int divisor, struct timeval *quotient) {
-	/* Avoid relying on tv->tv_sec after setting quotient->tv_sec in cases they alias. */
-	long int remainder_sec = tv->tv_sec % divisor;
-	quotient->tv_sec = tv->tv_sec / divisor;
-	quotient->tv_usec = (SEC_TO_USEC(remainder_sec) + tv->tv_usec) / divisor;
+	if (!overflowed) {
+		return 0;
+	}
+	elapsed = sched_elapsed();
+	guess = sched_rate(nmces, elapsed) * elapsed;
+	if (guess > nmces) {
+		lost = guess - nmces;
+	}
+
+	return lost ? lost : 1;
 }
 
-/* enforce MCE rate limiting */
-static void
-rate_limit_mces(void)
+/*
+ * Fold what a wakeup found into the arrival rate, and pick the interval
+ * to the next one.  Returns the interval in msecs, or -1 for no timer.
+ */
+static int
+sched_update(int nmces, int interval_ms)
 {
-	static int first_event = 1;
-	static struct timeval last_timestamp;
-	static struct timeval bias;
+	int loglen = atomic_load(&sched_stats.loglen);
+	unsigned fill = atomic_load(&sched_stats.fill);
 
-	if (mce_rate_limit <= 0) {
-		/* no rate limiting */
-		return;
-	} else if (first_event) {
-		/* first time through here, just remember it */
-		first_event = 0;
-		gettimeofday(&last_timestamp, NULL);
-	} else {
-		/* we might have to rate limit */
-		struct timeval now;
-		struct timeval since_last;
-		static const struct timeval one_second = {1, 0};
-		struct timeval time_per_event;
-		timerdiv(&one_second, mce_rate_limit, &time_per_event);
-
-		/* find how long it has been since the last event */
-		gettimeofday(&now, NULL);
-		timersub(&now, &last_timestamp, &since_last);
-
-		/* set the last_timestamp to now, we might change it later */
-		last_timestamp = now;
-
-		/* are we under the minimum time between events? */
-		if (timercmp(&time_per_event, &since_last, >)) {
-			struct timeval time_to_kill;
-			struct timeval missed_by;
-			struct timeval time_to_sleep;
+	sched.rate = sched_rate(nmces, sched_elapsed());
+	clock_gettime(CLOCK_MONOTONIC, &sched.last);
+	atomic_store(&sched_stats.rate,
+	             (unsigned long long)(sched.rate * 100));
 
-			/*
-			 * We set the last_timestamp to the *ideal* time
-			 * (now + usecs_to_kill), rather than the real
-			 * time after the usleep().  This is because
-			 * usleep() (and all other sleeps, really) is
-			 * inaccurate with very small values.  This gets
-			 * us closer to the actual requested rate
-			 * limiting.
-			 *
-			 * We also try to bias the sleep time based on
-			 * past inaccuracy.  We integrate the over/under
-			 * deltas somewhat slowly, so large transients
-			 * should not distort the bias too quickly.
-			 */
-			timersub(&time_per_event, &since_last, &time_to_kill);
-			timeradd(&last_timestamp, &time_to_kill, &last_timestamp);
-			timeradd(&time_to_kill, &bias, &time_to_sleep);
-			if (TIMEVAL_TO_USEC(&time_to_sleep) > 0) {
-				/* do the actual sleep */
-				usleep(TIMEVAL_TO_USEC(&time_to_sleep));
-			}
-			/* adjust the bias */
-			gettimeofday(&now, NULL);
-			timersub(&now, &last_timestamp, &missed_by);
-			timerdiv(&missed_by, 8, &missed_by);
-			timersub(&bias, &missed_by, &bias);
+	/* poll() wakes us for MCEs, so there is nothing to time */
+	if (mcelog_poll_works) {
+		atomic_store(&sched_stats.interval_ms, -1);
+		return -1;
+	}
+	/* a fixed interval, or none at all */
+	if (max_interval_ms <= 0) {
+		return interval_ms;
+	}
+
+	if (nmces && fill >= SCHED_TARGET_FILL) {
+		/* that was close: look again as soon as we may */
+		interval_ms = min_interval_ms;
+	} else {
+		/* how long until the log is as full as we let it get */
+		double target = loglen * SCHED_TARGET_FILL / 100.0;
+		if (sched.rate * max_interval_ms / 1000 <= target) {
+			/* idle, or near enough */
+			interval_ms = max_interval_ms;
+		} else {
+			interval_ms = target / sched.rate * 1000;
 		}
 	}
+	if (interval_ms < min_interval_ms) {
+		interval_ms = min_interval_ms;
+	}
+	if (interval_ms > max_interval_ms) {
+		interval_ms = max_interval_ms;
+	}
+	atomic_store(&sched_stats.interval_ms, interval_ms);
+
+	return interval_ms;
 }
 
-/* read and handle and MCEs that are pending in the kernel */
+/* read and queue any MCEs that are pending in the kernel */
 static int
 do_pending_mces(int mce_fd)
 {
-	int loglen;
+	int loglen = kernel_loglen;
 	int nmces = 0;
 	int flags = 0;
 	static struct rate_limit sw_overflow_limit;
+	static struct rate_limit ring_overflow_limit;
 	static int rate_limit_initialized = 0;
 
 	/* initialize the rate limits based on a commandline flag */
 	if (!rate_limit_initialized) {
 		rate_limit_initialized = 1;
 		sw_overflow_limit.period.tv_sec = overflow_suppress_time;
+		ring_overflow_limit.period.tv_sec = overflow_suppress_time;
 	}
 
 	/* check for MCEs */
-	loglen = get_loglen(mce_fd);
 	if (loglen > 0) {
-		uint8_t buf[mced_kernel_record_len*loglen];
+		uint8_t *buf = ingest_buf.raw;
 		int n;
 
 		/* read all of the MCE data */
-		n = read(mce_fd, buf, mced_kernel_record_len*loglen);
+		n = read(mce_fd, buf, ingest_buf.size);
 		if (n < 0) {
 			if (fake_dev_mcelog && errno == EAGAIN) {
+				atomic_fetch_add(&sched_stats.empty_reads, 1);
 				return 0;
 			}
 			mced_perror(LOG_ERR, "ERR: read()");
@@ -854,11 +1280,37 @@ do_pending_mces(int mce_fd)
 
 		/* did we get any MCES? */
 		nmces = n/mced_kernel_record_len;
+		if (nmces == 0) {
+			atomic_fetch_add(&sched_stats.empty_reads, 1);
+		}
+		if (nmces == 0 && fake_dev_mcelog) {
+			/* FIFO closed */
+			fake_dev_closed = 1;
+		}
 		if (nmces > 0) {
+			unsigned fill = nmces * 100 / loglen;
+			struct kmce_batch *batch = &ingest_buf.batch;
+			struct timeval tv;
+			uint64_t now;
 			int i;
 
-			/* read the flags */
-			if (!fake_dev_mcelog
+			/* how close did the kernel's log come to overflowing? */
+			atomic_store(&sched_stats.fill, fill);
+			if (fill > atomic_load(&sched_stats.peak_fill)) {
+				atomic_store(&sched_stats.peak_fill, fill);
+			}
+			atomic_fetch_add(&sched_stats.reads, 1);
+			int ndropped;
+			int lost_uc;
+			unsigned long long nlost;
+
+			/*
+			 * Read the flags.  The kernel only drops an MCE when
+			 * its log is full, and it is only emptied by a read,
+			 * so a read which didn't fill the buffer means there
+			 * was no overflow to report.
+			 */
+			if (!fake_dev_mcelog && nmces == loglen
 			 && ioctl(mce_fd, MCE_GETCLEAR_FLAGS, &flags) < 0) {
 				mced_log(LOG_ERR, "ERR: can't get flags: %s\n",
 				         strerror(errno));
@@ -866,11 +1318,15 @@ do_pending_mces(int mce_fd)
 			}
 
 			/* check for overflow */
+			nlost = track_arrivals(nmces,
+			                       flags & MCE_FLAG_OVERFLOW);
 			if ((flags & MCE_FLAG_OVERFLOW)
 			 && (mced_log_events
 			  || !apply_rate_limit(&sw_overflow_limit))){
 				mced_log(LOG_WARNING,
-				    "MCE overflow detected by software\n");
+				    "MCE overflow detected by software, "
+				    "about %llu MCE%s lost\n",
+				    nlost, (nlost==1)?"":"s");
 				if (!mced_log_events
 				 && overflow_suppress_time) {
 					mced_log(LOG_WARNING,
@@ -880,26 +1336,74 @@ do_pending_mces(int mce_fd)
 				}
 			}
 
+			/* one timestamp, and one classifying pass, per batch */
+			gettimeofday(&tv, NULL);
+			now = (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+			kmce_batch_fill(batch, buf, nmces,
+			                mced_kernel_record_len, kmce_layout, now);
+
 			if (mced_log_events) {
-				mced_debug(1, "DBG: got %d MCE%s\n",
-				           nmces, (nmces==1)?"":"s");
+				mced_debug(1, "DBG: got %d MCE%s (%d uncorrected, "
+				           "%d overflowed, %d not valid)\n",
+				           nmces, (nmces==1)?"":"s",
+				           kmce_batch_count(batch, KMCE_UC),
+				           kmce_batch_count(batch, KMCE_OVER),
+				           nmces - kmce_batch_count(batch,
+				                                    KMCE_VAL));
 			}
 
-			/* handle all the new MCEs */
+			/* queue all the new MCEs */
+			ndropped = 0;
+			lost_uc = -1;
 			for (i = 0; i < nmces; i++) {
-				struct kernel_mce kmce;
-				void *src, *dst;
-				rate_limit_mces();
-				/* The assumption is that newer versions of
-				 * 'struct kernel_mce' are guaranteed to be
-				 * supersets of older versions.  Only copy
-				 * the portion of the structure that we
-				 * currently know about, and zero the rest. */
-				src = &buf[i*mced_kernel_record_len];
-				dst = &kmce;
-				memcpy(dst, src, mced_copy_len);
-				memset(dst + mced_copy_len, 0, mced_zero_len);
-				do_one_mce(&kmce);
+				const struct kernel_mce *kmce;
+				struct mce mce;
+				int urgent;
+				/* The converter only reads the fields that a
+				 * record of this size has, so it can read it
+				 * in place. */
+				kmce = (const struct kernel_mce *)
+				       &buf[i*mced_kernel_record_len];
+				kmce_layout->convert(kmce, batch->now, &mce);
+				mce.boot = bootnum;
+				urgent = batch->class[i] & KMCE_UC;
+				if (mce_ring_push(urgent ? &urgent_ring
+				                         : &ingest_ring,
+				                  &mce) < 0) {
+					ndropped++;
+					if (urgent && lost_uc < 0) {
+						lost_uc = i;
+					}
+				}
+			}
+			/* clients are told where the sequence has holes */
+			nlost += ndropped;
+			if (nlost) {
+				atomic_fetch_add(&ingest_lost, nlost);
+			}
+			ingest_notify();
+
+			if (ndropped
+			 && (mced_log_events
+			  || !apply_rate_limit(&ring_overflow_limit))) {
+				mced_log(LOG_WARNING,
+				    "ingest ring full, dropped %d MCE%s\n",
+				    ndropped, (ndropped==1)?"":"s");
+				/* it never reaches the store, so say what it was */
+				if (lost_uc >= 0) {
+					mced_log(LOG_ERR,
+					    "ERR: dropped an uncorrected MCE: "
+					    "cpu %u bank %u status 0x%016llx "
+					    "addr 0x%016llx misc 0x%016llx\n",
+					    batch->cpu[lost_uc],
+					    batch->bank[lost_uc],
+					    (unsigned long long)
+					    batch->status[lost_uc],
+					    (unsigned long long)
+					    batch->addr[lost_uc],
+					    (unsigned long long)
+					    batch->misc[lost_uc]);
+				}
 			}
 		}
 	}
@@ -963,60 +1467,63 @@ check_mcelog_poll(int mce_fd)
 	return 0;
 }
 
+/* keep the ingest path's memory from being paged out, if asked to */
+static void
+lock_ingest_memory(const void *addr, size_t len, const char *what)
+{
+	if (mlock_ingest && mlock(addr, len) < 0) {
+		mced_log(LOG_WARNING, "WARNING: can't lock the %s: %s\n",
+		         what, strerror(errno));
+	}
+}
+
+/* allocate the buffer which every read of /dev/mcelog goes into */
 static int
-get_kernel_version(unsigned *vmajor, unsigned *vminor, unsigned *vmicro)
+alloc_ingest_buf(void)
 {
-	struct utsname u;
+	size_t size = mced_kernel_record_len * kernel_loglen;
+	void *raw;
+	int r;
 
-	int r = uname(&u);
-	if (r < 0) {
-		return r;
+	if (ingest_buf.raw && ingest_buf.size == size
+	 && ingest_buf.batch.size == kernel_loglen) {
+		return 0;
 	}
-
-	r = sscanf(u.release, "%u.%u.%u", vmajor, vminor, vmicro);
-	if (r != 3) {
-		errno = EBADMSG;
+	free(ingest_buf.raw);
+	kmce_batch_free(&ingest_buf.batch);
+	memset(&ingest_buf, 0, sizeof(ingest_buf));
+
+	/* records are read straight in, so keep them cacheline-aligned */
+	r = posix_memalign(&raw, 64, size);
+	if (r != 0) {
+		mced_log(LOG_ERR, "ERR: can't allocate the ingest buffer: %s\n",
+		         strerror(r));
 		return -1;
 	}
-	mced_debug(1, "DBG: found kernel %u.%u.%u\n",
-	           *vmajor, *vminor, *vmicro);
+	ingest_buf.raw = raw;
+	ingest_buf.size = size;
+	if (kmce_batch_alloc(&ingest_buf.batch, kernel_loglen) < 0) {
+		mced_log(LOG_ERR, "ERR: can't allocate the ingest buffer\n");
+		return -1;
+	}
+	lock_ingest_memory(ingest_buf.raw, size, "ingest buffer");
+	lock_ingest_memory(ingest_buf.batch.mem, ingest_buf.batch.mem_size,
+	                   "ingest buffer");
 	return 0;
 }
 
 static int
 init_kernel_mce_interface(int mce_fd)
 {
+	const struct kmce_layout *layout;
+
 	if (fake_dev_mcelog) {
 		mced_kernel_record_len = sizeof(struct kernel_mce);
-		kernel_mce_version = KERNEL_MCE_V1;
 	} else {
-		int r;
-
-		/* Adjust for kernel versions. */
-		unsigned vmajor, vminor, vmicro;
-		r = get_kernel_version(&vmajor, &vminor, &vmicro);
-		if (r < 0) {
-			static int printed_msg;
-			if (!printed_msg) {
-				printed_msg = 1;
-				mced_perror(LOG_ERR,
-				            "ERR: can't get kernel version\n");
-			}
-			return -1;
-		}
-
-		/* assume the historical kernel layout */
-		kernel_mce_version = KERNEL_MCE_V1;
-
-		/* there were layout changes in 2.6.31 */
-		if ((vmajor > 2)
-		 || (vmajor == 2 && vminor > 6)
-		 || (vmajor == 2 && vminor == 6 && vmicro >= 31)) {
-			kernel_mce_version = KERNEL_MCE_V2;
-		}
+		int len;
 
 		/* Figure out the kernel's 'struct mce' size. */
-		r = ioctl(mce_fd, MCE_GET_RECORD_LEN, &mced_kernel_record_len);
+		int r = ioctl(mce_fd, MCE_GET_RECORD_LEN, &len);
 		if (r < 0) {
 			static int printed_msg;
 			if (!printed_msg) {
@@ -1026,52 +1533,48 @@ init_kernel_mce_interface(int mce_fd)
 			}
 			return -1;
 		}
+		mced_kernel_record_len = len;
 	}
 
 	/*
-	 * Sanity check the results.
+	 * The record size tells us which fields the kernel fills in.  If
+	 * the kernel grew 'struct mce' we will catch it here, and read the
+	 * part we know about.  If they simply changed the meaning of fields
+	 * (hopefully only reserved fields), then we will not catch it.
+	 * Let's hope they don't do this.
 	 */
-
-	/* This should not happen. */
-	if (kernel_mce_version == KERNEL_MCE_UNKNOWN) {
+	layout = mced_kmce_layout(mced_kernel_record_len);
+	if (!layout) {
 		static int printed_msg;
 		if (!printed_msg) {
 			printed_msg = 1;
 			mced_log(LOG_ERR,
-			         "ERR: kernel MCE version is unknown\n");
+			         "ERR: unknown kernel MCE record size (%zd)\n",
+			         mced_kernel_record_len);
 		}
 		return -1;
 	}
+	kmce_layout = layout;
 
-	/*
-	 * If the kernel grew 'struct mce' we will catch it here.  If they
-	 * simply changed the meaning of fields (hopefully only reserved
-	 * fields), then we will not catch it.  Let's hope they don't do
-	 * this.  If the kernel declaration is larger than our declaration,
-	 * then we only want to copy the portion we know about.  If the
-	 * kernel declaration is smaller (an older kernel), then we want
-	 * to copy all of the kernel's data, but zero out the remainder
-	 * of our structure.
-	 */
-	if (mced_kernel_record_len >= sizeof(struct kernel_mce)) {
-		mced_copy_len = sizeof(struct kernel_mce);
-		mced_zero_len = 0;
-	} else {
-		mced_copy_len = mced_kernel_record_len;
-		mced_zero_len = sizeof(struct kernel_mce) - mced_kernel_record_len;
-	}
-
-	if (mced_kernel_record_len != sizeof(struct kernel_mce)) {
+	if (mced_kernel_record_len != layout->len) {
 		static int printed_msg;
 		if (!printed_msg) {
 			printed_msg = 1;
 			mced_log(LOG_WARNING,
 				 "kernel/mced record mismatch (%zd/%zd)\n",
-				 mced_kernel_record_len,
-				 sizeof(struct kernel_mce));
+				 mced_kernel_record_len, layout->len);
 		}
 	}
-	return 0;
+	mced_debug(1, "DBG: kernel MCE records are %zd bytes, up to '%s'\n",
+	           mced_kernel_record_len, layout->last);
+
+	/* the log's length is fixed when the kernel boots */
+	kernel_loglen = get_loglen(mce_fd);
+	if (kernel_loglen <= 0) {
+		return -1;
+	}
+	atomic_store(&sched_stats.loglen, kernel_loglen);
+	return alloc_ingest_buf();
 }
 
 static int
@@ -1141,13 +1644,694 @@ get_mcelog_fd(void)
 	return fd;
 }
 
+/*
+ * Arm the interval timer to fire every 'ms' milliseconds, or disarm it if
+ * 'ms' is negative (polling disabled, or not needed).
+ */
+static void
+set_interval_timer(int timer_fd, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (ms > 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	} else if (ms == 0) {
+		/* a zero it_value would disarm it */
+		its.it_value.tv_nsec = 1;
+	}
+	its.it_interval = its.it_value;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+	}
+}
+
+/*
+ * The ingest thread.  It does nothing but drain the kernel's MCE log into
+ * the ingest ring, so that slow handlers in the main thread can never
+ * delay the next read of /dev/mcelog.  It waits on its own epoll instance
+ * for the device and for a timerfd, which sched_update() sets from the
+ * arrival rate.
+ */
+static void *
+ingest_main(void *arg __attribute__((unused)))
+{
+	int interval_ms = max_interval_ms;
+	int armed_ms;
+	int mcelog_fd;
+	int ep_fd;
+	int timer_fd;
+	struct epoll_event ev;
+
+	/* open the device file */
+	while ((mcelog_fd = get_mcelog_fd()) < 0) {
+		if (atomic_load(&ingest_stopping)) {
+			return NULL;
+		}
+		poll(NULL, 0, max_interval_ms);
+	}
+
+	ep_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_create()");
+		exit(EXIT_FAILURE);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = timer_fd;
+	if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_ctl(ADD)");
+		exit(EXIT_FAILURE);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = ingest_stop_fd;
+	if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, ingest_stop_fd, &ev) < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_ctl(ADD)");
+		exit(EXIT_FAILURE);
+	}
+	/* wait on the mcelog, if we can */
+	if (mcelog_poll_works) {
+		ev.events = EPOLLIN;
+		ev.data.fd = mcelog_fd;
+		if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, mcelog_fd, &ev) < 0) {
+			mced_perror(LOG_ERR, "ERR: epoll_ctl(ADD)");
+			mcelog_poll_works = 0;
+		}
+	}
+	/* with poll(), we only wake up for MCEs */
+	if (mcelog_poll_works) {
+		interval_ms = -1;
+	}
+	set_interval_timer(timer_fd, interval_ms);
+	armed_ms = interval_ms;
+	atomic_store(&sched_stats.interval_ms, interval_ms);
+
+	while (1) {
+		struct epoll_event evs[3];
+		int mce_ready = 0;
+		int timed_out = 0;
+		int stopping = 0;
+		int r;
+		int i;
+
+		if (interval_ms != armed_ms) {
+			if (interval_ms < 0) {
+				mced_debug(2, "DBG: no interval\n");
+			} else {
+				mced_debug(2, "DBG: next interval = %d msecs\n",
+				           interval_ms);
+			}
+			set_interval_timer(timer_fd, interval_ms);
+			armed_ms = interval_ms;
+		}
+
+		r = epoll_wait(ep_fd, evs, 3, -1);
+		atomic_fetch_add(&sched_stats.wakeups, 1);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			mced_perror(LOG_ERR, "ERR: epoll_wait()");
+			continue;
+		}
+		for (i = 0; i < r; i++) {
+			if (evs[i].data.fd == timer_fd) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations,
+				         sizeof(expirations)) < 0) {
+					/* spurious */
+					continue;
+				}
+				timed_out = 1;
+				mced_debug(1, "DBG: poll timeout\n");
+			} else if (evs[i].data.fd == ingest_stop_fd) {
+				stopping = 1;
+			} else {
+				mce_ready = 1;
+			}
+		}
+
+		/*
+		 * Was it an MCE?  Be paranoid and always check.  If poll()
+		 * does not work, we can only check on every interval.
+		 */
+		if (mce_ready || (timed_out && !mcelog_poll_works)) {
+			int total = 0;
+			int n = 0;
+
+			/* while the kernel's log fills up, keep reading */
+			atomic_fetch_add(&sched_stats.drains, 1);
+			for (i = 0; i < SCHED_MAX_READS; i++) {
+				n = do_pending_mces(mcelog_fd);
+				if (n > 0) {
+					total += n;
+				}
+				if (n < kernel_loglen || fake_dev_closed) {
+					break;
+				}
+			}
+			if (fake_dev_closed) {
+				mced_log(LOG_INFO,
+				         "fake mcelog device closed\n");
+				atomic_store(&ingest_eof, 1);
+				ingest_notify();
+				break;
+			}
+			if (!total) {
+				atomic_fetch_add(&sched_stats.idle_wakeups, 1);
+			}
+			interval_ms = sched_update(total, interval_ms);
+		} else if (timed_out) {
+			/* nothing came: let the rate decay */
+			atomic_fetch_add(&sched_stats.idle_wakeups, 1);
+			interval_ms = sched_update(0, interval_ms);
+		}
+
+		/* whatever was read is left in the rings for the main thread */
+		if (stopping) {
+			break;
+		}
+	}
+
+	close(timer_fd);
+	close(ep_fd);
+	return NULL;
+}
+
+static int
+start_ingest(void)
+{
+	sigset_t all_sigs;
+	sigset_t old_sigs;
+	int r;
+
+	if (mce_ring_init(&ingest_ring, ring_size) < 0
+	 || mce_ring_init(&urgent_ring, ring_size) < 0) {
+		mced_perror(LOG_ERR, "ERR: can't allocate ingest ring");
+		return -1;
+	}
+	lock_ingest_memory(ingest_ring.slots,
+	                   ingest_ring.size * sizeof(*ingest_ring.slots),
+	                   "ingest ring");
+	lock_ingest_memory(urgent_ring.slots,
+	                   urgent_ring.size * sizeof(*urgent_ring.slots),
+	                   "urgent ring");
+	ingest_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ingest_stop_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ingest_eventfd < 0 || ingest_stop_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: eventfd()");
+		return -1;
+	}
+	mced_debug(1, "DBG: ingest ring holds %zu MCEs\n", ingest_ring.size);
+
+	/* signals are always handled by the main thread */
+	sigfillset(&all_sigs);
+	pthread_sigmask(SIG_SETMASK, &all_sigs, &old_sigs);
+	r = pthread_create(&ingest_thread, NULL, ingest_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+	if (r != 0) {
+		mced_log(LOG_ERR, "ERR: can't start ingest thread: %s\n",
+		         strerror(r));
+		return -1;
+	}
+	ingest_running = 1;
+
+	return 0;
+}
+
+/*
+ * Tell the ingest thread to finish, and wait until it has.  What it read
+ * from the kernel is left in the rings.
+ */
+static void
+stop_ingest(void)
+{
+	uint64_t one = 1;
+	int r;
+
+	if (!ingest_running) {
+		return;
+	}
+	atomic_store(&ingest_stopping, 1);
+	if (write(ingest_stop_fd, &one, sizeof(one)) < 0) {
+		mced_perror(LOG_ERR, "ERR: write(eventfd)");
+		return;
+	}
+	r = pthread_join(ingest_thread, NULL);
+	if (r != 0) {
+		mced_log(LOG_ERR, "ERR: can't join ingest thread: %s\n",
+		         strerror(r));
+		return;
+	}
+	ingest_running = 0;
+}
+
+#if ENABLE_MCEDB
+static void
+db_commit(void)
+{
+	if (mcedb_commit(mced_db) < 0) {
+		mced_log(LOG_ERR, "ERR: failed to sync the database\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &db_last_sync);
+}
+
+/* sync what this drain appended, or arrange to do it soon */
+static void
+db_group_commit(void)
+{
+	struct timespec now;
+	long long since_ms;
+
+	if (!mcedb_pending(mced_db) || db_sync_armed) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	since_ms = (now.tv_sec - db_last_sync.tv_sec) * 1000LL
+	         + (now.tv_nsec - db_last_sync.tv_nsec) / 1000000;
+	if (since_ms >= db_sync_ms) {
+		db_commit();
+	} else {
+		struct itimerspec its;
+		long long wait_ms = db_sync_ms - since_ms;
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = wait_ms / 1000;
+		its.it_value.tv_nsec = (wait_ms % 1000) * 1000000L;
+		if (timerfd_settime(db_sync_watch.fd, 0, &its, NULL) < 0) {
+			mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+			db_commit();
+			return;
+		}
+		db_sync_armed = 1;
+	}
+}
+
+/* a held back sync is due */
+static void
+db_sync_event(struct mced_watcher *w, uint32_t events __attribute__((unused)))
+{
+	uint64_t expirations;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious */
+		return;
+	}
+	db_sync_armed = 0;
+	db_commit();
+}
+
+/*
+ * Carry on the sequence numbers from the store, and retain its latest
+ * MCEs, so clients can resume across a restart.
+ */
+static void
+load_retained(void)
+{
+	long long end = mcedb_end(mced_db);
+	long long i = end - ((retain_len > 0) ? retain_len : 1);
+
+	for (i = (i < 0) ? 0 : i; i < end; i++) {
+		struct mce_v3_record rec;
+		struct mce mce;
+
+		if (mcedb_read(mced_db, i, &rec) < 0) {
+			continue;
+		}
+		mced_v3_to_mce(&rec, &mce);
+		mced_retain(&mce);
+		if (mce.seq >= mced_next_seq) {
+			mced_next_seq = mce.seq + 1;
+		}
+	}
+	mced_debug(1, "DBG: next sequence number is %llu\n",
+	           (unsigned long long)mced_next_seq);
+}
+
+static int
+init_db_sync(void)
+{
+	db_sync_watch.fd = timerfd_create(CLOCK_MONOTONIC,
+	                                  TFD_NONBLOCK|TFD_CLOEXEC);
+	if (db_sync_watch.fd < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_create()");
+		return -1;
+	}
+	db_sync_watch.handler = db_sync_event;
+	return mced_watch(&db_sync_watch, EPOLLIN);
+}
+#endif  /* ENABLE_MCEDB */
+
+/* resume draining the ingest ring in 'ns' nanoseconds */
+static void
+arm_limit_timer(uint64_t ns)
+{
+	struct itimerspec its;
+
+	if (limit_armed) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL;
+	if (timerfd_settime(limit_watch.fd, 0, &its, NULL) < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+		return;
+	}
+	limit_armed = 1;
+}
+
+/*
+ * Hand on any summaries which are due, and wake up for the next one.  A
+ * timer which is already running is left alone: it will get here first.
+ */
+static void
+arm_coalesce_timer(void)
+{
+	struct itimerspec its;
+	long long wait_ms;
+
+	if (!coalesce_ms || coalesce_armed) {
+		return;
+	}
+	wait_ms = mced_coalesce_expire();
+	if (wait_ms < 0) {
+		return;
+	}
+	if (wait_ms == 0) {
+		wait_ms = 1;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = wait_ms / 1000;
+	its.it_value.tv_nsec = (wait_ms % 1000) * 1000000L;
+	if (timerfd_settime(coalesce_watch.fd, 0, &its, NULL) < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+		return;
+	}
+	coalesce_armed = 1;
+}
+
+/* a coalescing window has closed */
+static void
+coalesce_event(struct mced_watcher *w, uint32_t events __attribute__((unused)))
+{
+	uint64_t expirations;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious */
+		return;
+	}
+	coalesce_armed = 0;
+	arm_coalesce_timer();
+	mced_flush_clients();
+	#if ENABLE_MCEDB
+	db_group_commit();
+	#endif
+}
+
+static int
+init_coalesce(void)
+{
+	if (mced_coalesce_init(coalesce_ms, dispatch_mce) < 0) {
+		return -1;
+	}
+	if (!coalesce_ms) {
+		return 0;
+	}
+	coalesce_watch.fd = timerfd_create(CLOCK_MONOTONIC,
+	                                   TFD_NONBLOCK|TFD_CLOEXEC);
+	if (coalesce_watch.fd < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_create()");
+		return -1;
+	}
+	coalesce_watch.handler = coalesce_event;
+	return mced_watch(&coalesce_watch, EPOLLIN);
+}
+
+/* MCEs we never got still use up sequence numbers */
+static void
+handle_ingest_lost(void)
+{
+	unsigned long long lost;
+
+	lost = atomic_exchange(&ingest_lost, 0);
+	if (lost) {
+		mced_handle_gap(mced_next_seq, lost);
+		mced_next_seq += lost;
+	}
+}
+
+/*
+ * Dispatch everything the ingest thread has queued.  Returns -1 if the
+ * ingest thread has finished (only with a fake mcelog device).
+ */
+static int
+do_ingested_mces(void)
+{
+	uint64_t count;
+	struct mce mce;
+	int eof;
+
+	/* clear the wakeup before draining, so we can't miss one */
+	if (read(ingest_eventfd, &count, sizeof(count)) < 0
+	 && errno != EAGAIN) {
+		mced_perror(LOG_ERR, "ERR: read(eventfd)");
+	}
+
+	eof = atomic_load(&ingest_eof);
+	while (1) {
+		uint64_t wait;
+
+		/* urgent MCEs go first, even mid-drain, and are never held */
+		if (mce_ring_pop(&urgent_ring, &mce)) {
+			do_one_mce(&mce);
+			continue;
+		}
+		wait = mced_tbucket_wait(&ingest_limit);
+		if (wait) {
+			/* leave the rest in the ring until a token is due */
+			if (mce_ring_depth(&ingest_ring)) {
+				if (!limit_armed) {
+					limit_pauses++;
+				}
+				arm_limit_timer(wait);
+				eof = 0;
+			}
+			break;
+		}
+		if (!mce_ring_pop(&ingest_ring, &mce)) {
+			break;
+		}
+		mced_tbucket_take(&ingest_limit);
+		do_one_mce(&mce);
+	}
+	handle_ingest_lost();
+	arm_coalesce_timer();
+	/* binary clients get everything we just drained in one frame */
+	mced_flush_clients();
+	#if ENABLE_MCEDB
+	db_group_commit();
+	#endif
+
+	return eof ? -1 : 0;
+}
+
+/*
+ * Dispatch everything left in the rings once the ingest thread has
+ * finished, urgent MCEs first.  The rate limit holds nothing back: mced is
+ * exiting, and there would be no later for it to wait until.
+ */
+static void
+drain_ingested_mces(void)
+{
+	struct mce mce;
+
+	while (mce_ring_pop(&urgent_ring, &mce)) {
+		do_one_mce(&mce);
+	}
+	while (mce_ring_pop(&ingest_ring, &mce)) {
+		do_one_mce(&mce);
+	}
+	handle_ingest_lost();
+}
+
+/* a token is due for MCEs held back by the rate limit */
+static void
+limit_event(struct mced_watcher *w, uint32_t events __attribute__((unused)))
+{
+	uint64_t expirations;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious */
+		return;
+	}
+	limit_armed = 0;
+	if (do_ingested_mces() < 0) {
+		main_loop_done = 1;
+	}
+}
+
+static int
+init_rate_limits(void)
+{
+	mced_tbucket_init(&ingest_limit, mce_rate_limit.rate,
+	                  mce_rate_limit.burst);
+	mced_tbucket_init(&mced_cmd_limit, cmd_rate_limit.rate,
+	                  cmd_rate_limit.burst);
+	mced_tbucket_init(&mced_client_limit, client_rate_limit.rate,
+	                  client_rate_limit.burst);
+	mced_tbucket_init(&mced_shm_limit, shm_rate_limit.rate,
+	                  shm_rate_limit.burst);
+	#if ENABLE_DBUS
+	mced_tbucket_init(&dbus_limit, dbus_rate_limit.rate,
+	                  dbus_rate_limit.burst);
+	#endif
+
+	limit_watch.fd = timerfd_create(CLOCK_MONOTONIC,
+	                                TFD_NONBLOCK|TFD_CLOEXEC);
+	if (limit_watch.fd < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_create()");
+		return -1;
+	}
+	limit_watch.handler = limit_event;
+	return mced_watch(&limit_watch, EPOLLIN);
+}
+
+/* the ingest thread has queued MCEs */
+static void
+ingest_event(struct mced_watcher *w __attribute__((unused)),
+             uint32_t events __attribute__((unused)))
+{
+	if (do_ingested_mces() < 0) {
+		main_loop_done = 1;
+	}
+}
+
+/* signals are read from the signalfd and handled in the main loop */
+static void
+signal_event(struct mced_watcher *w, uint32_t events __attribute__((unused)))
+{
+	struct signalfd_siginfo si;
+
+	while (read(w->fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			reload_conf();
+			break;
+		case SIGINT:
+		case SIGQUIT:
+			clean_exit(si.ssi_signo);
+			break;
+		case SIGTERM:
+			clean_exit_with_killer(si.ssi_signo, si.ssi_pid);
+			break;
+		case SIGCHLD:
+			mced_reap_handlers();
+			break;
+		case SIGUSR1:
+			dump_stats();
+			break;
+		}
+	}
+}
+
+/* a new client connection */
+static void
+socket_event(struct mced_watcher *w, uint32_t events)
+{
+	int cli_fd;
+	struct ucred creds;
+	char buf[32];
+	static int accept_errors;
+	int proto;
+
+	/* this shouldn't happen */
+	if (!(events & EPOLLIN)) {
+		mced_log(LOG_WARNING, "odd, epoll set flags 0x%x\n", events);
+		return;
+	}
+
+	/* accept and add to our lists */
+	cli_fd = ud_accept(w->fd, &creds);
+	if (cli_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: can't accept client");
+		accept_errors++;
+		if (accept_errors >= 5) {
+			mced_log(LOG_ERR, "giving up\n");
+			clean_exit_with_status(EXIT_FAILURE);
+		}
+		return;
+	}
+	accept_errors = 0;
+	if (creds.uid != 0 && mced_non_root_clients >= clientmax) {
+		close(cli_fd);
+		mced_log(LOG_ERR, "too many non-root clients\n");
+		return;
+	}
+	if (creds.uid != 0) {
+		mced_non_root_clients++;
+	}
+	fcntl(cli_fd, F_SETFD, FD_CLOEXEC);
+	snprintf(buf, sizeof(buf)-1, "%d[%d:%d]",
+		creds.pid, creds.uid, creds.gid);
+	if (w == &compat_sock_watch) {
+		proto = 1;
+	} else if (w == &bin_sock_watch) {
+		proto = 3;
+	} else {
+		proto = 2;
+	}
+	mced_add_client(cli_fd, buf, proto);
+}
+
+/*
+ * Set up the main loop's epoll instance, and start handling signals
+ * through it.
+ */
+static int
+init_main_loop(void)
+{
+	sigset_t sigs;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: epoll_create1()");
+		return -1;
+	}
+
+	/* these are only ever delivered through the signalfd */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0) {
+		mced_perror(LOG_ERR, "ERR: sigprocmask()");
+		return -1;
+	}
+	signal_watch.fd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (signal_watch.fd < 0) {
+		mced_perror(LOG_ERR, "ERR: signalfd()");
+		return -1;
+	}
+	signal_watch.handler = signal_event;
+
+	return mced_watch(&signal_watch, EPOLLIN);
+}
+
 int
 main(int argc, const char *argv[])
 {
-	int mcelog_fd;
 	int sock_fd = -1; /* init to avoid a compiler warning */
 	int compat_sock_fd = -1;
-	int interval_ms;
+	int bin_sock_fd = -1;
 
 	/* learn who we really are */
 	progname = strrchr(argv[0], '/');
@@ -1172,6 +2356,13 @@ main(int argc, const char *argv[])
 				exit(EXIT_FAILURE);
 			}
 		}
+		if (socketfile_bin) {
+			bin_sock_fd = open_socket(socketfile_bin,
+			                          socketmode, socketgroup);
+			if (bin_sock_fd < 0) {
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
 
 	/* if we're running in foreground, we don't daemonize */
@@ -1196,6 +2387,15 @@ main(int argc, const char *argv[])
 	}
 	#endif
 
+	/* keep recent MCEs for clients which resume */
+	if (mced_retain_init(retain_len) < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+	#if ENABLE_MCEDB
+	load_retained();
+	#endif
+
 	#if ENABLE_DBUS
 	if (!no_dbus) {
 		int which_bus = DBUS_BUS_SYSTEM;
@@ -1208,18 +2408,17 @@ main(int argc, const char *argv[])
 	#endif
 
 	/* trap key signals */
-	signal(SIGHUP, reload_conf);
-	signal(SIGINT, clean_exit);
-	signal(SIGQUIT, clean_exit);
 	signal(SIGPIPE, SIG_IGN);
+	if (init_main_loop() < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
 
-	// Also handle SIGTERM, but we want the siginfo_t from it.
-	struct sigaction sigterm_action = {
-		.sa_sigaction = clean_exit_with_killer,
-		.sa_flags = SA_SIGINFO,
-	};
-
-	sigaction(SIGTERM, &sigterm_action, 0);
+	/* run rule actions without blocking */
+	if (mced_handler_init(max_handlers, handler_queue) < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
 
 	/* read in our configuration */
 	if (mced_read_conf(confdir) < 0) {
@@ -1233,160 +2432,91 @@ main(int argc, const char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	#if ENABLE_MCEDB
+	if (init_db_sync() < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	if (init_rate_limits() < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+
+	if (init_coalesce() < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+
+	/* start draining the kernel log */
+	if (start_ingest() < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+	ingest_watch.fd = ingest_eventfd;
+	ingest_watch.handler = ingest_event;
+	if (mced_watch(&ingest_watch, EPOLLIN) < 0) {
+		mced_log(LOG_ERR, "aborting");
+		exit(EXIT_FAILURE);
+	}
+
+	/* wait for clients */
+	if (!nosocket) {
+		sock_watch.fd = sock_fd;
+		sock_watch.handler = socket_event;
+		if (mced_watch(&sock_watch, EPOLLIN) < 0) {
+			mced_log(LOG_ERR, "aborting");
+			exit(EXIT_FAILURE);
+		}
+		if (socketfile_compat) {
+			compat_sock_watch.fd = compat_sock_fd;
+			compat_sock_watch.handler = socket_event;
+			if (mced_watch(&compat_sock_watch, EPOLLIN) < 0) {
+				mced_log(LOG_ERR, "aborting");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (socketfile_bin) {
+			bin_sock_watch.fd = bin_sock_fd;
+			bin_sock_watch.handler = socket_event;
+			if (mced_watch(&bin_sock_watch, EPOLLIN) < 0) {
+				mced_log(LOG_ERR, "aborting");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
 	/* main loop */
-	if (mce_rate_limit > 0) {
-		mced_log(LOG_INFO, "rate limiting MCEs to %lld per second\n",
-		         mce_rate_limit);
+	if (mce_rate_limit.rate > 0) {
+		mced_log(LOG_INFO, "rate limiting MCEs to %lld per second, "
+		         "in bursts of up to %lld\n", mce_rate_limit.rate,
+		         mce_rate_limit.burst);
 	}
 	mced_log(LOG_INFO, "waiting for events: per-event logging is %s\n",
 	         mced_log_events ? "on" : "off");
-	interval_ms = max_interval_ms;
-	while (1) {
-		struct pollfd ar[3];
+	while (!main_loop_done) {
+		struct epoll_event events[MCED_MAX_EVENTS];
 		int r;
-		int nfds = 0;
-		int mce_idx = -1;
-		int sock_idx = -1;
-		int compat_sock_idx = -1;
-		int timed_out;
-
-		/* open the device file */
-		mcelog_fd = get_mcelog_fd();
-
-		/* poll on the mcelog */
-		if (mcelog_fd >= 0 && mcelog_poll_works) {
-			ar[nfds].fd = mcelog_fd;
-			ar[nfds].events = POLLIN;
-			mce_idx = nfds;
-			nfds++;
-		}
+		int i;
 
-		/* poll on the socket */
-		if (!nosocket) {
-			ar[nfds].fd = sock_fd;
-			ar[nfds].events = POLLIN;
-			sock_idx = nfds;
-			nfds++;
-			if (socketfile_compat) {
-				ar[nfds].fd = compat_sock_fd;
-				ar[nfds].events = POLLIN;
-				compat_sock_idx = nfds;
-				nfds++;
-			}
-		}
-		if (max_interval_ms > 0) {
-			mced_debug(2, "DBG: next interval = %d msecs\n",
-			           interval_ms);
-		}
-		r = poll(ar, nfds, interval_ms);
+		r = epoll_wait(epoll_fd, events, MCED_MAX_EVENTS, -1);
+		main_wakeups++;
 		if (r < 0 && errno == EINTR) {
 			continue;
 		} else if (r < 0) {
-			mced_perror(LOG_ERR, "ERR: poll()");
+			mced_perror(LOG_ERR, "ERR: epoll_wait()");
 			continue;
 		}
-		/* see if poll() timed out */
-		if (r == 0) {
-			timed_out = 1;
-			mced_debug(1, "DBG: poll timeout\n");
-		} else {
-			timed_out = 0;
-		}
-
-		/* house keeping */
-		mced_close_dead_clients();
-
-		/*
-		 * Was it an MCE?  Be paranoid and always check.
-		 */
-		if (mce_idx >= 0 && ar[mce_idx].revents) {
-			int n;
 
-			/* check for MCEs */
-			n = do_pending_mces(mcelog_fd);
-			if (n == 0 && !timed_out && fake_dev_mcelog) {
-				/* FIFO closed */
-				mced_log(LOG_INFO,
-				         "fake mcelog device closed\n");
-				break;
-			}
-			/* if we are actively polling, adjust intervals */
-			if (max_interval_ms > 0) {
-				if (n == 0 && timed_out) {
-					interval_ms *= 2;
-					if (interval_ms > max_interval_ms) {
-						interval_ms = max_interval_ms;
-					}
-				} else if (n > 0) {
-					interval_ms /= 2;
-					if (interval_ms < min_interval_ms) {
-						interval_ms = min_interval_ms;
-					}
-				}
-			}
+		/* only the fds which are ready are looked at */
+		for (i = 0; i < r; i++) {
+			struct mced_watcher *w = events[i].data.ptr;
+			w->handler(w, events[i].events);
 		}
 
-		/* was it a new connection? */
-		if ((sock_idx >= 0 && ar[sock_idx].revents)
-		 || (compat_sock_idx >= 0 && ar[compat_sock_idx].revents)) {
-			int cli_fd;
-			struct ucred creds;
-			char buf[32];
-			static int accept_errors;
-			int idx;
-			int fd;
-			int is_legacy_client;
-
-			/*
-			 * Prefer the new socket if forced to choose.
-			 * We'll get the old socket on the next loop.
-			 */
-			if (sock_idx >= 0 && ar[sock_idx].revents) {
-				is_legacy_client = 0;
-				idx = sock_idx;
-				fd = sock_fd;
-			} else {
-				is_legacy_client = 1;
-				idx = compat_sock_idx;
-				fd = compat_sock_fd;
-			}
-
-			/* this shouldn't happen */
-			if (!(ar[idx].revents & POLLIN)) {
-				mced_log(LOG_WARNING,
-				    "odd, poll set flags 0x%x\n",
-				    ar[idx].revents);
-				continue;
-			}
-
-			/* accept and add to our lists */
-			cli_fd = ud_accept(fd, &creds);
-			if (cli_fd < 0) {
-				mced_perror(LOG_ERR,
-				    "ERR: can't accept client");
-				accept_errors++;
-				if (accept_errors >= 5) {
-					mced_log(LOG_ERR, "giving up\n");
-					clean_exit_with_status(EXIT_FAILURE);
-				}
-				continue;
-			}
-			accept_errors = 0;
-			if (creds.uid != 0
-			 && mced_non_root_clients >= clientmax) {
-				close(cli_fd);
-				mced_log(LOG_ERR,
-				         "too many non-root clients\n");
-				continue;
-			}
-			if (creds.uid != 0) {
-				mced_non_root_clients++;
-			}
-			fcntl(cli_fd, F_SETFD, FD_CLOEXEC);
-			snprintf(buf, sizeof(buf)-1, "%d[%d:%d]",
-				creds.pid, creds.uid, creds.gid);
-			mced_add_client(cli_fd, buf, is_legacy_client);
-		}
+		/* clients dropped in this batch are safe to free now */
+		mced_free_dead_clients();
 	}
 
 	clean_exit_with_status(EXIT_SUCCESS);
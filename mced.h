@@ -35,12 +35,21 @@
 #define MCED_CONFDIR			"/etc/mced"
 #define MCED_SOCKETFILE_V1		"/var/run/mced.socket"
 #define MCED_SOCKETFILE_V2		"/var/run/mced2.socket"
+#define MCED_SOCKETFILE_V3		"/var/run/mced3.socket"
 #define MCED_SOCKETMODE			0600
 #define MCED_PIDFILE			"/var/run/mced.pid"
 #define MCED_DBDIR			"/var/log/mced_db/"
 #define MCED_CLIENTMAX			128
 #define MCED_MAX_ERRS			5
 #define MCED_OVERFLOW_SUPPRESS_TIME	10 /* seconds */
+#define MCED_RING_SIZE			4096 /* MCEs */
+#define MCED_MAX_HANDLERS		8
+#define MCED_HANDLER_QUEUE		1024
+#define MCED_CLIENT_QUEUE		65536 /* bytes */
+#define MCED_SHM_SLOTS			4096 /* MCEs */
+#define MCED_DB_SYNC_MS			100  /* milliseconds */
+#define MCED_RETAIN			4096 /* MCEs */
+#define MCED_COALESCE_SLOTS		1024 /* distinct errors */
 
 #define PACKAGE				"mced"
 
@@ -90,6 +99,7 @@ struct kernel_mce {
 	uint64_t ipid;		/* MCA_IPID MSR: only valid on SMCA systems */
 	uint64_t ppin;		/* Protected Processor Inventory Number */
 	uint32_t microcode;	/* Microcode revision */
+	uint64_t kflags;	/* internal to the kernel (5.10+) */
 };
 
 /* ioctl() calls for /dev/mcelog */
@@ -100,6 +110,9 @@ struct kernel_mce {
 /* flags from MCE_GETCLEAR_FLAGS */
 #define MCE_FLAG_OVERFLOW    (1ULL << 0)
 
+/* the CPUs listed in a summary of coalesced MCEs */
+#define MCE_SUMMARY_CPUS     4
+
 /* this is our notion of an MCE */
 struct mce {
 	uint64_t mci_status;	/* MCi_STATUS */
@@ -108,6 +121,7 @@ struct mce {
 	uint64_t mci_synd;	/* MCi_SYND (Syndrome; SMCA-only) */
 	uint64_t mci_ipid;	/* MCi_IPID (IP Identification; SMCA-only) */
 	uint64_t mcg_status;	/* MCG_STATUS */
+	uint64_t ppin;		/* Protected Processor Inventory Number */
 	uint64_t tsc;		/* CPU timestamp counter */
 	uint64_t time;		/* MCED timestamp (usecs since epoch) */
 	uint64_t ip;		/* CPU instruction pointer */
@@ -117,13 +131,143 @@ struct mce {
 	uint32_t init_apic_id;	/* CPU initial APIC ID (-1UL for unknown) */
 	int32_t  socket;	/* CPU socket number (-1 for unknown) */
 	uint32_t mcg_cap;	/* MCG_CAP (0 for unknown) */
+	uint32_t microcode;	/* microcode revision (0 for unknown) */
 	uint16_t cs;		/* CPU code segment */
 	uint8_t  bank;		/* MC bank */
 	int8_t   vendor;	/* CPU vendor (enum cpu_vendor) */
+	uint64_t seq;		/* MCED sequence number */
+	/* only set in a summary of coalesced repeats */
+	uint32_t repeats;	/* how many repeats it stands for */
+	uint32_t ncpus;		/* how many CPUs they were seen on */
+	uint32_t cpus[MCE_SUMMARY_CPUS];	/* the first of those CPUs */
+	uint64_t first_time;	/* when the first repeat was seen */
+};
+
+/*
+ * The v3 (binary) socket protocol.
+ *
+ * Each write is one frame: a header followed by 'count' records of
+ * 'rec_size' bytes.  All fields are little-endian and the structures are
+ * packed.  New fields are only ever appended to the record, bumping the
+ * schema version, so a reader should use the smaller of 'rec_size' and
+ * its own sizeof(struct mce_v3_record), and skip any excess bytes.
+ * Likewise 'hdr_size' allows the header to grow.
+ *
+ * The results of a query are sent in frames with MCE_V3_F_QUERY set,
+ * followed by an empty frame which also has MCE_V3_F_END set (and
+ * MCE_V3_F_ERROR, if the query failed).  Frames of live MCEs have no
+ * flags set.
+ *
+ * A frame with MCE_V3_F_GAP set holds 'count' struct mce_v3_gap records
+ * instead of MCEs, each a range of sequence numbers which the client will
+ * never see.  An empty frame with MCE_V3_F_RESUME set marks the start of
+ * the MCEs replayed after a "resume" command.
+ *
+ * A record with a non-zero 'repeats' is a summary of that many repeats of
+ * a corrected error, coalesced since 'first_time'.  Its other fields are
+ * those of the latest repeat.
+ */
+#define MCE_V3_MAGIC		0x3344434dU	/* "MCD3" */
+#define MCE_V3_VERSION		4
+#define MCE_V3_BATCH_MAX	256		/* records per frame */
+#define MCE_V3_F_QUERY		0x0001		/* query results */
+#define MCE_V3_F_END		0x0002		/* end of query results */
+#define MCE_V3_F_ERROR		0x0004		/* the query failed */
+#define MCE_V3_F_GAP		0x0008		/* gap records */
+#define MCE_V3_F_RESUME		0x0010		/* replay starts here */
+
+struct mce_v3_header {
+	uint32_t magic;		/* MCE_V3_MAGIC */
+	uint16_t version;	/* schema version of the records */
+	uint16_t hdr_size;	/* bytes in this header */
+	uint16_t rec_size;	/* bytes in each record */
+	uint16_t flags;		/* MCE_V3_F_* */
+	uint32_t count;		/* number of records which follow */
+} __attribute__((packed));
+
+struct mce_v3_record {
+	uint64_t mci_status;
+	uint64_t mci_address;
+	uint64_t mci_misc;
+	uint64_t mci_synd;
+	uint64_t mci_ipid;
+	uint64_t mcg_status;
+	uint64_t tsc;
+	uint64_t time;
+	uint64_t ip;
+	int32_t  boot;
+	uint32_t cpu;
+	uint32_t cpuid_eax;
+	uint32_t init_apic_id;
+	int32_t  socket;
+	uint32_t mcg_cap;
+	uint16_t cs;
+	uint8_t  bank;
+	int8_t   vendor;
+	uint64_t seq;		/* since version 2 */
+	uint32_t repeats;	/* since version 3 */
+	uint32_t ncpus;		/* since version 3 */
+	uint32_t cpus[MCE_SUMMARY_CPUS];	/* since version 3 */
+	uint64_t first_time;	/* since version 3 */
+	uint64_t ppin;		/* since version 4 */
+	uint32_t microcode;	/* since version 4 */
+} __attribute__((packed));
+
+struct mce_v3_gap {
+	uint64_t first;		/* the first sequence number missed */
+	uint64_t count;		/* how many (an estimate for kernel overflows) */
+} __attribute__((packed));
+
+/*
+ * The shared-memory event ring.
+ *
+ * A client which sends "shm\n" on a v2 or v3 socket is answered with
+ * "shm\n" and a read-only memfd, passed with SCM_RIGHTS.  From then on
+ * that client gets no socket output at all: it mmap()s the fd and reads
+ * MCEs straight out of the ring.
+ *
+ * The mapping is a header followed by 'nslots' slots of 'slot_size' bytes,
+ * starting 'slots_offset' bytes in.  The MCE with sequence number 'n' (from
+ * 0) lives in slot n % nslots.  'head' is the sequence number of the next
+ * MCE to be written.  A slot's 'seq' is n + 1 once MCE 'n' is complete, and
+ * 0 while it is being rewritten.  A reader which finds a slot's 'seq' is
+ * not what it expected, before or after copying the record, has been
+ * lapped and lost events.  'futex' is incremented and woken (FUTEX_WAKE,
+ * not private) after each batch of MCEs is published.  Records are in the
+ * v3 wire format above.
+ */
+#define MCE_SHM_MAGIC		0x4d48534dU	/* "MSHM" */
+#define MCE_SHM_VERSION		1
+
+struct mce_shm_header {
+	uint32_t magic;		/* MCE_SHM_MAGIC */
+	uint16_t version;	/* MCE_SHM_VERSION */
+	uint16_t rec_version;	/* MCE_V3_VERSION of the records */
+	uint32_t rec_size;	/* bytes in each record */
+	uint32_t slot_size;	/* bytes in each slot */
+	uint32_t nslots;	/* a power of two */
+	uint32_t slots_offset;	/* where slot 0 starts */
+	_Alignas(64) _Atomic uint64_t head;
+	_Alignas(64) _Atomic uint32_t futex;
+};
+
+struct mce_shm_slot {
+	_Atomic uint64_t seq;
+	struct mce_v3_record rec;
 };
 
 /* bits from the MCi_STATUS register */
+#define MCI_STATUS_VAL		(1ULL<<63)	/* register is valid */
 #define MCI_STATUS_OVER		(1ULL<<62)	/* errors overflowed */
+#define MCI_STATUS_UC		(1ULL<<61)	/* uncorrected error */
+#define MCI_STATUS_ADDRV	(1ULL<<58)	/* MCi_ADDR is valid */
+#define MCI_STATUS_PCC		(1ULL<<57)	/* processor context corrupt */
+
+/*
+ * Uncorrected errors are urgent: they have their own ingest ring, skip the
+ * rate limits, and go ahead of anything queued for handlers or clients.
+ */
+#define MCED_MCE_URGENT(mce)	(((mce)->mci_status & MCI_STATUS_UC) != 0)
 
 #ifdef __GNUC__
 #  define PRINTF_ARGS(fmt, var)  __attribute__((format(printf, fmt, var)))
@@ -131,24 +275,121 @@ struct mce {
 #  define PRINTF_ARGS(fmtarg, vararg)
 #endif
 
+/* what to do when a client's output queue is full */
+enum client_overflow {
+	CLIENT_OVERFLOW_DROP_OLDEST = 0,
+	CLIENT_OVERFLOW_DROP_NEWEST,
+	CLIENT_OVERFLOW_DISCONNECT,
+};
+
+/*
+ * Something the main loop waits on.  When epoll reports any of the
+ * watched events on 'fd', 'handler' is called from the main loop with
+ * the events which fired.
+ */
+struct mced_watcher {
+	int fd;
+	void (*handler)(struct mced_watcher *w, uint32_t events);
+};
+
+/*
+ * A token bucket: 'rate' events per second, with bursts of up to 'burst'.
+ * A bucket with no rate never limits anything.
+ */
+struct mced_tbucket {
+	uint64_t interval;		/* nsecs per token, 0 for no limit */
+	uint64_t depth;			/* most credit held, in nsecs */
+	uint64_t credit;		/* credit on hand, in nsecs */
+	uint64_t last;			/* when credit was last added */
+	unsigned long long passed;	/* tokens taken */
+	unsigned long long limited;	/* takes refused */
+};
+
 /*
  * mced.c
  */
 extern int mced_debug_level;
 extern int mced_log_events;
 extern int mced_non_root_clients;
+extern size_t mced_client_queue_len;
+extern int mced_client_overflow;
+extern int mced_shm_slots;
 extern size_t mced_kernel_record_len;
+extern uint64_t mced_next_seq;
+extern struct mced_tbucket mced_cmd_limit;
+extern struct mced_tbucket mced_client_limit;
+extern struct mced_tbucket mced_shm_limit;
 extern int mced_log(int level, const char *fmt, ...) PRINTF_ARGS(2, 3);
 extern int mced_debug(int min_dbg_lvl, const char *fmt, ...) PRINTF_ARGS(2, 3);
 extern int mced_perror(int level, const char *str);
+extern int mced_watch(struct mced_watcher *w, uint32_t events);
+extern int mced_rewatch(struct mced_watcher *w, uint32_t events);
+extern void mced_unwatch(struct mced_watcher *w);
 
 /*
  * rules.c
  */
 extern int mced_read_conf(const char *confdir);
-extern int mced_add_client(int client, const char *origin, int is_legacy);
+extern int mced_add_client(int client, const char *origin, int proto);
 extern int mced_cleanup_rules(int do_detach);
 extern int mced_handle_mce(struct mce *mce);
-extern void mced_close_dead_clients(void);
+extern void mced_flush_clients(void);
+extern void mced_mce_to_v3(const struct mce *mce, struct mce_v3_record *rec);
+extern void mced_v3_to_mce(const struct mce_v3_record *rec, struct mce *mce);
+extern void mced_handle_gap(uint64_t first, uint64_t count);
+extern void mced_free_dead_clients(void);
+extern void mced_dump_client_stats(void);
+extern void mced_dump_rule_stats(void);
+
+/*
+ * handler.c
+ */
+extern int mced_handler_init(int max_running, int max_queued);
+extern int mced_run_handler(char *cmd, int urgent);
+extern int mced_run_handler_input(char *cmd, int input, unsigned count,
+                                  int urgent);
+extern void mced_reap_handlers(void);
+extern pid_t mced_spawn_coproc(const char *cmd, int *fd);
+extern void mced_dump_handler_stats(void);
+
+/*
+ * pipe.c
+ */
+extern int mced_coproc_exited(pid_t pid, int status);
+
+/*
+ * shm.c
+ */
+extern int mced_shm_get_fd(void);
+extern void mced_shm_publish(const struct mce *mce);
+extern void mced_shm_wake(void);
+extern void mced_dump_shm_stats(void);
+
+/*
+ * tbucket.c
+ */
+extern void mced_tbucket_init(struct mced_tbucket *tb, long long rate,
+                              long long burst);
+extern uint64_t mced_tbucket_wait(struct mced_tbucket *tb);
+extern int mced_tbucket_take(struct mced_tbucket *tb);
+
+/*
+ * coalesce.c
+ */
+extern int mced_coalesce_init(int window_ms, void (*emit)(struct mce *mce));
+extern int mced_coalesce(const struct mce *mce);
+extern long long mced_coalesce_expire(void);
+extern void mced_coalesce_flush(void);
+extern void mced_dump_coalesce_stats(void);
+
+/*
+ * retain.c
+ */
+extern int mced_retain_init(size_t size);
+extern void mced_retain(const struct mce *mce);
+extern uint64_t mced_retain_start(void);
+extern uint64_t mced_retain_end(void);
+extern uint64_t mced_retain_find(uint64_t seq);
+extern const struct mce *mced_retain_get(uint64_t pos);
 
 #endif /* MCED_H__ */
@@ -0,0 +1,920 @@
+/*
+ *  mcedb.c - append-only MCE store
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mced.h"
+#include "mcedb.h"
+
+/* a mapped segment; all but the last are read-only */
+struct mcedb_segment {
+	uint64_t first;		/* index of the first record */
+	uint32_t capacity;
+	uint32_t count;		/* valid records */
+	uint64_t min_time;
+	uint64_t max_time;
+	char *map;
+	size_t map_len;
+};
+
+/*
+ * The query indexes live only in memory, and are rebuilt from the
+ * segments at startup.
+ *
+ * The time index is sparse: it holds the range of MCE times in each block
+ * of MCEDB_BLOCK records, so whole blocks can be skipped without reading
+ * them.  It doesn't assume that times only go forward.
+ *
+ * The posting lists hold the index of every record for a given cpu,
+ * socket or bank, in order.  Keys beyond a list's limit are not indexed;
+ * queries for them fall back to the time index.
+ */
+#define MCEDB_BLOCK_SHIFT	6
+#define MCEDB_BLOCK		(1 << MCEDB_BLOCK_SHIFT)
+
+struct mcedb_block {
+	uint64_t min_time;
+	uint64_t max_time;
+};
+
+struct mcedb_postings {
+	uint64_t *idx;
+	size_t n;
+	size_t alloc;
+};
+
+struct mcedb_keyindex {
+	struct mcedb_postings *lists;
+	uint32_t nlists;
+	uint32_t limit;		/* highest key + 1 we will index */
+};
+
+enum { KEY_CPU, KEY_SOCKET, KEY_BANK, NKEYS };
+
+struct mce_database {
+	char *dir;
+	int dir_fd;
+	int lock_fd;
+
+	struct mcedb_segment *segs;
+	int nsegs;
+
+	/* the last segment is the one being appended to */
+	int fd;
+	struct mcedb_seg_header *hdr;
+
+	int pending;		/* appends since the last commit */
+
+	struct mcedb_block *blocks;
+	size_t nblocks;
+	struct mcedb_keyindex keys[NKEYS];
+	int index_broken;	/* ran out of memory for the posting lists */
+};
+
+/*
+ * A query in progress.  It only ever looks at records which existed when
+ * the query started.
+ */
+struct mcedb_cursor {
+	struct mce_database *db;
+	struct mcedb_query q;
+	uint64_t end;		/* mcedb_end() when the query started */
+	int key;		/* the posting list we walk, or -1 */
+	uint32_t key_val;
+	uint64_t pos;		/* next list entry, or next record index */
+	int done;
+};
+
+/* how many records one mcedb_query_next() may look at */
+#define MCEDB_QUERY_WORK	65536
+
+#define SEG_LEN(cap) \
+	(MCEDB_HDR_SIZE + (size_t)(cap) * sizeof(struct mcedb_record))
+
+static uint32_t
+crc32(const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const unsigned char *p = buf;
+	uint32_t crc = 0xffffffff;
+
+	if (!table[1]) {
+		uint32_t i;
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+			int k;
+			for (k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	while (len--) {
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffff;
+}
+
+static struct mcedb_segment *
+active_segment(struct mce_database *db)
+{
+	return &db->segs[db->nsegs - 1];
+}
+
+static struct mcedb_record *
+seg_record(const struct mcedb_segment *seg, uint32_t slot)
+{
+	return (struct mcedb_record *)(seg->map + MCEDB_HDR_SIZE
+	       + (size_t)slot * sizeof(struct mcedb_record));
+}
+
+/* find a record by index, or NULL if it is not in the log */
+static const struct mcedb_record *
+find_record(struct mce_database *db, uint64_t index)
+{
+	int lo = 0;
+	int hi = db->nsegs;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		const struct mcedb_segment *seg = &db->segs[mid];
+
+		if (index < seg->first) {
+			hi = mid;
+		} else if (index >= seg->first + seg->count) {
+			lo = mid + 1;
+		} else {
+			return seg_record(seg, index - seg->first);
+		}
+	}
+	return NULL;
+}
+
+/* is this slot a complete record with the right index? */
+static int
+record_is_valid(const struct mcedb_record *rec, uint64_t index)
+{
+	return le64toh(rec->index) == index
+	    && le32toh(rec->crc) == crc32(rec, offsetof(struct mcedb_record,
+	                                                 crc));
+}
+
+static void
+seg_path(struct mce_database *db, uint64_t first, const char *suffix,
+         char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/seg-%016llx%s", db->dir,
+	         (unsigned long long)first, suffix);
+}
+
+/*
+ * Index maintenance
+ */
+
+static int
+add_posting(struct mcedb_keyindex *k, uint32_t key, uint64_t index)
+{
+	struct mcedb_postings *p;
+
+	if (key >= k->limit) {
+		/* not indexed */
+		return 0;
+	}
+	if (key >= k->nlists) {
+		uint32_t n = k->nlists ? k->nlists : 8;
+		struct mcedb_postings *lists;
+		while (n <= key) {
+			n *= 2;
+		}
+		lists = realloc(k->lists, n * sizeof(*lists));
+		if (!lists) {
+			return -1;
+		}
+		memset(lists + k->nlists, 0,
+		       (n - k->nlists) * sizeof(*lists));
+		k->lists = lists;
+		k->nlists = n;
+	}
+
+	p = &k->lists[key];
+	if (p->n == p->alloc) {
+		size_t n = p->alloc ? p->alloc * 2 : 64;
+		uint64_t *idx = realloc(p->idx, n * sizeof(*idx));
+		if (!idx) {
+			return -1;
+		}
+		p->idx = idx;
+		p->alloc = n;
+	}
+	p->idx[p->n++] = index;
+	return 0;
+}
+
+static void
+index_record(struct mce_database *db, const struct mcedb_record *rec)
+{
+	uint64_t index = le64toh(rec->index);
+	uint64_t t = le64toh(rec->mce.time);
+	size_t b = index >> MCEDB_BLOCK_SHIFT;
+	int32_t socket = (int32_t)le32toh(rec->mce.socket);
+
+	if (b >= db->nblocks) {
+		size_t n = db->nblocks ? db->nblocks : 1024;
+		struct mcedb_block *blocks;
+		size_t i;
+		while (n <= b) {
+			n *= 2;
+		}
+		blocks = realloc(db->blocks, n * sizeof(*blocks));
+		if (!blocks) {
+			mced_perror(LOG_ERR, "ERR: realloc()");
+			db->index_broken = 1;
+			return;
+		}
+		/* an empty block overlaps no time range */
+		for (i = db->nblocks; i < n; i++) {
+			blocks[i].min_time = UINT64_MAX;
+			blocks[i].max_time = 0;
+		}
+		db->blocks = blocks;
+		db->nblocks = n;
+	}
+	if (t < db->blocks[b].min_time) {
+		db->blocks[b].min_time = t;
+	}
+	if (t > db->blocks[b].max_time) {
+		db->blocks[b].max_time = t;
+	}
+
+	if (add_posting(&db->keys[KEY_CPU], le32toh(rec->mce.cpu), index) < 0
+	 || (socket >= 0
+	  && add_posting(&db->keys[KEY_SOCKET], socket, index) < 0)
+	 || add_posting(&db->keys[KEY_BANK], rec->mce.bank, index) < 0) {
+		if (!db->index_broken) {
+			mced_log(LOG_ERR, "ERR: out of memory for the "
+			         "database index, queries will be slow\n");
+		}
+		db->index_broken = 1;
+	}
+}
+
+static void
+free_indexes(struct mce_database *db)
+{
+	int i;
+
+	for (i = 0; i < NKEYS; i++) {
+		struct mcedb_keyindex *k = &db->keys[i];
+		uint32_t j;
+		for (j = 0; j < k->nlists; j++) {
+			free(k->lists[j].idx);
+		}
+		free(k->lists);
+	}
+	free(db->blocks);
+}
+
+/*
+ * Segments
+ */
+
+/* map an existing segment, for appending if it is the last one */
+static int
+map_segment(struct mce_database *db, uint64_t first, int writable)
+{
+	char path[4096];
+	struct stat st;
+	struct mcedb_seg_header *hdr;
+	struct mcedb_segment *segs;
+	struct mcedb_segment *seg;
+	int fd;
+
+	segs = realloc(db->segs, (db->nsegs + 1) * sizeof(*segs));
+	if (!segs) {
+		mced_perror(LOG_ERR, "ERR: realloc()");
+		return -1;
+	}
+	db->segs = segs;
+	seg = &segs[db->nsegs];
+	memset(seg, 0, sizeof(*seg));
+
+	seg_path(db, first, "", path, sizeof(path));
+	fd = open(path, (writable ? O_RDWR : O_RDONLY)|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		mced_log(LOG_ERR, "ERR: can't open %s: %s\n",
+		         path, strerror(errno));
+		goto fail;
+	}
+	if ((size_t)st.st_size < MCEDB_HDR_SIZE) {
+		mced_log(LOG_ERR, "ERR: %s is truncated\n", path);
+		goto fail;
+	}
+	seg->map_len = st.st_size;
+	seg->map = mmap(NULL, seg->map_len,
+	                PROT_READ|(writable ? PROT_WRITE : 0), MAP_SHARED,
+	                fd, 0);
+	if (seg->map == MAP_FAILED) {
+		seg->map = NULL;
+		mced_log(LOG_ERR, "ERR: can't mmap %s: %s\n",
+		         path, strerror(errno));
+		goto fail;
+	}
+
+	hdr = (struct mcedb_seg_header *)seg->map;
+	if (le32toh(hdr->magic) != MCEDB_MAGIC
+	 || le16toh(hdr->version) != MCEDB_VERSION
+	 || le16toh(hdr->rec_size) != sizeof(struct mcedb_record)
+	 || le32toh(hdr->hdr_size) != MCEDB_HDR_SIZE
+	 || le64toh(hdr->first_index) != first
+	 || SEG_LEN(le32toh(hdr->capacity)) > seg->map_len) {
+		mced_log(LOG_ERR, "ERR: %s is not a valid segment\n", path);
+		munmap(seg->map, seg->map_len);
+		goto fail;
+	}
+	seg->first = first;
+	seg->capacity = le32toh(hdr->capacity);
+	db->nsegs++;
+
+	if (writable) {
+		db->fd = fd;
+		db->hdr = hdr;
+	} else {
+		/* the mapping is all we need */
+		close(fd);
+	}
+	return 0;
+
+ fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * Create a new, empty segment.  It is built under a temporary name and
+ * renamed into place, so a crash never leaves a half-made segment.
+ */
+static int
+create_segment(struct mce_database *db, uint64_t first)
+{
+	char tmp[4096];
+	char path[4096];
+	struct mcedb_seg_header hdr;
+	int fd;
+	int r;
+
+	seg_path(db, first, ".tmp", tmp, sizeof(tmp));
+	seg_path(db, first, "", path, sizeof(path));
+
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		mced_log(LOG_ERR, "ERR: can't create %s: %s\n",
+		         tmp, strerror(errno));
+		return -1;
+	}
+	/* allocate it all now, so writes through the map can't fail later */
+	r = posix_fallocate(fd, 0, SEG_LEN(MCEDB_SEG_RECORDS));
+	if (r != 0) {
+		mced_log(LOG_ERR, "ERR: can't allocate %s: %s\n",
+		         tmp, strerror(r));
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htole32(MCEDB_MAGIC);
+	hdr.version = htole16(MCEDB_VERSION);
+	hdr.rec_size = htole16(sizeof(struct mcedb_record));
+	hdr.hdr_size = htole32(MCEDB_HDR_SIZE);
+	hdr.capacity = htole32(MCEDB_SEG_RECORDS);
+	hdr.first_index = htole64(first);
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	 || fdatasync(fd) < 0) {
+		mced_log(LOG_ERR, "ERR: can't write %s: %s\n",
+		         tmp, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		mced_log(LOG_ERR, "ERR: can't rename %s: %s\n",
+		         tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	fsync(db->dir_fd);
+
+	mced_debug(1, "DBG: created database segment %s\n", path);
+	return map_segment(db, first, 1);
+
+ fail:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/* count the valid records in a segment, and index them */
+static void
+scan_segment(struct mce_database *db, struct mcedb_segment *seg)
+{
+	uint32_t n;
+
+	for (n = 0; n < seg->capacity; n++) {
+		const struct mcedb_record *rec = seg_record(seg, n);
+		uint64_t t;
+
+		if (!record_is_valid(rec, seg->first + n)) {
+			break;
+		}
+		t = le64toh(rec->mce.time);
+		if (n == 0 || t < seg->min_time) {
+			seg->min_time = t;
+		}
+		if (t > seg->max_time) {
+			seg->max_time = t;
+		}
+		index_record(db, rec);
+	}
+	seg->count = n;
+}
+
+/*
+ * Find where the log really ends in the last segment.  Anything after
+ * the first bad record is cleared, so that a stale record there can never
+ * be mistaken for a new one after a later crash.
+ */
+static int
+recover_segment(struct mce_database *db)
+{
+	struct mcedb_segment *seg = active_segment(db);
+	uint32_t n;
+
+	scan_segment(db, seg);
+	n = seg->count;
+	if (n != le64toh(db->hdr->count)) {
+		mced_log(LOG_WARNING,
+		         "database: recovered %u records (header said %llu)\n",
+		         n, (unsigned long long)le64toh(db->hdr->count));
+	}
+	if (n < seg->capacity) {
+		memset(seg_record(seg, n), 0,
+		       (size_t)(seg->capacity - n) * sizeof(struct mcedb_record));
+	}
+	db->hdr->count = htole64(n);
+	db->hdr->min_time = htole64(seg->min_time);
+	db->hdr->max_time = htole64(seg->max_time);
+
+	if (fdatasync(db->fd) < 0) {
+		mced_perror(LOG_ERR, "ERR: fdatasync()");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * List the segments in order of their first index.  Returns the number
+ * found, or -1 on error.  The caller must free the list.
+ */
+static int
+list_segments(struct mce_database *db, uint64_t **listp)
+{
+	DIR *dir;
+	struct dirent *de;
+	uint64_t *list = NULL;
+	int n = 0;
+	int alloc = 0;
+
+	dir = opendir(db->dir);
+	if (!dir) {
+		mced_log(LOG_ERR, "ERR: can't read %s: %s\n",
+		         db->dir, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		unsigned long long first;
+		char junk;
+
+		if (sscanf(de->d_name, "seg-%16llx%c", &first, &junk) == 2
+		 && junk == '.') {
+			/* a leftover from a crash during creation */
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%s",
+			         db->dir, de->d_name);
+			unlink(path);
+			continue;
+		}
+		if (sscanf(de->d_name, "seg-%16llx", &first) != 1) {
+			continue;
+		}
+		if (n == alloc) {
+			uint64_t *l;
+			alloc = alloc ? alloc * 2 : 16;
+			l = realloc(list, alloc * sizeof(*l));
+			if (!l) {
+				mced_perror(LOG_ERR, "ERR: realloc()");
+				free(list);
+				closedir(dir);
+				return -1;
+			}
+			list = l;
+		}
+		list[n++] = first;
+	}
+	closedir(dir);
+
+	if (n) {
+		qsort(list, n, sizeof(*list), cmp_u64);
+	}
+	*listp = list;
+	return n;
+}
+
+struct mce_database *
+mcedb_open(const char *dir)
+{
+	struct mce_database *db;
+	char path[4096];
+	uint64_t *segs = NULL;
+	int nsegs;
+	int i;
+
+	db = calloc(1, sizeof(*db));
+	if (!db) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	db->fd = db->dir_fd = db->lock_fd = -1;
+	db->keys[KEY_CPU].limit = 65536;
+	db->keys[KEY_SOCKET].limit = 65536;
+	db->keys[KEY_BANK].limit = 256;
+	db->dir = strdup(dir);
+	if (!db->dir) {
+		mced_perror(LOG_ERR, "ERR: strdup()");
+		goto fail;
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		mced_log(LOG_ERR, "ERR: can't create %s: %s\n",
+		         dir, strerror(errno));
+		goto fail;
+	}
+	db->dir_fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (db->dir_fd < 0) {
+		mced_log(LOG_ERR, "ERR: can't open %s: %s\n",
+		         dir, strerror(errno));
+		goto fail;
+	}
+
+	/* only one writer at a time */
+	snprintf(path, sizeof(path), "%s/lock", dir);
+	db->lock_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (db->lock_fd < 0 || flock(db->lock_fd, LOCK_EX|LOCK_NB) < 0) {
+		mced_log(LOG_ERR, "ERR: can't lock database %s: %s\n",
+		         dir, strerror(errno));
+		goto fail;
+	}
+
+	nsegs = list_segments(db, &segs);
+	if (nsegs < 0) {
+		goto fail;
+	}
+	if (nsegs == 0) {
+		if (create_segment(db, 0) < 0) {
+			goto fail;
+		}
+	}
+	for (i = 0; i < nsegs - 1; i++) {
+		if (map_segment(db, segs[i], 0) < 0) {
+			goto fail;
+		}
+		scan_segment(db, active_segment(db));
+	}
+	if (nsegs > 0) {
+		if (map_segment(db, segs[nsegs - 1], 1) < 0
+		 || recover_segment(db) < 0) {
+			goto fail;
+		}
+	}
+	free(segs);
+
+	mced_log(LOG_INFO, "database %s holds %lld records in %d segment%s\n",
+	         dir, mcedb_end(db), db->nsegs, (db->nsegs == 1) ? "" : "s");
+	return db;
+
+ fail:
+	free(segs);
+	mcedb_close(db);
+	return NULL;
+}
+
+void
+mcedb_close(struct mce_database *db)
+{
+	int i;
+
+	if (!db) {
+		return;
+	}
+	if (db->fd >= 0) {
+		mcedb_commit(db);
+		close(db->fd);
+	}
+	for (i = 0; i < db->nsegs; i++) {
+		munmap(db->segs[i].map, db->segs[i].map_len);
+	}
+	free(db->segs);
+	free_indexes(db);
+	if (db->lock_fd >= 0) {
+		close(db->lock_fd);
+	}
+	if (db->dir_fd >= 0) {
+		close(db->dir_fd);
+	}
+	free(db->dir);
+	free(db);
+}
+
+int
+mcedb_append(struct mce_database *db, const struct mce *mce)
+{
+	struct mcedb_segment *seg = active_segment(db);
+	struct mcedb_record *rec;
+	uint64_t t;
+
+	/* move on to a new segment when this one is full */
+	if (seg->count == seg->capacity) {
+		uint64_t next = seg->first + seg->capacity;
+		if (mcedb_commit(db) < 0) {
+			return -1;
+		}
+		/* the old segment stays mapped for queries */
+		close(db->fd);
+		db->fd = -1;
+		db->hdr = NULL;
+		if (create_segment(db, next) < 0) {
+			return -1;
+		}
+		seg = active_segment(db);
+	}
+
+	rec = seg_record(seg, seg->count);
+	rec->index = htole64(seg->first + seg->count);
+	mced_mce_to_v3(mce, &rec->mce);
+	rec->crc = htole32(crc32(rec, offsetof(struct mcedb_record, crc)));
+
+	t = mce->time;
+	if (seg->count == 0 || t < seg->min_time) {
+		seg->min_time = t;
+		db->hdr->min_time = htole64(t);
+	}
+	if (t > seg->max_time) {
+		seg->max_time = t;
+		db->hdr->max_time = htole64(t);
+	}
+	seg->count++;
+	db->hdr->count = htole64(seg->count);
+	db->pending++;
+
+	index_record(db, rec);
+
+	return 0;
+}
+
+long long
+mcedb_end(struct mce_database *db)
+{
+	struct mcedb_segment *seg = active_segment(db);
+
+	return seg->first + seg->count;
+}
+
+int
+mcedb_read(struct mce_database *db, long long index,
+           struct mce_v3_record *rec)
+{
+	const struct mcedb_record *r;
+
+	if (index < 0 || !(r = find_record(db, index))) {
+		return -1;
+	}
+	*rec = r->mce;
+	return 0;
+}
+
+int
+mcedb_pending(struct mce_database *db)
+{
+	return db->pending;
+}
+
+int
+mcedb_commit(struct mce_database *db)
+{
+	if (!db->pending) {
+		return 0;
+	}
+	if (fdatasync(db->fd) < 0) {
+		mced_perror(LOG_ERR, "ERR: fdatasync()");
+		return -1;
+	}
+	mced_debug(2, "DBG: committed %d database records\n", db->pending);
+	db->pending = 0;
+	return 0;
+}
+
+/*
+ * Queries
+ */
+
+void
+mcedb_query_init(struct mcedb_query *q)
+{
+	memset(q, 0, sizeof(*q));
+	q->until = UINT64_MAX;
+	q->cpu = MCEDB_ANY;
+	q->socket = MCEDB_ANY;
+	q->bank = MCEDB_ANY;
+}
+
+static int
+record_matches(const struct mcedb_query *q, const struct mce_v3_record *rec)
+{
+	uint64_t t = le64toh(rec->time);
+
+	return t >= q->since && t <= q->until
+	    && (q->cpu == MCEDB_ANY || q->cpu == le32toh(rec->cpu))
+	    && (q->socket == MCEDB_ANY
+	     || q->socket == (int32_t)le32toh(rec->socket))
+	    && (q->bank == MCEDB_ANY || q->bank == rec->bank)
+	    && (le64toh(rec->mci_status) & q->status_mask)
+	       == q->status_value;
+}
+
+/* could the block holding this record have anything in the time range? */
+static int
+block_overlaps(const struct mce_database *db, const struct mcedb_query *q,
+               uint64_t index)
+{
+	size_t i = index >> MCEDB_BLOCK_SHIFT;
+
+	if (i >= db->nblocks) {
+		/* the index is incomplete, so we must look */
+		return 1;
+	}
+	return db->blocks[i].max_time >= q->since
+	    && db->blocks[i].min_time <= q->until;
+}
+
+struct mcedb_cursor *
+mcedb_query(struct mce_database *db, const struct mcedb_query *q)
+{
+	struct mcedb_cursor *c;
+	long long vals[NKEYS];
+	size_t best = SIZE_MAX;
+	int i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	c->db = db;
+	c->q = *q;
+	c->end = mcedb_end(db);
+	c->key = -1;
+
+	/* walk the shortest posting list that the query can use */
+	vals[KEY_CPU] = q->cpu;
+	vals[KEY_SOCKET] = q->socket;
+	vals[KEY_BANK] = q->bank;
+	for (i = 0; i < NKEYS && !db->index_broken; i++) {
+		const struct mcedb_keyindex *k = &db->keys[i];
+		size_t n;
+
+		if (vals[i] < 0 || vals[i] >= k->limit) {
+			continue;
+		}
+		n = (vals[i] < k->nlists) ? k->lists[vals[i]].n : 0;
+		if (n < best) {
+			best = n;
+			c->key = i;
+			c->key_val = vals[i];
+		}
+	}
+
+	mced_debug(1, "DBG: query uses %s (%zu candidates)\n",
+	           (c->key == KEY_CPU) ? "the cpu list" :
+	           (c->key == KEY_SOCKET) ? "the socket list" :
+	           (c->key == KEY_BANK) ? "the bank list" : "the time index",
+	           (c->key < 0) ? (size_t)c->end : best);
+
+	return c;
+}
+
+/* the next record index from a posting list, or c->end */
+static uint64_t
+next_posting(struct mcedb_cursor *c)
+{
+	const struct mcedb_keyindex *k = &c->db->keys[c->key];
+	const struct mcedb_postings *p;
+
+	if (c->key_val >= k->nlists) {
+		return c->end;
+	}
+	p = &k->lists[c->key_val];
+	if (c->pos >= p->n || p->idx[c->pos] >= c->end) {
+		return c->end;
+	}
+	return p->idx[c->pos++];
+}
+
+/*
+ * Fetch up to 'max' more matching records.  This does a bounded amount of
+ * work, so it can return 0 before the query is done.
+ */
+int
+mcedb_query_next(struct mcedb_cursor *c, struct mce_v3_record *recs, int max)
+{
+	struct mce_database *db = c->db;
+	int work = MCEDB_QUERY_WORK;
+	int n = 0;
+
+	while (n < max && work-- > 0) {
+		const struct mcedb_record *rec;
+		uint64_t index;
+
+		if (c->key >= 0) {
+			index = next_posting(c);
+		} else {
+			index = c->pos;
+			if ((index & (MCEDB_BLOCK - 1)) == 0
+			 && index < c->end
+			 && !block_overlaps(db, &c->q, index)) {
+				/* skip the whole block */
+				c->pos += MCEDB_BLOCK;
+				continue;
+			}
+			c->pos++;
+		}
+		if (index >= c->end) {
+			c->done = 1;
+			break;
+		}
+		if (!block_overlaps(db, &c->q, index)) {
+			continue;
+		}
+
+		rec = find_record(db, index);
+		if (rec && record_matches(&c->q, &rec->mce)) {
+			recs[n++] = rec->mce;
+		}
+	}
+
+	return n;
+}
+
+int
+mcedb_query_done(const struct mcedb_cursor *c)
+{
+	return c->done;
+}
+
+void
+mcedb_query_free(struct mcedb_cursor *c)
+{
+	free(c);
+}
@@ -0,0 +1,108 @@
+#ifndef MCEDB_H__
+#define MCEDB_H__
+
+#include <stdint.h>
+
+#include "mced.h"
+
+/*
+ * A simple append-only MCE store.
+ *
+ * The database is a directory of segment files, named for the index of
+ * their first record ("seg-%016llx").  Each segment is preallocated to hold
+ * a fixed number of fixed-size records, and is written through mmap().
+ * Its header holds the range of record indexes and MCE times it covers.
+ * Every record carries its own index and a CRC, so after a crash the end
+ * of the log is wherever the valid records stop, whatever the header says.
+ *
+ * All values on disk are little-endian.
+ */
+#define MCEDB_MAGIC		0x4244434dU	/* "MCDB" */
+#define MCEDB_VERSION		4
+#define MCEDB_HDR_SIZE		4096
+#define MCEDB_SEG_RECORDS	16384
+
+struct mcedb_seg_header {
+	uint32_t magic;		/* MCEDB_MAGIC */
+	uint16_t version;	/* MCEDB_VERSION */
+	uint16_t rec_size;	/* bytes in each record */
+	uint32_t hdr_size;	/* records start this far in */
+	uint32_t capacity;	/* records this segment can hold */
+	uint64_t first_index;	/* index of the first record */
+	uint64_t count;		/* records written (a hint after a crash) */
+	uint64_t min_time;	/* earliest MCE time in the segment */
+	uint64_t max_time;	/* latest MCE time in the segment */
+} __attribute__((packed));
+
+struct mcedb_record {
+	uint64_t index;		/* position in the whole log */
+	struct mce_v3_record mce;
+	uint32_t crc;		/* crc32 of everything above */
+} __attribute__((packed));
+
+struct mce_database;
+
+/* open (creating if needed) the database in 'dir' */
+extern struct mce_database *mcedb_open(const char *dir);
+extern void mcedb_close(struct mce_database *db);
+
+/*
+ * Append an MCE.  It is not durable until the next mcedb_commit().
+ * Returns 0 on success or -1 on error.
+ */
+extern int mcedb_append(struct mce_database *db, const struct mce *mce);
+
+/* the index the next record will get (the number ever appended) */
+extern long long mcedb_end(struct mce_database *db);
+
+/* read the record at 'index'; returns 0, or -1 if there is none */
+extern int mcedb_read(struct mce_database *db, long long index,
+                      struct mce_v3_record *rec);
+
+/* the number of appends not yet committed */
+extern int mcedb_pending(struct mce_database *db);
+
+/* make every append so far durable, with a single fdatasync() */
+extern int mcedb_commit(struct mce_database *db);
+
+/*
+ * Queries.  A record matches if its time is in [since, until], each of
+ * cpu, socket and bank is MCEDB_ANY or equal, and (mci_status &
+ * status_mask) == status_value.  Queries are served from indexes built in
+ * memory at startup, and see only the records which existed when they
+ * started.
+ */
+#define MCEDB_ANY		(-1LL)
+
+struct mcedb_query {
+	uint64_t since;		/* MCE times, in usecs since the epoch */
+	uint64_t until;
+	long long cpu;
+	long long socket;
+	long long bank;
+	uint64_t status_mask;
+	uint64_t status_value;
+};
+
+struct mcedb_cursor;
+
+/* set up a query which matches everything */
+extern void mcedb_query_init(struct mcedb_query *q);
+
+extern struct mcedb_cursor *mcedb_query(struct mce_database *db,
+                                        const struct mcedb_query *q);
+
+/*
+ * Copy up to 'max' more matching records into 'recs', returning how many.
+ * Each call does a bounded amount of work, so it may return 0 before the
+ * query is done; check mcedb_query_done().
+ */
+extern int mcedb_query_next(struct mcedb_cursor *c,
+                            struct mce_v3_record *recs, int max);
+extern int mcedb_query_done(const struct mcedb_cursor *c);
+extern void mcedb_query_free(struct mcedb_cursor *c);
+
+/* the daemon's database */
+extern struct mce_database *mced_db;
+
+#endif  /* MCEDB_H__ */
@@ -0,0 +1,170 @@
+/*
+ *  old_fmt.c - the snprintf() formatting which fields.c and fmt.c replaced,
+ *  for the tests and the benchmark to check and time them against
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "old_fmt.h"
+
+/* what the v1 line used to be */
+void
+old_v1(const struct mce *mce, char *buf, size_t size)
+{
+	snprintf(buf, size,
+	         "%u %u 0x%016llx 0x%016llx 0x%016llx 0x%016llx "
+	         "0x%016llx %d\n",
+	         mce->cpu, mce->bank,
+	         (unsigned long long)mce->mci_status,
+	         (unsigned long long)mce->mci_address,
+	         (unsigned long long)mce->mci_misc,
+	         (unsigned long long)mce->mcg_status,
+	         (unsigned long long)mce->time, mce->boot);
+}
+
+/* what the v2 line used to be */
+void
+old_v2(const struct mce *mce, char *buf, size_t size)
+{
+	char cpus[MCE_KIND_MAX_CPUS + 1];
+	unsigned i, n;
+	int len = 0;
+
+	if (!mce->repeats) {
+		sprintf(cpus, "%u", (unsigned)mce->cpu);
+	} else {
+		n = (mce->ncpus < MCE_SUMMARY_CPUS) ? mce->ncpus
+		                                    : MCE_SUMMARY_CPUS;
+		for (i = 0; i < n; i++) {
+			len += sprintf(cpus + len, i ? ",%u" : "%u",
+			               (unsigned)mce->cpus[i]);
+		}
+		if (mce->ncpus > n) {
+			cpus[len++] = '+';
+		}
+		cpus[len] = '\0';
+	}
+	snprintf(buf, size,
+		 "%%B=%d"			// boot
+		 " %%c=%u %%S=%d"		// cpu, socket
+		 " %%p=0x%08lx"			// init_apic_id
+		 " %%v=%d %%A=0x%08lx"		// vendor, cpuid_eax
+		 " %%b=%u"			// bank
+		 " %%s=0x%016llx"		// mci_status
+		 " %%a=0x%016llx"		// mci_address
+		 " %%m=0x%016llx"		// mci_misc
+		 " %%y=0x%016llx"		// mci_synd
+		 " %%i=0x%016llx"		// mci_ipid
+		 " %%g=0x%016llx"		// mcg_status
+		 " %%G=0x%08lx"			// mcg_cap
+		 " %%t=0x%016llx"		// time
+		 " %%T=0x%016llx"		// tsc
+		 " %%C=0x%04x %%I=0x%016llx"	// cs, ip
+		 " %%q=%llu"			// seq
+		 " %%R=%u %%F=0x%016llx"	// repeats, first_time
+		 " %%P=%s"			// cpus seen
+		 " %%N=0x%016llx %%M=0x%08lx"	// ppin, microcode
+		 "\n",
+		 (int)mce->boot,
+		 (unsigned)mce->cpu, (int)mce->socket,
+		 (unsigned long)mce->init_apic_id,
+		 (int)mce->vendor, (unsigned long)mce->cpuid_eax,
+		 (unsigned)mce->bank,
+		 (unsigned long long)mce->mci_status,
+		 (unsigned long long)mce->mci_address,
+		 (unsigned long long)mce->mci_misc,
+		 (unsigned long long)mce->mci_synd,
+		 (unsigned long long)mce->mci_ipid,
+		 (unsigned long long)mce->mcg_status,
+		 (unsigned long)mce->mcg_cap,
+		 (unsigned long long)mce->time,
+		 (unsigned long long)mce->tsc,
+		 (unsigned)mce->cs, (unsigned long long)mce->ip,
+		 (unsigned long long)mce->seq,
+		 (unsigned)mce->repeats,
+		 (unsigned long long)mce_first_time(mce),
+		 cpus,
+		 (unsigned long long)mce->ppin,
+		 (unsigned long)mce->microcode);
+}
+
+/* what the expansions used to produce, with snprintf() */
+void
+old_expansion(char field, const struct mce *m, char *buf, size_t size)
+{
+	uint64_t first = m->repeats ? m->first_time : m->time;
+	unsigned i, n;
+	int len;
+
+	switch (field) {
+	case 'c': snprintf(buf, size, "%u", m->cpu); break;
+	case 'S': snprintf(buf, size, "%d", m->socket); break;
+	case 'v': snprintf(buf, size, "%d", m->vendor); break;
+	case 'A': snprintf(buf, size, "0x%08lx", (unsigned long)m->cpuid_eax);
+		break;
+	case 'p': snprintf(buf, size, "0x%08lx",
+		           (unsigned long)m->init_apic_id); break;
+	case 'b': snprintf(buf, size, "%u", m->bank); break;
+	case 's': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mci_status); break;
+	case 'a': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mci_address); break;
+	case 'm': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mci_misc); break;
+	case 'y': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mci_synd); break;
+	case 'i': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mci_ipid); break;
+	case 'g': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->mcg_status); break;
+	case 'G': snprintf(buf, size, "0x%08lx", (unsigned long)m->mcg_cap);
+		break;
+	case 't': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->time); break;
+	case 'T': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->tsc); break;
+	case 'C': snprintf(buf, size, "0x%04x", m->cs); break;
+	case 'I': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->ip); break;
+	case 'B': snprintf(buf, size, "%d", m->boot); break;
+	case 'q': snprintf(buf, size, "%llu", (unsigned long long)m->seq);
+		break;
+	case 'R': snprintf(buf, size, "%u", m->repeats); break;
+	case 'F': snprintf(buf, size, "0x%016llx", (unsigned long long)first);
+		break;
+	case 'P':
+		if (!m->repeats) {
+			snprintf(buf, size, "%u", m->cpu);
+			break;
+		}
+		n = (m->ncpus < MCE_SUMMARY_CPUS) ? m->ncpus : MCE_SUMMARY_CPUS;
+		len = 0;
+		for (i = 0; i < n; i++) {
+			len += snprintf(buf + len, size - len, "%s%u",
+			                i ? "," : "", m->cpus[i]);
+		}
+		snprintf(buf + len, size - len, "%s",
+		         (m->ncpus > n) ? "+" : "");
+		break;
+	case 'N': snprintf(buf, size, "0x%016llx",
+		           (unsigned long long)m->ppin); break;
+	case 'M': snprintf(buf, size, "0x%08lx", (unsigned long)m->microcode);
+		break;
+	default:
+		buf[0] = '\0';
+		break;
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef MCED_OLD_FMT_H__
+#define MCED_OLD_FMT_H__
+
+#include <stddef.h>
+
+#include "mced.h"
+
+/* what the v1 and v2 socket lines used to be */
+extern void old_v1(const struct mce *mce, char *buf, size_t size);
+extern void old_v2(const struct mce *mce, char *buf, size_t size);
+
+/* what the '%' expansion of 'field' used to produce */
+extern void old_expansion(char field, const struct mce *m, char *buf,
+                          size_t size);
+
+#endif  /* MCED_OLD_FMT_H__ */
@@ -0,0 +1,193 @@
+/*
+ *  pipe.c - co-processes for pipe_action rules
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+
+#include "mced.h"
+#include "pipe.h"
+
+/* every pipe there is, so that a reaped child can be found */
+static struct mced_pipe *pipes;
+
+struct mced_pipe *
+mced_pipe_new(void)
+{
+	struct mced_pipe *pp;
+
+	pp = calloc(1, sizeof(*pp));
+	if (!pp) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return NULL;
+	}
+	pp->format = MCED_PIPE_FORMAT_V2;
+	pp->restart.fd = -1;
+	pp->backoff_ms = MCED_PIPE_BACKOFF_MIN_MS;
+
+	pp->next = pipes;
+	pipes = pp;
+
+	return pp;
+}
+
+void
+mced_pipe_free(struct mced_pipe *pp)
+{
+	struct mced_pipe **p;
+
+	for (p = &pipes; *p; p = &(*p)->next) {
+		if (*p == pp) {
+			*p = pp->next;
+			break;
+		}
+	}
+	if (pp->restart.fd >= 0) {
+		mced_unwatch(&pp->restart);
+		close(pp->restart.fd);
+	}
+	free(pp->cmd);
+	free(pp);
+}
+
+/* time to restart a co-process */
+static void
+pipe_restart_event(struct mced_watcher *w,
+                   uint32_t events __attribute__((unused)))
+{
+	struct mced_pipe *pp;
+	uint64_t expirations;
+
+	pp = (struct mced_pipe *)((char *)w - offsetof(struct mced_pipe,
+	                                               restart));
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious */
+		return;
+	}
+	if (!pp->pid) {
+		pp->restarts++;
+		mced_pipe_start(pp);
+	}
+}
+
+/* restart a co-process after its backoff, which doubles each time */
+static void
+schedule_restart(struct mced_pipe *pp)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = pp->backoff_ms / 1000;
+	its.it_value.tv_nsec = (pp->backoff_ms % 1000) * 1000000L;
+	if (timerfd_settime(pp->restart.fd, 0, &its, NULL) < 0) {
+		mced_perror(LOG_ERR, "ERR: timerfd_settime()");
+		return;
+	}
+	mced_debug(1, "DBG: restarting pipe_action from %s in %ums\n",
+	           pp->origin, pp->backoff_ms);
+
+	pp->backoff_ms *= 2;
+	if (pp->backoff_ms > MCED_PIPE_BACKOFF_MAX_MS) {
+		pp->backoff_ms = MCED_PIPE_BACKOFF_MAX_MS;
+	}
+}
+
+int
+mced_pipe_start(struct mced_pipe *pp)
+{
+	int fd;
+	pid_t pid;
+
+	if (pp->restart.fd < 0) {
+		pp->restart.fd = timerfd_create(CLOCK_MONOTONIC,
+		                                TFD_NONBLOCK|TFD_CLOEXEC);
+		if (pp->restart.fd < 0) {
+			mced_perror(LOG_ERR, "ERR: timerfd_create()");
+			return -1;
+		}
+		pp->restart.handler = pipe_restart_event;
+		if (mced_watch(&pp->restart, EPOLLIN) < 0) {
+			close(pp->restart.fd);
+			pp->restart.fd = -1;
+			return -1;
+		}
+	}
+
+	pid = mced_spawn_coproc(pp->cmd, &fd);
+	if (pid < 0) {
+		schedule_restart(pp);
+		return 0;
+	}
+	pp->pid = pid;
+	gettimeofday(&pp->started, NULL);
+
+	pp->on_start(pp, fd);
+
+	return 0;
+}
+
+void
+mced_pipe_stop(struct mced_pipe *pp)
+{
+	if (pp->pid) {
+		kill(-pp->pid, SIGTERM);
+	}
+}
+
+/* a child was reaped: restart it if it was a co-process */
+int
+mced_coproc_exited(pid_t pid, int status)
+{
+	struct mced_pipe *pp;
+	struct timeval now;
+	struct timeval up;
+
+	for (pp = pipes; pp; pp = pp->next) {
+		if (pp->pid == pid) {
+			break;
+		}
+	}
+	if (!pp) {
+		return 0;
+	}
+
+	if (WIFSIGNALED(status)) {
+		mced_log(LOG_WARNING, "pipe_action from %s (pid %d) "
+		         "exited on signal %d\n", pp->origin, (int)pid,
+		         WTERMSIG(status));
+	} else {
+		mced_log(LOG_WARNING, "pipe_action from %s (pid %d) "
+		         "exited with status %d\n", pp->origin,
+		         (int)pid, WEXITSTATUS(status));
+	}
+	pp->pid = 0;
+	pp->on_exit(pp);
+
+	/* one which stayed up for a while starts over */
+	gettimeofday(&now, NULL);
+	timersub(&now, &pp->started, &up);
+	if (up.tv_sec >= MCED_PIPE_BACKOFF_MAX_MS / 1000) {
+		pp->backoff_ms = MCED_PIPE_BACKOFF_MIN_MS;
+	}
+	schedule_restart(pp);
+
+	return 1;
+}
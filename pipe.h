@@ -0,0 +1,59 @@
+#ifndef MCED_PIPE_H__
+#define MCED_PIPE_H__
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "mced.h"
+
+/*
+ * A pipe_action rule keeps one co-process running, and writes each MCE it
+ * matches to the co-process's stdin, as a v2 line or a v3 frame.  This is
+ * the co-process half of it: starting it, and restarting it when it dies,
+ * after twice as long as the last time if it did not stay up for long.
+ * Writing to it is up to the rule.
+ */
+enum mced_pipe_format {
+	MCED_PIPE_FORMAT_V2 = 0,
+	MCED_PIPE_FORMAT_BINARY,
+};
+struct mced_pipe {
+	char *cmd;
+	enum mced_pipe_format format;
+	const char *origin;		/* the rule's, for messages */
+	pid_t pid;			/* 0 while it is not running */
+	struct timeval started;
+	struct mced_watcher restart;	/* a timerfd, to restart it */
+	unsigned backoff_ms;		/* how long the next restart waits */
+	unsigned long long restarts;
+
+	/* called with the stdin of each co-process started */
+	void (*on_start)(struct mced_pipe *pp, int fd);
+	/* called when a co-process has been reaped */
+	void (*on_exit)(struct mced_pipe *pp);
+	void *owner;
+
+	struct mced_pipe *next;		/* all pipes, to reap them */
+};
+#define MCED_PIPE_BACKOFF_MIN_MS	100
+#define MCED_PIPE_BACKOFF_MAX_MS	60000
+
+/* a pipe with no co-process, for a rule's file to set 'cmd' and 'format' */
+extern struct mced_pipe *mced_pipe_new(void);
+
+/* it must have been stopped, and reaped or not */
+extern void mced_pipe_free(struct mced_pipe *pp);
+
+/*
+ * Start a pipe's co-process.  If it can not be started now, it is tried
+ * again later.  Returns -1 if it can never be started.
+ */
+extern int mced_pipe_start(struct mced_pipe *pp);
+
+/*
+ * Make sure a co-process is on its way out.  It is restarted when it has
+ * been reaped.
+ */
+extern void mced_pipe_stop(struct mced_pipe *pp);
+
+#endif  /* MCED_PIPE_H__ */
@@ -0,0 +1,96 @@
+/*
+ *  retain.c - recent MCEs, kept for clients which resume
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mced.h"
+
+/*
+ * The last 'retain_size' MCEs handled, in sequence order.  Entries are
+ * addressed by position: the number of MCEs retained before them.  The
+ * sequence numbers may have holes (where MCEs were lost), so finding one
+ * takes a binary search.  Only the main thread touches this.
+ */
+static struct mce *retained;
+static uint64_t retain_size;
+static uint64_t retain_end;		/* MCEs ever retained */
+
+int
+mced_retain_init(size_t size)
+{
+	if (!size) {
+		return 0;
+	}
+	retained = calloc(size, sizeof(*retained));
+	if (!retained) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		return -1;
+	}
+	retain_size = size;
+	return 0;
+}
+
+void
+mced_retain(const struct mce *mce)
+{
+	if (!retain_size) {
+		return;
+	}
+	retained[retain_end % retain_size] = *mce;
+	retain_end++;
+}
+
+/* the position of the oldest MCE still retained */
+uint64_t
+mced_retain_start(void)
+{
+	return (retain_end > retain_size) ? retain_end - retain_size : 0;
+}
+
+/* the position the next MCE will be retained at */
+uint64_t
+mced_retain_end(void)
+{
+	return retain_end;
+}
+
+/* the MCE at a position, or NULL if it is not (or no longer) retained */
+const struct mce *
+mced_retain_get(uint64_t pos)
+{
+	if (pos < mced_retain_start() || pos >= retain_end) {
+		return NULL;
+	}
+	return &retained[pos % retain_size];
+}
+
+/* the position of the first retained MCE with a sequence number >= seq */
+uint64_t
+mced_retain_find(uint64_t seq)
+{
+	uint64_t lo = mced_retain_start();
+	uint64_t hi = retain_end;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (retained[mid % retain_size].seq < seq) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
@@ -0,0 +1,122 @@
+/*
+ *  ring.c - lock-free SPSC ring of MCEs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mced.h"
+#include "ring.h"
+
+int
+mce_ring_init(struct mce_ring *ring, size_t size)
+{
+	size_t n;
+
+	if (size < 2) {
+		size = 2;
+	}
+	/* round up to a power of two, so we can mask instead of divide */
+	for (n = 1; n < size; n <<= 1) {
+		continue;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->slots = calloc(n, sizeof(*ring->slots));
+	if (!ring->slots) {
+		return -1;
+	}
+	ring->size = n;
+	ring->mask = n - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->high_water, 0);
+	atomic_init(&ring->pushed, 0);
+	atomic_init(&ring->drops, 0);
+
+	return 0;
+}
+
+void
+mce_ring_destroy(struct mce_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+	ring->size = ring->mask = 0;
+}
+
+int
+mce_ring_push(struct mce_ring *ring, const struct mce *mce)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t depth = head - tail;
+
+	if (depth >= ring->size) {
+		atomic_fetch_add_explicit(&ring->drops, 1,
+		                          memory_order_relaxed);
+		return -1;
+	}
+
+	ring->slots[head & ring->mask] = *mce;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	depth++;
+	if (depth > atomic_load_explicit(&ring->high_water,
+	                                 memory_order_relaxed)) {
+		atomic_store_explicit(&ring->high_water, depth,
+		                      memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+int
+mce_ring_pop(struct mce_ring *ring, struct mce *mce)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail == head) {
+		return 0;
+	}
+
+	*mce = ring->slots[tail & ring->mask];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return 1;
+}
+
+size_t
+mce_ring_depth(struct mce_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	return head - tail;
+}
+
+void
+mce_ring_get_stats(struct mce_ring *ring, struct mce_ring_stats *stats)
+{
+	stats->size = ring->size;
+	stats->depth = mce_ring_depth(ring);
+	stats->high_water = atomic_load_explicit(&ring->high_water,
+	                                         memory_order_relaxed);
+	stats->pushed = atomic_load_explicit(&ring->pushed,
+	                                     memory_order_relaxed);
+	stats->drops = atomic_load_explicit(&ring->drops,
+	                                    memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+#ifndef MCED_RING_H__
+#define MCED_RING_H__
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "mced.h"
+
+/*
+ * A preallocated single-producer/single-consumer ring of MCEs.
+ *
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ * Neither side ever blocks or takes a lock.  If the ring is full, the
+ * pushed record is dropped and counted.  The size is rounded up to a
+ * power of two.
+ */
+struct mce_ring {
+	struct mce *slots;
+	size_t size;
+	size_t mask;
+
+	/* written by the producer, read by the consumer */
+	_Alignas(64) atomic_size_t head;
+	/* written by the consumer, read by the producer */
+	_Alignas(64) atomic_size_t tail;
+
+	/* statistics, written by the producer */
+	_Alignas(64) atomic_size_t high_water;
+	atomic_ullong pushed;
+	atomic_ullong drops;
+};
+
+/* a snapshot of the ring's statistics */
+struct mce_ring_stats {
+	size_t size;
+	size_t depth;
+	size_t high_water;
+	unsigned long long pushed;
+	unsigned long long drops;
+};
+
+extern int mce_ring_init(struct mce_ring *ring, size_t size);
+extern void mce_ring_destroy(struct mce_ring *ring);
+
+/* Producer side.  Returns 0 on success or -1 if the ring was full. */
+extern int mce_ring_push(struct mce_ring *ring, const struct mce *mce);
+
+/* Consumer side.  Returns 1 if a record was popped or 0 if empty. */
+extern int mce_ring_pop(struct mce_ring *ring, struct mce *mce);
+
+extern size_t mce_ring_depth(struct mce_ring *ring);
+extern void mce_ring_get_stats(struct mce_ring *ring,
+                               struct mce_ring_stats *stats);
+
+#endif  /* MCED_RING_H__ */
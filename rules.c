@@ -25,22 +25,33 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <endian.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <limits.h>
 #include <regex.h>
-#include <signal.h>
 
 #include "mced.h"
 #include "util.h"
 #include "ud_socket.h"
+#include "match.h"
+#include "fields.h"
+#include "fmt.h"
+#include "action.h"
+#include "batch.h"
+#include "pipe.h"
+#if ENABLE_MCEDB
+#include "mcedb.h"
+#endif
 
 /*
  * What is a rule?
@@ -49,14 +60,30 @@ struct rule {
 	enum {
 		RULE_NONE = 0,
 		RULE_CMD,
+		RULE_PIPE,
 		RULE_V1_CLIENT,
 		RULE_V2_CLIENT,
+		RULE_V3_CLIENT,
+		RULE_SHM_CLIENT,
 	} type;
 	char *origin;
 	union {
-		char *cmd;
-		int fd;
+		struct mced_action *cmd;
+		int fd;			/* -1 while a pipe is restarting */
 	} action;
+	struct mced_match match;	/* command rules and v2 clients */
+	struct mced_pipe *pipe;		/* pipe rules only */
+	struct mced_batch *batch;	/* batched command rules only */
+	struct client_out *out;		/* client and pipe rules only */
+	struct client_in *in;		/* client rules only */
+	struct mced_watcher watch;	/* client and pipe rules only */
+	int replaying;			/* catching up after a resume */
+	uint64_t replay_pos;		/* next retained MCE to send */
+	uint64_t replay_seq;		/* next sequence number to send */
+#if ENABLE_MCEDB
+	struct mcedb_cursor *query;	/* a query being answered */
+	unsigned long long query_count;	/* records sent for it so far */
+#endif
 	struct rule *next;
 	struct rule *prev;
 };
@@ -64,26 +91,144 @@ struct rule_list {
 	struct rule *head;
 	struct rule *tail;
 };
+
+/*
+ * Client sockets are non-blocking.  Whatever a client can't take right
+ * away waits in its own bounded output queue, which is flushed when the
+ * main loop finds the socket writable.  Urgent messages are queued ahead
+ * of everything but other urgent messages and one already partly written.
+ */
+struct client_out_msg {
+	struct client_out_msg *next;
+	size_t len;
+	size_t off;			/* bytes already written */
+	unsigned nevents;		/* MCEs carried by this message */
+	int urgent;			/* goes ahead of the rest */
+	char data[];
+};
+struct client_out {
+	struct client_out_msg *head;
+	struct client_out_msg *tail;
+	size_t queued;			/* unwritten bytes in the queue */
+	size_t high_water;
+	unsigned long long events;	/* events fully written */
+	unsigned long long dropped;	/* events dropped on overflow */
+	unsigned long long bytes;	/* bytes written */
+	struct timeval blocked_since;	/* when the queue became non-empty */
+	struct timeval blocked;		/* total time spent with a queue */
+};
+
+/* what we watch client sockets for, besides EPOLLOUT */
+#define CLIENT_EVENTS	(EPOLLIN|EPOLLRDHUP)
+
+/*
+ * Clients may send us commands, one per line.  This holds a partial line
+ * until the rest of it arrives.
+ */
+#define CLIENT_CMD_MAX 256
+struct client_in {
+	size_t len;
+	char buf[CLIENT_CMD_MAX];
+};
+
+/*
+ * An MCE rendered in one client wire format.  Each format is rendered at
+ * most once per MCE, the first time a client of that type needs it, and
+ * the same bytes are then written to every client of that type.
+ */
+#define CLIENT_MSG_MAX 2048
+_Static_assert(MCE_V2_MSG_MAX < CLIENT_MSG_MAX, "CLIENT_MSG_MAX is too small");
+struct client_msg {
+	size_t len;		/* 0 until rendered */
+	char buf[CLIENT_MSG_MAX];
+};
 static struct rule_list cmd_list;
 static struct rule_list client_list;
 
+/*
+ * Command rules are found through an index of their match predicates, so
+ * an MCE only visits the rules which can match it.  'cmd_rules' holds them
+ * in list order, and 'cmd_hits' has room for all of them.
+ */
+static struct mced_match_index *cmd_index;
+static struct rule **cmd_rules;
+static int *cmd_hits;
+static int ncmd_rules;
+static unsigned long long cmd_lookups;	/* MCEs looked up */
+static unsigned long long cmd_fired;	/* rules run for them */
+
+/*
+ * MCEs which clients missed because of --clientratelimit.  They are told
+ * with a gap, just before the next MCE they do get, or at the end of the
+ * batch, so they can resume to get them.
+ */
+static uint64_t limit_gap_first;
+static uint64_t limit_gap_count;
+
+/*
+ * Clients dropped while handling one batch of events may still have
+ * events pending in that batch, so they are only freed once the main
+ * loop has finished with it.
+ */
+static struct rule_list dead_list;
+
+/*
+ * Pipe rules from before a reload.  A new rule with the same pipe_action
+ * and pipe_format takes one over, and carries on with its co-process, fd
+ * and queue.  The rest are stopped once the new rules are all loaded.
+ */
+static struct rule_list reload_list;
+
+/*
+ * MCEs waiting to go to v3 clients.  They are sent as a single frame when
+ * the main loop has drained the ingest ring, or when the batch fills.
+ */
+static struct {
+	struct mce_v3_header hdr;
+	struct mce_v3_record recs[MCE_V3_BATCH_MAX];
+} __attribute__((packed)) v3_batch;
+static unsigned v3_batch_count;
+static int v3_batch_urgent;		/* a batch is all urgent, or none */
+
 /* rule routines */
 static void enlist_rule(struct rule_list *list, struct rule *r);
 static void delist_rule(struct rule_list *list, struct rule *r);
 static struct rule *new_rule(void);
 static void free_rule(struct rule *r);
+static struct rule *adopt_pipe(struct rule *r);
+static void stop_old_pipes(void);
+static int build_cmd_index(void);
+static void free_cmd_index(void);
+static int have_socket_clients(void);
+static void send_limit_gap(void);
 
 /* other helper routines */
-static void lock_rules(void);
-static void unlock_rules(void);
-static sigset_t *signals_handled(void);
 static struct rule *parse_file(const char *file);
-static struct rule *parse_client(int client, int is_legacy);
+static struct rule *parse_client(int client, int proto);
+static int do_cmd_rules(struct mce *mce);
 static int do_cmd_rule(struct rule *r, struct mce *mce);
-static int do_v1_client_rule(struct rule *r, struct mce *mce);
-static int do_v2_client_rule(struct rule *r, struct mce *mce);
-static int safe_write(int fd, const char *buf, int len);
-static char *parse_cmd(const char *cmd, struct mce *mce);
+static int start_pipe(struct rule *r);
+static void close_pipe(struct rule *r);
+static int do_pipe_rule(struct rule *r, struct mce *mce);
+static int do_v1_client_rule(struct rule *r, struct mce *mce,
+                             struct client_msg *msg);
+static void add_to_v3_batch(const struct mce *mce);
+static void set_v3_header(struct mce_v3_header *hdr, unsigned count,
+                          unsigned flags);
+static size_t format_v2_msg(const struct mce *mce, char *buf, size_t size);
+static int client_is_busy(const struct rule *r);
+static int send_gap(struct rule *rule, uint64_t first, uint64_t count);
+static int do_v2_client_rule(struct rule *r, struct mce *mce,
+                             struct client_msg *msg);
+static void drop_client(struct rule *r);
+static void client_event(struct mced_watcher *w, uint32_t events);
+static int flush_client(struct rule *r);
+static int enqueue_client_msg(struct rule *r, const char *buf, size_t len,
+                              size_t off, unsigned nevents, int urgent);
+static int write_to_client_prio(struct rule *r, const char *buf, size_t len,
+                                unsigned nevents, int urgent);
+static void client_unblocked(struct client_out *out);
+static void free_client_out(struct client_out *out);
 
 /*
  * read in all the configuration files
@@ -96,13 +241,11 @@ mced_read_conf(const char *confdir)
 	char *file = NULL;
 	int nrules = 0;
 
-	lock_rules();
-
 	dir = opendir(confdir);
 	if (!dir) {
 		mced_log(LOG_ERR, "ERR: opendir(%s): %s\n",
 			confdir, strerror(errno));
-		unlock_rules();
+		stop_old_pipes();
 		return -1;
 	}
 
@@ -127,7 +270,7 @@ mced_read_conf(const char *confdir)
 		if (!file) {
 			mced_perror(LOG_ERR, "ERR: malloc()");
 			closedir(dir);
-			unlock_rules();
+			stop_old_pipes();
 			return -1;
 		}
 		snprintf(file, len, "%s/%s", confdir, dirent->d_name);
@@ -153,10 +296,15 @@ mced_read_conf(const char *confdir)
 		free(file);
 	}
 	closedir(dir);
-	unlock_rules();
+	stop_old_pipes();
 
 	mced_log(LOG_INFO, "%d rule%s loaded\n", nrules, (nrules == 1)?"":"s");
 
+	if (build_cmd_index() < 0) {
+		mced_log(LOG_WARNING, "can't index rules, "
+		         "every MCE will be checked against each one\n");
+	}
+
 	return 0;
 }
 
@@ -169,8 +317,6 @@ mced_cleanup_rules(int do_detach)
 	struct rule *p;
 	struct rule *next;
 
-	lock_rules();
-
 	mced_debug(3, "DBG: cleaning up rules\n");
 
 	if (do_detach) {
@@ -179,23 +325,35 @@ mced_cleanup_rules(int do_detach)
 		while (p) {
 			next = p->next;
 			delist_rule(&client_list, p);
+			/* one last try at what is queued, without waiting */
+			flush_client(p);
+			mced_unwatch(&p->watch);
 			close(p->action.fd);
 			free_rule(p);
 			p = next;
 		}
+		mced_free_dead_clients();
 	}
 
 	/* clear out our conf rules */
+	free_cmd_index();
 	p = cmd_list.head;
 	while (p) {
 		next = p->next;
 		delist_rule(&cmd_list, p);
-		free_rule(p);
+		if (!do_detach && p->type == RULE_PIPE) {
+			/* the rules about to be loaded may take it over */
+			enlist_rule(&reload_list, p);
+		} else if (!do_detach && p->batch) {
+			/* its timer's event may still be pending in this batch */
+			mced_batch_stop(p->batch);
+			enlist_rule(&dead_list, p);
+		} else {
+			free_rule(p);
+		}
 		p = next;
 	}
 
-	unlock_rules();
-
 	return 0;
 }
 
@@ -275,6 +433,7 @@ parse_file(const char *file)
 {
 	int fd;
 	int line = 0;
+	int ret;
 	struct rule *r;
 
 	mced_debug(1, "DBG: parsing conf file %s\n", file);
@@ -328,43 +487,169 @@ parse_file(const char *file)
 
 		/* handle the parsed line */
 		if (!strcasecmp(key, "action")) {
-			r->action.cmd = strdup(val);
+			if (r->action.cmd) {
+				mced_action_free(r->action.cmd);
+			}
+			r->action.cmd = mced_action_compile(val);
 			if (!r->action.cmd) {
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			continue;
+		}
+		if (!strcasecmp(key, "pipe_action")) {
+			if (!r->pipe && !(r->pipe = mced_pipe_new())) {
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			free(r->pipe->cmd);
+			r->pipe->cmd = strdup(val);
+			if (!r->pipe->cmd) {
 				mced_perror(LOG_ERR, "ERR: strdup()");
 				free_rule(r);
 				close(fd);
 				return NULL;
 			}
-		} else {
+			continue;
+		}
+		if (!strcasecmp(key, "batch_window_ms")
+		 || !strcasecmp(key, "batch_max")) {
+			unsigned long v;
+			char *end;
+
+			if (!r->batch && !(r->batch = mced_batch_new())) {
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			errno = 0;
+			v = strtoul(val, &end, 0);
+			if (*end || errno || v > UINT_MAX) {
+				mced_log(LOG_ERR,
+				    "ERR: bad value for '%s' in %s at line %d, "
+				    "skipping file\n", key, file, line);
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			if (!strcasecmp(key, "batch_max")) {
+				r->batch->max = v;
+			} else {
+				r->batch->window_ms = v;
+			}
+			continue;
+		}
+		if (!strcasecmp(key, "pipe_format")) {
+			if (!r->pipe && !(r->pipe = mced_pipe_new())) {
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			if (!strcasecmp(val, "v2")) {
+				r->pipe->format = MCED_PIPE_FORMAT_V2;
+			} else if (!strcasecmp(val, "binary")) {
+				r->pipe->format = MCED_PIPE_FORMAT_BINARY;
+			} else {
+				mced_log(LOG_ERR,
+				    "ERR: bad value for '%s' in %s at line %d, "
+				    "skipping file\n", key, file, line);
+				free_rule(r);
+				close(fd);
+				return NULL;
+			}
+			continue;
+		}
+		ret = mced_match_set(&r->match, key, val);
+		if (ret > 0) {
 			mced_log(LOG_WARNING,
 			    "unknown option '%s' in %s at line %d\n",
 			      key, file, line);
 			continue;
+		} else if (ret < 0) {
+			/* a rule which matched too much would be worse */
+			mced_log(LOG_ERR,
+			    "ERR: bad value for '%s' in %s at line %d, "
+			    "skipping file\n", key, file, line);
+			free_rule(r);
+			close(fd);
+			return NULL;
 		}
 	}
-	if (!r->action.cmd) {
+	close(fd);
+	if (r->pipe && !r->pipe->cmd) {
+		mced_log(LOG_ERR, "ERR: %s has a pipe_format but no "
+		         "pipe_action, skipping file\n", file);
+		free_rule(r);
+		return NULL;
+	}
+	if (r->pipe && r->action.cmd) {
+		mced_log(LOG_ERR, "ERR: %s has both an action and a "
+		         "pipe_action, skipping file\n", file);
+		free_rule(r);
+		return NULL;
+	}
+	if (r->pipe && r->batch) {
+		mced_log(LOG_ERR, "ERR: %s batches a pipe_action, "
+		         "skipping file\n", file);
+		free_rule(r);
+		return NULL;
+	}
+	if (!r->action.cmd && !(r->pipe && r->pipe->cmd)) {
 		mced_debug(1, "DBG: skipping incomplete file %s\n", file);
 		free_rule(r);
-		close(fd);
 		return NULL;
 	}
-	close(fd);
+
+	if (mced_match_finish(&r->match) < 0) {
+		mced_log(LOG_ERR, "ERR: status predicates in %s can never "
+		         "match, skipping file\n", file);
+		free_rule(r);
+		return NULL;
+	}
+
+	if (r->pipe) {
+		struct rule *old = adopt_pipe(r);
+		if (old) {
+			return old;
+		}
+		r->type = RULE_PIPE;
+		r->action.fd = -1;
+		r->out = calloc(1, sizeof(*r->out));
+		if (!r->out) {
+			mced_perror(LOG_ERR, "ERR: calloc()");
+			free_rule(r);
+			return NULL;
+		}
+		if (start_pipe(r) < 0) {
+			free_rule(r);
+			return NULL;
+		}
+	}
+	if (r->batch && mced_batch_start(r->batch, r->action.cmd,
+	                                 r->origin) < 0) {
+		free_rule(r);
+		return NULL;
+	}
 
 	return r;
 }
 
+/* add a client of the v1, v2 or v3 socket protocol */
 int
-mced_add_client(int clifd, const char *origin, int is_legacy)
+mced_add_client(int clifd, const char *origin, int proto)
 {
 	struct rule *r;
 	int nrules = 0;
 
 	if (mced_log_events) {
 		mced_log(LOG_NOTICE, "%sclient connected from %s\n",
-		         is_legacy ? "legacy " : "", origin);
+		         (proto == 1) ? "legacy " :
+		         (proto == 3) ? "binary " : "", origin);
 	}
 
-	r = parse_client(clifd, is_legacy);
+	r = parse_client(clifd, proto);
 	if (r) {
 		r->origin = strdup(origin);
 		enlist_rule(&client_list, r);
@@ -380,7 +665,7 @@ mced_add_client(int clifd, const char *origin, int is_legacy)
 }
 
 static struct rule *
-parse_client(int client, int is_legacy)
+parse_client(int client, int proto)
 {
 	struct rule *r;
 
@@ -389,8 +674,32 @@ parse_client(int client, int is_legacy)
 	if (!r) {
 		return NULL;
 	}
-	r->type = is_legacy ? RULE_V1_CLIENT : RULE_V2_CLIENT;
+	if (proto == 1) {
+		r->type = RULE_V1_CLIENT;
+	} else if (proto == 3) {
+		r->type = RULE_V3_CLIENT;
+	} else {
+		r->type = RULE_V2_CLIENT;
+	}
 	r->action.fd = client;
+	r->out = calloc(1, sizeof(*r->out));
+	r->in = calloc(1, sizeof(*r->in));
+	if (!r->out || !r->in) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		free_rule(r);
+		return NULL;
+	}
+
+	/* a slow client must never block us */
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+	/* find out as soon as the client goes away */
+	r->watch.fd = client;
+	r->watch.handler = client_event;
+	if (mced_watch(&r->watch, CLIENT_EVENTS) < 0) {
+		free_rule(r);
+		return NULL;
+	}
 
 	return r;
 }
@@ -444,6 +753,20 @@ new_rule(void)
 	r->type = RULE_NONE;
 	r->origin = NULL;
 	r->action.cmd = NULL;
+	mced_match_init(&r->match);
+	r->pipe = NULL;
+	r->batch = NULL;
+	r->out = NULL;
+	r->in = NULL;
+	r->watch.fd = -1;
+	r->watch.handler = NULL;
+	r->replaying = 0;
+	r->replay_pos = 0;
+	r->replay_seq = 0;
+#if ENABLE_MCEDB
+	r->query = NULL;
+	r->query_count = 0;
+#endif
 	r->prev = r->next = NULL;
 
 	return r;
@@ -453,11 +776,31 @@ new_rule(void)
 static void
 free_rule(struct rule *r)
 {
+	if (r->batch) {
+		mced_batch_free(r->batch);
+	}
 	if (r->type == RULE_CMD) {
 		if (r->action.cmd) {
-			free(r->action.cmd);
+			mced_action_free(r->action.cmd);
+		}
+	}
+	mced_match_free(&r->match);
+	if (r->pipe) {
+		if (r->type == RULE_PIPE) {
+			close_pipe(r);
 		}
+		mced_pipe_free(r->pipe);
+	}
+
+	if (r->out) {
+		free_client_out(r->out);
+	}
+	free(r->in);
+#if ENABLE_MCEDB
+	if (r->query) {
+		mcedb_query_free(r->query);
 	}
+#endif
 
 	if (r->origin) {
 		free(r->origin);
@@ -466,56 +809,67 @@ free_rule(struct rule *r)
 	free(r);
 }
 
-static int
-client_is_dead(int fd)
+/*
+ * A pipe rule being loaded takes over an old one's co-process, if it has
+ * the same commandline and format.  The old rule is kept, with the new
+ * one's origin and match predicates, and the new one is freed.  Returns
+ * the old rule, or NULL if there is none to take over.
+ */
+static struct rule *
+adopt_pipe(struct rule *r)
 {
-	struct pollfd pfd;
-	int r;
-
-	/* check the fd to see if it is dead */
-	pfd.fd = fd;
-	pfd.events = POLLERR | POLLHUP;
-	r = poll(&pfd, 1, 0);
+	struct rule *p;
 
-	if (r < 0) {
-		mced_perror(LOG_ERR, "ERR: poll()");
-		return 0;
+	for (p = reload_list.head; p; p = p->next) {
+		if (!strcmp(p->pipe->cmd, r->pipe->cmd)
+		 && p->pipe->format == r->pipe->format) {
+			break;
+		}
+	}
+	if (!p) {
+		return NULL;
 	}
+	delist_rule(&reload_list, p);
+	mced_debug(1, "DBG: %s takes over pipe_action pid %d from %s\n",
+	           r->origin, (int)p->pipe->pid, p->origin);
+
+	free(p->origin);
+	p->origin = r->origin;
+	p->pipe->origin = p->origin;
+	r->origin = NULL;
+	mced_match_free(&p->match);
+	p->match = r->match;
+	mced_match_init(&r->match);
+	free_rule(r);
 
-	return pfd.revents;
+	return p;
 }
 
-void
-mced_close_dead_clients(void)
+/* stop the co-processes of the old pipe rules no new rule took over */
+static void
+stop_old_pipes(void)
 {
 	struct rule *p;
 
-	lock_rules();
-
-	/* scan our client list */
-	p = client_list.head;
-	while (p) {
-		struct rule *next = p->next;
-		if (client_is_dead(p->action.fd)) {
-			struct ucred cred;
-			/* closed */
-			if (mced_log_events) {
-				mced_log(LOG_NOTICE,
-				         "client %s has disconnected\n",
-				         p->origin);
-			}
-			delist_rule(&client_list, p);
-			ud_get_peercred(p->action.fd, &cred);
-			if (cred.uid != 0) {
-				mced_non_root_clients--;
-			}
-			close(p->action.fd);
-			free_rule(p);
-		}
-		p = next;
+	while ((p = reload_list.head)) {
+		delist_rule(&reload_list, p);
+		mced_debug(1, "DBG: stopping pipe_action from %s\n", p->origin);
+		/* its events may still be pending in this batch */
+		close_pipe(p);
+		enlist_rule(&dead_list, p);
 	}
+}
+
+/* free the clients dropped since the last call */
+void
+mced_free_dead_clients(void)
+{
+	struct rule *p;
 
-	unlock_rules();
+	while ((p = dead_list.head)) {
+		delist_rule(&dead_list, p);
+		free_rule(p);
+	}
 }
 
 /*
@@ -526,39 +880,71 @@ mced_handle_mce(struct mce *mce)
 {
 	struct rule *p;
 	int nrules = 0;
-	struct rule_list *ar[] = { &client_list, &cmd_list, NULL };
-	struct rule_list **lp;
+	struct client_msg v1_msg;
+	struct client_msg v2_msg;
+	int v3_batched = 0;
+
+	/* nothing is rendered until a client wants it */
+	v1_msg.len = 0;
+	v2_msg.len = 0;
+
+	/*
+	 * Shared ring subscribers all read the same copy, whether or not
+	 * there are socket clients.  They see what the limit held back as
+	 * a gap in the sequence numbers.
+	 */
+	if (MCED_MCE_URGENT(mce) || mced_tbucket_take(&mced_shm_limit)) {
+		mced_shm_publish(mce);
+	}
 
-	/* make an MCE be atomic wrt known signals */
-	lock_rules();
+	/* the shm clients had theirs above, and take no socket tokens */
+	if (!MCED_MCE_URGENT(mce) && have_socket_clients()
+	 && !mced_tbucket_take(&mced_client_limit)) {
+		if (!limit_gap_count) {
+			limit_gap_first = mce->seq;
+		}
+		limit_gap_count++;
+		p = NULL;
+	} else {
+		send_limit_gap();
+		p = client_list.head;
+	}
 
-	/* scan each rule list for any rules that care about this MCE */
-	for (lp = ar; *lp; lp++) {
-		struct rule_list *l = *lp;
-		p = l->head;
-		while (p) {
-			/* the list can change underneath us */
-			struct rule *pnext = p->next;
+	/* every client gets every MCE */
+	while (p) {
+		/* the list can change underneath us */
+		struct rule *pnext = p->next;
 
-			if (mced_log_events) {
-				mced_debug(1, "DBG: rule from %s\n", p->origin);
+		if (mced_log_events) {
+			mced_debug(1, "DBG: rule from %s\n", p->origin);
+		}
+		nrules++;
+		if (client_is_busy(p)) {
+			/* no live MCEs in the middle of the results */
+		} else if (p->type == RULE_V1_CLIENT) {
+			do_v1_client_rule(p, mce, &v1_msg);
+		} else if (p->type == RULE_V2_CLIENT) {
+			/* filtered before anything is formatted */
+			if (!p->match.keys || mced_match_mce(&p->match, mce)) {
+				do_v2_client_rule(p, mce, &v2_msg);
 			}
-			nrules++;
-			if (p->type == RULE_CMD) {
-				do_cmd_rule(p, mce);
-			} else if (p->type == RULE_V1_CLIENT) {
-				do_v1_client_rule(p, mce);
-			} else if (p->type == RULE_V2_CLIENT) {
-				do_v2_client_rule(p, mce);
-			} else {
-				mced_log(LOG_WARNING,
-				    "unknown rule type: %d\n", p->type);
+		} else if (p->type == RULE_V3_CLIENT) {
+			/* batched once for all v3 clients */
+			if (!v3_batched) {
+				add_to_v3_batch(mce);
+				v3_batched = 1;
 			}
-			p = pnext;
+		} else if (p->type == RULE_SHM_CLIENT) {
+			/* published above */
+		} else {
+			mced_log(LOG_WARNING,
+			    "unknown rule type: %d\n", p->type);
 		}
+		p = pnext;
 	}
 
-	unlock_rules();
+	/* command rules only if their predicates match */
+	nrules += do_cmd_rules(mce);
 
 	if (mced_log_events) {
 		mced_debug(1, "DBG: %d total rule%s matched\n",
@@ -568,347 +954,1363 @@ mced_handle_mce(struct mce *mce)
 	return 0;
 }
 
-/* helper functions to block signals while iterating */
-static sigset_t *
-signals_handled(void)
+/* whether any client still reads MCEs from its socket */
+static int
+have_socket_clients(void)
 {
-	static sigset_t sigs;
-
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGHUP);
-	sigaddset(&sigs, SIGTERM);
-	sigaddset(&sigs, SIGQUIT);
-	sigaddset(&sigs, SIGINT);
+	struct rule *p;
 
-	return &sigs;
+	for (p = client_list.head; p; p = p->next) {
+		if (p->type != RULE_SHM_CLIENT) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
+/* tell clients about the MCEs they missed because of the rate limit */
 static void
-lock_rules(void)
+send_limit_gap(void)
 {
-	mced_debug(4, "DBG: blocking signals for rule lock\n");
-	sigprocmask(SIG_BLOCK, signals_handled(), NULL);
-}
+	uint64_t count = limit_gap_count;
 
-static void
-unlock_rules(void)
-{
-	mced_debug(4, "DBG: unblocking signals for rule lock\n");
-	sigprocmask(SIG_UNBLOCK, signals_handled(), NULL);
+	if (count) {
+		limit_gap_count = 0;
+		mced_handle_gap(limit_gap_first, count);
+	}
 }
 
 /*
- * the meat of the rules
+ * Tell clients that MCEs were lost before we could handle them.  Clients
+ * which are replaying will find the hole in the sequence for themselves.
  */
-
-static int
-do_cmd_rule(struct rule *rule, struct mce *mce)
+void
+mced_handle_gap(uint64_t first, uint64_t count)
 {
-	pid_t pid;
-	int status;
-	const char *action;
+	struct rule *p;
 
-	pid = fork();
-	switch (pid) {
-	case -1:
-		mced_perror(LOG_ERR, "ERR: fork()");
-		return -1;
-	case 0: /* child */
-		/* parse the commandline, doing any expansions needed */
-		action = parse_cmd(rule->action.cmd, mce);
-		if (mced_log_events) {
-			mced_log(LOG_NOTICE, "executing action \"%s\"\n",
-			         action);
+	/* keep the gap in order with the MCEs before it */
+	mced_flush_clients();
+
+	p = client_list.head;
+	while (p) {
+		/* the list can change underneath us */
+		struct rule *pnext = p->next;
+		if ((p->type == RULE_V2_CLIENT || p->type == RULE_V3_CLIENT)
+		 && !client_is_busy(p)) {
+			send_gap(p, first, count);
 		}
+		p = pnext;
+	}
+}
 
-		/* reset signals */
-		signal(SIGHUP, SIG_DFL);
-		signal(SIGTERM, SIG_DFL);
-		signal(SIGINT, SIG_DFL);
-		signal(SIGQUIT, SIG_DFL);
-		signal(SIGPIPE, SIG_DFL);
-		sigprocmask(SIG_UNBLOCK, signals_handled(), NULL);
+/* index the command rules by their match predicates */
+static int
+build_cmd_index(void)
+{
+	const struct mced_match **matches;
+	struct rule *p;
+	int n = 0;
 
-		if (mced_log_events)
-			mced_log(LOG_NOTICE, "BEGIN HANDLER MESSAGES\n");
-		execl("/bin/sh", "/bin/sh", "-c", action, NULL);
-		/* should not get here */
-		mced_perror(LOG_ERR, "ERR: execl()");
-		exit(EXIT_FAILURE);
+	for (p = cmd_list.head; p; p = p->next) {
+		n++;
 	}
-
-	/* parent */
-	waitpid(pid, &status, 0);
-	if (mced_log_events) {
-		mced_log(LOG_NOTICE, "END HANDLER MESSAGES\n");
+	cmd_rules = malloc((n ? n : 1) * sizeof(*cmd_rules));
+	cmd_hits = malloc((n ? n : 1) * sizeof(*cmd_hits));
+	matches = malloc((n ? n : 1) * sizeof(*matches));
+	if (!cmd_rules || !cmd_hits || !matches) {
+		mced_perror(LOG_ERR, "ERR: malloc()");
+		free(matches);
+		free_cmd_index();
+		return -1;
 	}
-	if (mced_log_events) {
-		if (WIFEXITED(status)) {
-			mced_log(LOG_INFO, "action exited with status %d\n",
-			         WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status)) {
-			mced_log(LOG_INFO, "action exited on signal %d\n",
-			         WTERMSIG(status));
-		} else {
-			mced_log(LOG_INFO, "action exited with status %d\n",
-			         status);
-		}
+	n = 0;
+	for (p = cmd_list.head; p; p = p->next) {
+		cmd_rules[n] = p;
+		matches[n] = &p->match;
+		n++;
 	}
+	ncmd_rules = n;
 
+	cmd_index = mced_match_index_build(matches, n);
+	free(matches);
+	if (!cmd_index) {
+		free_cmd_index();
+		return -1;
+	}
 	return 0;
 }
 
-static int
-write_to_client(struct rule *rule, const char *buf, size_t len) {
-	int client = rule->action.fd;
-	int r;
-
-	if (mced_log_events) {
-		mced_log(LOG_NOTICE, "notifying client %s\n", rule->origin);
+static void
+free_cmd_index(void)
+{
+	if (cmd_index) {
+		mced_match_index_free(cmd_index);
 	}
+	cmd_index = NULL;
+	free(cmd_rules);
+	cmd_rules = NULL;
+	free(cmd_hits);
+	cmd_hits = NULL;
+	ncmd_rules = 0;
+}
 
-	r = safe_write(client, buf, len);
-	if (r < 0 && errno == EPIPE) {
-		struct ucred cred;
-		/* closed */
-		if (mced_log_events) {
-			mced_log(LOG_NOTICE, "client %s has disconnected\n",
-			         rule->origin);
+/*
+ * the meat of the rules
+ */
+
+/* run the command rules which match an MCE */
+static int
+do_cmd_rules(struct mce *mce)
+{
+	struct rule *p;
+	int urgent = MCED_MCE_URGENT(mce);
+	int nhits = 0;
+	int i;
+
+	cmd_lookups++;
+	if (cmd_index) {
+		nhits = mced_match_index_find(cmd_index, mce, cmd_hits);
+		if (nhits && !urgent && !mced_tbucket_take(&mced_cmd_limit)) {
+			return 0;
 		}
-		delist_rule(&client_list, rule);
-		ud_get_peercred(rule->action.fd, &cred);
-		if (cred.uid != 0) {
-			mced_non_root_clients--;
+		for (i = 0; i < nhits; i++) {
+			p = cmd_rules[cmd_hits[i]];
+			if (mced_log_events) {
+				mced_debug(1, "DBG: rule from %s\n", p->origin);
+			}
+			do_cmd_rule(p, mce);
+		}
+	} else {
+		/* no index, so check them all */
+		for (p = cmd_list.head; p; p = p->next) {
+			if (!mced_match_mce(&p->match, mce)) {
+				continue;
+			}
+			if (!nhits && !urgent
+			 && !mced_tbucket_take(&mced_cmd_limit)) {
+				return 0;
+			}
+			if (mced_log_events) {
+				mced_debug(1, "DBG: rule from %s\n", p->origin);
+			}
+			do_cmd_rule(p, mce);
+			nhits++;
 		}
-		close(rule->action.fd);
-		free_rule(rule);
-		return -1;
 	}
+	cmd_fired += nhits;
 
-	return 0;
+	return nhits;
 }
 
 static int
-do_v1_client_rule(struct rule *rule, struct mce *mce)
+do_cmd_rule(struct rule *rule, struct mce *mce)
 {
-	char buf[2048];
+	char *action;
+
+	if (rule->type == RULE_PIPE) {
+		return do_pipe_rule(rule, mce);
+	}
+	if (rule->batch) {
+		return mced_batch_add(rule->batch, mce);
+	}
 
-	snprintf(buf, sizeof(buf)-1,
-	         "%u %u 0x%016llx 0x%016llx 0x%016llx 0x%016llx "
-	         "0x%016llx %d\n",
-	         mce->cpu, mce->bank,
-	         (unsigned long long)mce->mci_status,
-	         (unsigned long long)mce->mci_address,
-	         (unsigned long long)mce->mci_misc,
-	         (unsigned long long)mce->mcg_status,
-	         (unsigned long long)mce->time, mce->boot);
+	/* build the commandline, doing any expansions needed */
+	action = mced_action_expand(rule->action.cmd, mce);
+	if (!action) {
+		return -1;
+	}
 
-	return write_to_client(rule, buf, strlen(buf));
+	/* this does not wait for the command to finish */
+	return mced_run_handler(action, MCED_MCE_URGENT(mce));
 }
 
-static int
-do_v2_client_rule(struct rule *rule, struct mce *mce)
-{
-	char buf[2048];
-
-	snprintf(buf, sizeof(buf)-1,
-		 "%%B=%d"			// boot
-		 " %%c=%u %%S=%d"		// cpu, socket
-		 " %%p=0x%08lx"			// init_apic_id
-		 " %%v=%d %%A=0x%08lx"		// vendor, cpuid_eax
-		 " %%b=%u"			// bank
-		 " %%s=0x%016llx"		// mci_status
-		 " %%a=0x%016llx"		// mci_address
-		 " %%m=0x%016llx"		// mci_misc
-		 " %%y=0x%016llx"		// mci_synd
-		 " %%i=0x%016llx"		// mci_ipid
-		 " %%g=0x%016llx"		// mcg_status
-		 " %%G=0x%08lx"			// mcg_cap
-		 " %%t=0x%016llx"		// time
-		 " %%T=0x%016llx"		// tsc
-		 " %%C=0x%04x %%I=0x%016llx"	// cs, ip
-		 "\n",
-		 (int)mce->boot,
-		 (unsigned)mce->cpu, (int)mce->socket,
-		 (unsigned long)mce->init_apic_id,
-		 (int)mce->vendor, (unsigned long)mce->cpuid_eax,
-		 (unsigned)mce->bank,
-		 (unsigned long long)mce->mci_status,
-		 (unsigned long long)mce->mci_address,
-		 (unsigned long long)mce->mci_misc,
-		 (unsigned long long)mce->mci_synd,
-		 (unsigned long long)mce->mci_ipid,
-		 (unsigned long long)mce->mcg_status,
-		 (unsigned long)mce->mcg_cap,
-		 (unsigned long long)mce->time,
-		 (unsigned long long)mce->tsc,
-		 (unsigned)mce->cs, (unsigned long long)mce->ip);
-
-	return write_to_client(rule, buf, strlen(buf));
-}
-
-#define NTRIES 100
-static int
-safe_write(int fd, const char *buf, int len)
+/* the main loop saw activity on a co-process's stdin */
+static void
+pipe_event(struct mced_watcher *w, uint32_t events)
 {
-	int r;
-	int ttl = 0;
-	int ntries = NTRIES;
+	struct rule *rule;
 
-	do {
-		r = write(fd, buf+ttl, len-ttl);
-		if (r < 0) {
-			if (errno != EAGAIN && errno != EINTR) {
-				/* a legit error */
-				return r;
-			}
-			ntries--;
-		} else if (r > 0) {
-			/* as long as we make forward progress, reset ntries */
-			ntries = NTRIES;
-			ttl += r;
-		}
-	} while (ttl < len && ntries);
+	rule = (struct rule *)((char *)w - offsetof(struct rule, watch));
+	if (w->fd < 0) {
+		/* already closed earlier in this batch */
+		return;
+	}
 
-	if (!ntries) {
-		/* crap */
-		mced_log(LOG_ERR, "uh-oh! safe_write() timed out\n");
-		return r;
+	/* the co-process closed its stdin, or went away */
+	if ((events & (EPOLLERR|EPOLLHUP))
+	 || ((events & EPOLLOUT) && flush_client(rule) < 0)) {
+		close_pipe(rule);
 	}
+}
 
-	return ttl;
+/* a rule's co-process has started, with its stdin on 'fd' */
+static void
+pipe_started(struct mced_pipe *pp, int fd)
+{
+	struct rule *rule = pp->owner;
+
+	rule->action.fd = fd;
+	rule->watch.fd = fd;
+	rule->watch.handler = pipe_event;
+	/* and send it whatever waited for it */
+	if (mced_watch(&rule->watch, rule->out->head ? CLIENT_EVENTS|EPOLLOUT
+	                                             : CLIENT_EVENTS) < 0) {
+		close_pipe(rule);
+	}
 }
 
-/*
- * Valid expansions:
- * 	%c	- CPU
- * 	%S	- CPU socket
- * 	%p	- CPU initial APIC ID
- * 	%v	- CPU vendor
- * 	%A	- CPUID(1) EAX
- * 	%b	- MC bank
- * 	%s	- MCi status
- * 	%a	- MCi address
- * 	%m	- MCi misc
- * 	%y	- MCi synd
- * 	%i	- MCi ipid
- * 	%g	- MCG status
- * 	%G	- MCG capabilities
- * 	%t	- time
- * 	%B	- bootnum
- */
-static char *
-parse_cmd(const char *cmd, struct mce *mce)
-{
-	static char buf[1024];
-	size_t used;
-	const char *p;
-
-	p = cmd;
-	used = 0;
-	memset(buf, 0, sizeof(buf));
-	while (used < (sizeof(buf)-1)) {
-		if (!*p) {
-			break;
-		}
-		if (*p == '%') {
-			/* handle an expansion */
-			size_t size = sizeof(buf) - used;
+/* a rule's co-process has been reaped, and will be restarted */
+static void
+pipe_exited(struct mced_pipe *pp)
+{
+	struct rule *rule = pp->owner;
+	struct client_out_msg *m = rule->out->head;
 
-			p++;
+	close_pipe(rule);
 
-			if (*p == 'c') {
-				/* cpu */
-				used += snprintf(buf+used, size,
-				    "%u", (unsigned)mce->cpu);
-			} else if (*p == 'S') {
-				/* cpu socket */
-				used += snprintf(buf+used, size,
-				    "%d", (int)mce->vendor);
-			} else if (*p == 'p') {
-				/* cpu init_apic_id */
-				used += snprintf(buf+used, size,
-				    "0x%08lx",
-				    (unsigned long)mce->init_apic_id);
-			} else if (*p == 'v') {
-				/* vendor */
-				used += snprintf(buf+used, size,
-				    "%d", (int)mce->vendor);
-			} else if (*p == 'A') {
-				/* CPUID(1) EAX */
-				used += snprintf(buf+used, size,
-				    "0x%08lx",
-				    (unsigned long)mce->cpuid_eax);
-			} else if (*p == 'b') {
-				/* bank */
-				used += snprintf(buf+used, size,
-				    "%u", (unsigned)mce->bank);
-			} else if (*p == 's') {
-				/* mci_status */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mci_status);
-			} else if (*p == 'a') {
-				/* mci_address */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mci_address);
-			} else if (*p == 'm') {
-				/* mci_misc */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mci_misc);
-			} else if (*p == 'y') {
-				/* mci_synd */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mci_synd);
-			} else if (*p == 'i') {
-				/* mci_ipid */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mci_ipid);
-			} else if (*p == 'g') {
-				/* mcg_status */
-				used += snprintf(buf+used, size,
-				    "0x%016llx",
-				    (unsigned long long)mce->mcg_status);
-			} else if (*p == 'G') {
-				/* mcg_cap */
-				used += snprintf(buf+used, size,
-				    "0x%08lx", (unsigned long)mce->mcg_cap);
-			} else if (*p == 't') {
-				/* time */
-				used += snprintf(buf+used, size,
-				    "0x%016llx", (unsigned long long)mce->time);
-			} else if (*p == 'T') {
-				/* tsc */
-				used += snprintf(buf+used, size,
-				    "0x%016llx", (unsigned long long)mce->tsc);
-			} else if (*p == 'C') {
-				/* cs */
-				used += snprintf(buf+used, size,
-				    "0x%04x", (unsigned)mce->cs);
-			} else if (*p == 'I') {
-				/* ip */
-				used += snprintf(buf+used, size,
-				    "0x%016llx", (unsigned long long)mce->ip);
-			} else if (*p == 'B') {
-				/* bootnum */
-				used += snprintf(buf+used, size,
-				    "%d", (int)mce->boot);
-			} else {
-				/* just assume a literal */
-				buf[used++] = *p;
+	/* the rest of a half-written message would confuse the next */
+	if (m && m->off) {
+		rule->out->head = m->next;
+		if (!rule->out->head) {
+			rule->out->tail = NULL;
+			client_unblocked(rule->out);
+		}
+		rule->out->queued -= m->len - m->off;
+		rule->out->dropped += m->nevents;
+		free(m);
+	}
+}
+
+/* start a rule's co-process, which tells us when it is up */
+static int
+start_pipe(struct rule *rule)
+{
+	struct mced_pipe *pp = rule->pipe;
+
+	pp->origin = rule->origin;
+	pp->on_start = pipe_started;
+	pp->on_exit = pipe_exited;
+	pp->owner = rule;
+
+	return mced_pipe_start(pp);
+}
+
+/*
+ * Stop writing to a co-process, and make sure it is on its way out.  It
+ * is restarted when it has been reaped.
+ */
+static void
+close_pipe(struct rule *rule)
+{
+	if (rule->action.fd >= 0) {
+		mced_unwatch(&rule->watch);
+		close(rule->action.fd);
+		rule->action.fd = -1;
+		rule->watch.fd = -1;
+	}
+	mced_pipe_stop(rule->pipe);
+}
+
+/* write an MCE to a co-process, or queue it if it is restarting */
+static int
+do_pipe_rule(struct rule *rule, struct mce *mce)
+{
+	struct {
+		struct mce_v3_header hdr;
+		struct mce_v3_record rec;
+	} __attribute__((packed)) frame;
+	char line[MCE_V2_MSG_MAX + 1];
+	const char *buf;
+	size_t len;
+	int urgent = MCED_MCE_URGENT(mce);
+
+	if (rule->pipe->format == MCED_PIPE_FORMAT_BINARY) {
+		set_v3_header(&frame.hdr, 1, 0);
+		mced_mce_to_v3(mce, &frame.rec);
+		buf = (const char *)&frame;
+		len = sizeof(frame);
+	} else {
+		len = mced_format_v2(mce, line);
+		buf = line;
+	}
+
+	if (rule->action.fd < 0) {
+		return enqueue_client_msg(rule, buf, len, 0, 1, urgent);
+	}
+	return write_to_client_prio(rule, buf, len, 1, urgent);
+}
+
+/*
+ * Disconnect a client.  It is not freed until mced_free_dead_clients(),
+ * as the main loop may still hold events for it.
+ */
+static void
+drop_client(struct rule *rule)
+{
+	struct ucred cred;
+
+	if (rule->type == RULE_PIPE) {
+		/* it is restarted once it has been reaped */
+		close_pipe(rule);
+		return;
+	}
+	if (mced_log_events) {
+		mced_log(LOG_NOTICE, "client %s has disconnected\n",
+		         rule->origin);
+	}
+	delist_rule(&client_list, rule);
+	ud_get_peercred(rule->action.fd, &cred);
+	if (cred.uid != 0) {
+		mced_non_root_clients--;
+	}
+	mced_unwatch(&rule->watch);
+	close(rule->action.fd);
+	rule->watch.fd = -1;
+	enlist_rule(&dead_list, rule);
+}
+
+static void
+free_client_out(struct client_out *out)
+{
+	while (out->head) {
+		struct client_out_msg *m = out->head;
+		out->head = m->next;
+		free(m);
+	}
+	free(out);
+}
+
+/* account for time spent with a non-empty queue */
+static void
+client_unblocked(struct client_out *out)
+{
+	struct timeval now;
+	struct timeval delta;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &out->blocked_since, &delta);
+	timeradd(&out->blocked, &delta, &out->blocked);
+}
+
+/*
+ * Remove the oldest message that has not been partly written and is not
+ * urgent, or which may be urgent if 'urgent' is set.  Returns the number
+ * of MCEs it carried, or -1 if there was none.
+ */
+static int
+drop_oldest_msg(struct client_out *out, int urgent)
+{
+	struct client_out_msg *prev = NULL;
+	struct client_out_msg *m = out->head;
+	int nevents;
+
+	while (m && (m->off || (m->urgent && !urgent))) {
+		prev = m;
+		m = m->next;
+	}
+	if (!m) {
+		return -1;
+	}
+
+	if (prev) {
+		prev->next = m->next;
+	} else {
+		out->head = m->next;
+	}
+	if (out->tail == m) {
+		out->tail = prev;
+	}
+	out->queued -= m->len;
+	nevents = m->nevents;
+	free(m);
+
+	return nevents;
+}
+
+/*
+ * Queue a message carrying 'nevents' MCEs for a client, starting 'off'
+ * bytes in.  Returns -1 if the overflow policy says the client should be
+ * disconnected.
+ */
+static int
+enqueue_client_msg(struct rule *rule, const char *buf, size_t len,
+                   size_t off, unsigned nevents, int urgent)
+{
+	struct client_out *out = rule->out;
+	struct client_out_msg *m;
+	struct client_out_msg *prev;
+	size_t need = len - off;
+	int policy = mced_client_overflow;
+	int ndropped;
+
+	/* a co-process would only be restarted, with the same backlog */
+	if (rule->type == RULE_PIPE && policy == CLIENT_OVERFLOW_DISCONNECT) {
+		policy = CLIENT_OVERFLOW_DROP_OLDEST;
+	}
+
+	/* a partly written message must be queued, or the stream breaks */
+	while (!off && out->queued + need > mced_client_queue_len) {
+		if (policy == CLIENT_OVERFLOW_DISCONNECT) {
+			mced_log(LOG_WARNING,
+			         "client %s is not keeping up, disconnecting\n",
+			         rule->origin);
+			return -1;
+		}
+		/*
+		 * An urgent message makes room for itself by dropping
+		 * corrected ones.  If there are only urgent ones left, the
+		 * oldest of them goes under drop-oldest, and this one under
+		 * drop-newest.
+		 */
+		ndropped = -1;
+		if (policy != CLIENT_OVERFLOW_DROP_NEWEST || urgent) {
+			ndropped = drop_oldest_msg(out, 0);
+		}
+		if (ndropped < 0 && urgent
+		 && policy == CLIENT_OVERFLOW_DROP_OLDEST) {
+			ndropped = drop_oldest_msg(out, 1);
+		}
+		if (ndropped < 0) {
+			/* drop this one */
+			out->dropped += nevents;
+			return 0;
+		}
+		out->dropped += ndropped;
+	}
+
+	m = malloc(sizeof(*m) + len);
+	if (!m) {
+		mced_perror(LOG_ERR, "ERR: malloc()");
+		out->dropped += nevents;
+		return 0;
+	}
+	memcpy(m->data, buf, len);
+	m->len = len;
+	m->off = off;
+	m->nevents = nevents;
+	m->urgent = urgent;
+	m->next = NULL;
+
+	if (!out->head) {
+		gettimeofday(&out->blocked_since, NULL);
+		out->head = out->tail = m;
+		/* tell us when the client can take more */
+		if (rule->watch.fd >= 0) {
+			mced_rewatch(&rule->watch, CLIENT_EVENTS|EPOLLOUT);
+		}
+	} else if (urgent) {
+		/* behind the urgent ones, ahead of the rest */
+		prev = NULL;
+		if (out->head->off || out->head->urgent) {
+			prev = out->head;
+			while (prev->next && prev->next->urgent) {
+				prev = prev->next;
 			}
-			p++;
+		}
+		if (prev) {
+			m->next = prev->next;
+			prev->next = m;
 		} else {
-			buf[used++] = *p++;
+			m->next = out->head;
+			out->head = m;
 		}
+		if (!m->next) {
+			out->tail = m;
+		}
+	} else {
+		out->tail->next = m;
+		out->tail = m;
+	}
+	out->queued += need;
+	if (out->queued > out->high_water) {
+		out->high_water = out->queued;
+	}
+
+	return 0;
+}
+
+/* write as much queued output as the client will take */
+static int
+flush_client(struct rule *rule)
+{
+	struct client_out *out = rule->out;
+
+	if (!out->head) {
+		/* a query may have asked to be called back */
+		mced_rewatch(&rule->watch, CLIENT_EVENTS);
+		return 0;
 	}
+	while (out->head) {
+		struct client_out_msg *m = out->head;
+		ssize_t r;
+
+		r = write(rule->action.fd, m->data + m->off, m->len - m->off);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+		m->off += r;
+		out->queued -= r;
+		out->bytes += r;
+		if (m->off == m->len) {
+			out->head = m->next;
+			if (!out->head) {
+				out->tail = NULL;
+			}
+			out->events += m->nevents;
+			free(m);
+		}
+	}
+	client_unblocked(out);
+	mced_rewatch(&rule->watch, CLIENT_EVENTS);
+
+	return 0;
+}
+
+/*
+ * Send a message carrying 'nevents' MCEs to a client, ahead of anything
+ * queued for it if it is 'urgent'.
+ */
+static int
+write_to_client_prio(struct rule *rule, const char *buf, size_t len,
+                     unsigned nevents, int urgent)
+{
+	struct client_out *out = rule->out;
+	ssize_t r = 0;
+
 	if (mced_log_events) {
-		mced_debug(2, "DBG: expanded \"%s\" -> \"%s\"\n", cmd, buf);
+		mced_log(LOG_NOTICE, "notifying client %s\n", rule->origin);
+	}
+
+	/* if nothing is queued, try to write it all right now */
+	if (!out->head) {
+		do {
+			r = write(rule->action.fd, buf, len);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				/* closed */
+				drop_client(rule);
+				return -1;
+			}
+			r = 0;
+		}
+		out->bytes += r;
+		if ((size_t)r == len) {
+			out->events += nevents;
+			return 0;
+		}
+	}
+
+	/* keep the rest for when the client is ready */
+	if (enqueue_client_msg(rule, buf, len, r, nevents, urgent) < 0) {
+		drop_client(rule);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* send a message carrying 'nevents' MCEs to a client */
+static int
+write_to_client(struct rule *rule, const char *buf, size_t len,
+                unsigned nevents)
+{
+	return write_to_client_prio(rule, buf, len, nevents, 0);
+}
+
+/*
+ * Hand a client the shared event ring.  From now on it reads MCEs from
+ * there, so it gets no more socket output.
+ */
+static int
+client_cmd_shm(struct rule *rule)
+{
+	static const char reply[] = "shm\n";
+	int fd;
+	int r;
+
+	fd = mced_shm_get_fd();
+	if (fd < 0) {
+		return write_to_client(rule, "error shm\n", 10, 0);
+	}
+
+	/* whatever was queued is moot: the client wants the fd */
+	free_client_out(rule->out);
+	rule->out = calloc(1, sizeof(*rule->out));
+	if (!rule->out) {
+		mced_perror(LOG_ERR, "ERR: calloc()");
+		close(fd);
+		return -1;
+	}
+	mced_rewatch(&rule->watch, CLIENT_EVENTS);
+
+	r = ud_send_fd(rule->action.fd, fd, reply, sizeof(reply) - 1);
+	close(fd);
+	if (r < 0) {
+		mced_perror(LOG_ERR, "ERR: can't send event ring");
+		return -1;
+	}
+	rule->type = RULE_SHM_CLIENT;
+	if (mced_log_events) {
+		mced_log(LOG_NOTICE, "client %s is using the shared ring\n",
+		         rule->origin);
+	}
+
+	return 0;
+}
+
+/*
+ * Query results and replayed MCEs are written from here, a batch at a
+ * time.  A batch is only written once the client has taken the last one,
+ * so however much there is to send, it never piles up in the client's
+ * queue.
+ */
+#define REPLY_BUF_LEN	65536
+static char reply_buf[REPLY_BUF_LEN];
+
+/* send one batch of MCEs, as a v3 frame or as v2 lines */
+static int
+send_batch(struct rule *rule, const struct mce_v3_record *recs, int n,
+           unsigned flags)
+{
+	size_t len;
+
+	if (rule->type == RULE_V3_CLIENT) {
+		set_v3_header((struct mce_v3_header *)reply_buf, n, flags);
+		len = sizeof(struct mce_v3_header);
+		memcpy(reply_buf + len, recs, n * sizeof(*recs));
+		len += n * sizeof(*recs);
+	} else {
+		int i;
+		len = 0;
+		for (i = 0; i < n; i++) {
+			struct mce mce;
+			mced_v3_to_mce(&recs[i], &mce);
+			len += format_v2_msg(&mce, reply_buf + len,
+			                     sizeof(reply_buf) - len);
+		}
+	}
+
+	return write_to_client(rule, reply_buf, len, n);
+}
+
+/* how many MCEs fit in one batch for this client */
+static int
+batch_max(const struct rule *rule)
+{
+	size_t per;
+	size_t max;
+
+	if (rule->type == RULE_V3_CLIENT) {
+		per = sizeof(struct mce_v3_record);
+		max = (sizeof(reply_buf) - sizeof(struct mce_v3_header)) / per;
+	} else {
+		per = CLIENT_MSG_MAX;
+		max = sizeof(reply_buf) / per;
+	}
+	/* a batch must fit in the client's queue, or it could be dropped */
+	if (max > mced_client_queue_len / per) {
+		max = mced_client_queue_len / per;
+	}
+	if (max > MCE_V3_BATCH_MAX) {
+		max = MCE_V3_BATCH_MAX;
+	}
+	return max ? max : 1;
+}
+
+/* tell a client it will never see a range of sequence numbers */
+static int
+send_gap(struct rule *rule, uint64_t first, uint64_t count)
+{
+	if (rule->type == RULE_V3_CLIENT) {
+		struct {
+			struct mce_v3_header hdr;
+			struct mce_v3_gap gap;
+		} __attribute__((packed)) frame;
+
+		set_v3_header(&frame.hdr, 1, MCE_V3_F_GAP);
+		frame.hdr.rec_size = htole16(sizeof(frame.gap));
+		frame.gap.first = htole64(first);
+		frame.gap.count = htole64(count);
+		return write_to_client(rule, (const char *)&frame,
+		                       sizeof(frame), 0);
+	} else {
+		char line[64];
+		int n = snprintf(line, sizeof(line), "gap %llu %llu\n",
+		                 (unsigned long long)first,
+		                 (unsigned long long)count);
+		return write_to_client(rule, line, n, 0);
+	}
+}
+
+/*
+ * Send the next batch of replayed MCEs, if the client is ready for it.
+ * Returns -1 if the client was dropped.
+ *
+ * A replaying client gets no live MCEs.  They are retained like any
+ * other, so the replay picks them up, and the client goes back to live
+ * MCEs once it has caught up.
+ */
+static int
+pump_replay(struct rule *rule)
+{
+	struct mce_v3_record recs[MCE_V3_BATCH_MAX];
+	int max = batch_max(rule);
+
+	while (rule->replaying && !rule->out->head) {
+		uint64_t end = mced_retain_end();
+		uint64_t hole = 0;
+		int n = 0;
+
+		/* what we were going to send next may have been overwritten */
+		if (rule->replay_pos < mced_retain_start()) {
+			rule->replay_pos = mced_retain_start();
+		}
+		while (n < max && rule->replay_pos < end) {
+			const struct mce *mce;
+
+			mce = mced_retain_get(rule->replay_pos);
+			if (mce->seq > rule->replay_seq) {
+				hole = mce->seq - rule->replay_seq;
+				break;
+			}
+			if (mce->seq == rule->replay_seq) {
+				if (mced_match_mce(&rule->match, mce)) {
+					mced_mce_to_v3(mce, &recs[n++]);
+				}
+				rule->replay_seq++;
+			}
+			rule->replay_pos++;
+		}
+		if (rule->replay_pos == end
+		 && rule->replay_seq < mced_next_seq) {
+			/* lost after the last MCE we have */
+			hole = mced_next_seq - rule->replay_seq;
+		}
+
+		if (n > 0 && send_batch(rule, recs, n, 0) < 0) {
+			return -1;
+		}
+		if (hole) {
+			if (send_gap(rule, rule->replay_seq, hole) < 0) {
+				return -1;
+			}
+			rule->replay_seq += hole;
+		}
+		if (rule->replay_pos == end) {
+			mced_debug(1, "DBG: client %s has caught up\n",
+			           rule->origin);
+			rule->replaying = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Only send a v2 client the MCEs which match a filter, such as "bank=4,5
+ * severity=uncorrected".  An empty filter sends everything again.
+ */
+static int
+client_cmd_filter(struct rule *rule, char *args)
+{
+	struct mced_match m;
+	char *save = NULL;
+	char *tok;
+
+	mced_match_init(&m);
+	for (tok = strtok_r(args, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		char *val = strchr(tok, '=');
+
+		if (!val) {
+			goto bad;
+		}
+		*val++ = '\0';
+		if (mced_match_set(&m, tok, val) != 0) {
+			goto bad;
+		}
+	}
+	if (mced_match_finish(&m) < 0) {
+		goto bad;
+	}
+
+	mced_match_free(&rule->match);
+	rule->match = m;
+	mced_debug(1, "DBG: client %s set a filter\n", rule->origin);
+
+	/* MCEs after this line are filtered */
+	return write_to_client(rule, "filter\n", 7, 0);
+
+ bad:
+	mced_match_free(&m);
+	mced_log(LOG_WARNING, "bad filter from client %s\n", rule->origin);
+	return write_to_client(rule, "error filter\n", 13, 0);
+}
+
+/* replay retained MCEs, starting from a sequence number */
+static int
+client_cmd_resume(struct rule *rule, const char *args)
+{
+	unsigned long long seq;
+	char *end;
+	char line[64];
+	int n;
+
+	errno = 0;
+	seq = strtoull(args, &end, 0);
+	if (end == args || *end || errno) {
+		mced_log(LOG_WARNING, "bad resume from client %s\n",
+		         rule->origin);
+		return write_to_client(rule, "error resume\n", 13, 0);
+	}
+	if (client_is_busy(rule)) {
+		mced_log(LOG_WARNING, "client %s sent a resume while busy, "
+		         "ignored\n", rule->origin);
+		return 0;
+	}
+	if (seq == 0 || seq > mced_next_seq) {
+		/* 0, or from before a restart without a store: start over */
+		seq = 1;
+	}
+
+	/* mark where the replay starts, after any live MCEs sent so far */
+	if (rule->type == RULE_V3_CLIENT) {
+		struct mce_v3_header hdr;
+		set_v3_header(&hdr, 0, MCE_V3_F_RESUME);
+		n = write_to_client(rule, (const char *)&hdr, sizeof(hdr), 0);
+	} else {
+		n = snprintf(line, sizeof(line), "resume %llu\n", seq);
+		n = write_to_client(rule, line, n, 0);
+	}
+	if (n < 0) {
+		return -1;
+	}
+
+	rule->replaying = 1;
+	rule->replay_seq = seq;
+	rule->replay_pos = mced_retain_find(seq);
+	mced_debug(1, "DBG: client %s resumes from %llu\n",
+	           rule->origin, seq);
+
+	return pump_replay(rule);
+}
+
+#if ENABLE_MCEDB
+
+/* a query time is usecs since the epoch, or "-N[smhd]" before now */
+static int
+parse_query_time(const char *str, uint64_t *t)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	if (*str == '-') {
+		unsigned long long secs = 1;
+		unsigned long long now;
+		unsigned long long ago;
+		struct timeval tv;
+
+		v = strtoull(str + 1, &end, 10);
+		switch (*end) {
+		case 'd':
+			secs *= 24;
+			/* fall through */
+		case 'h':
+			secs *= 60;
+			/* fall through */
+		case 'm':
+			secs *= 60;
+			/* fall through */
+		case 's':
+			end++;
+			break;
+		}
+		if (end == str + 1 || *end || errno) {
+			return -1;
+		}
+		gettimeofday(&tv, NULL);
+		now = tv.tv_sec * 1000000ULL + tv.tv_usec;
+		ago = v * secs * 1000000ULL;
+		*t = (ago > now) ? 0 : now - ago;
+		return 0;
+	}
+
+	v = strtoull(str, &end, 0);
+	if (end == str || *end || errno) {
+		return -1;
+	}
+	*t = v;
+	return 0;
+}
+
+static int
+parse_query_key(const char *str, long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoll(str, &end, 0);
+	if (end == str || *end || errno || *val < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse "key=value" predicates:
+ *	since=TIME until=TIME cpu=N socket=N bank=N status=MASK[/VALUE]
+ */
+static int
+parse_query(char *args, struct mcedb_query *q)
+{
+	char *save = NULL;
+	char *tok;
+
+	mcedb_query_init(q);
+	for (tok = strtok_r(args, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		char *val = strchr(tok, '=');
+		int r;
+
+		if (!val) {
+			return -1;
+		}
+		*val++ = '\0';
+		if (!strcmp(tok, "since")) {
+			r = parse_query_time(val, &q->since);
+		} else if (!strcmp(tok, "until")) {
+			r = parse_query_time(val, &q->until);
+		} else if (!strcmp(tok, "cpu")) {
+			r = parse_query_key(val, &q->cpu);
+		} else if (!strcmp(tok, "socket")) {
+			r = parse_query_key(val, &q->socket);
+		} else if (!strcmp(tok, "bank")) {
+			r = parse_query_key(val, &q->bank);
+		} else if (!strcmp(tok, "status")) {
+			char *end;
+			errno = 0;
+			q->status_mask = strtoull(val, &end, 0);
+			q->status_value = q->status_mask;
+			if (*end == '/') {
+				val = end + 1;
+				q->status_value = strtoull(val, &end, 0);
+			}
+			r = (end == val || *end || errno) ? -1 : 0;
+		} else {
+			r = -1;
+		}
+		if (r < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* end a query's results, successfully or not */
+static int
+send_query_end(struct rule *rule, int failed)
+{
+	if (rule->type == RULE_V3_CLIENT) {
+		struct mce_v3_header hdr;
+		set_v3_header(&hdr, 0, MCE_V3_F_QUERY | MCE_V3_F_END
+		                       | (failed ? MCE_V3_F_ERROR : 0));
+		return write_to_client(rule, (const char *)&hdr,
+		                       sizeof(hdr), 0);
+	} else if (failed) {
+		return write_to_client(rule, "error query\n", 12, 0);
+	} else {
+		char line[64];
+		int n = snprintf(line, sizeof(line), "end query %llu\n",
+		                 rule->query_count);
+		return write_to_client(rule, line, n, 0);
+	}
+}
+
+/*
+ * Send the next batch of query results, if the client is ready for it.
+ * Returns -1 if the client was dropped.
+ */
+static int
+pump_query(struct rule *rule)
+{
+	struct mce_v3_record recs[MCE_V3_BATCH_MAX];
+	int max = batch_max(rule);
+
+	while (rule->query && !rule->out->head) {
+		int n = mcedb_query_next(rule->query, recs, max);
+
+		rule->query_count += n;
+		if (n > 0 && send_batch(rule, recs, n, MCE_V3_F_QUERY) < 0) {
+			return -1;
+		}
+		if (mcedb_query_done(rule->query)) {
+			mced_debug(1, "DBG: query from client %s found "
+			           "%llu records\n", rule->origin,
+			           rule->query_count);
+			mcedb_query_free(rule->query);
+			rule->query = NULL;
+			return send_query_end(rule, 0);
+		}
+		if (!n) {
+			/*
+			 * Give the rest of the main loop a turn.  The socket
+			 * is writable, so we will be called straight back.
+			 */
+			mced_rewatch(&rule->watch, CLIENT_EVENTS|EPOLLOUT);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* start answering a query from the database */
+static int
+client_cmd_query(struct rule *rule, char *args)
+{
+	struct mcedb_query q;
+
+	if (client_is_busy(rule)) {
+		mced_log(LOG_WARNING, "client %s sent a query while busy, "
+		         "ignored\n", rule->origin);
+		return 0;
+	}
+	if (parse_query(args, &q) < 0) {
+		mced_log(LOG_WARNING, "bad query from client %s\n",
+		         rule->origin);
+		return send_query_end(rule, 1);
+	}
+
+	rule->query = mcedb_query(mced_db, &q);
+	if (!rule->query) {
+		return send_query_end(rule, 1);
+	}
+	rule->query_count = 0;
+
+	/* v2 clients can tell results from live MCEs sent before now */
+	if (rule->type == RULE_V2_CLIENT
+	 && write_to_client(rule, "begin query\n", 12, 0) < 0) {
+		return -1;
+	}
+
+	return pump_query(rule);
+}
+#endif  /* ENABLE_MCEDB */
+
+/* is a client in the middle of a query or a replay? */
+static int
+client_is_busy(const struct rule *r)
+{
+#if ENABLE_MCEDB
+	if (r->query) {
+		return 1;
+	}
+#endif
+	return r->replaying;
+}
+
+/* the client took the last batch of a reply */
+static int
+pump_client(struct rule *rule)
+{
+	if (rule->replaying) {
+		return pump_replay(rule);
+	}
+#if ENABLE_MCEDB
+	if (rule->query) {
+		return pump_query(rule);
+	}
+#endif
+	return 0;
+}
+
+/* run one command line from a client */
+static int
+client_command(struct rule *rule, char *cmd)
+{
+	mced_debug(1, "DBG: command from client %s: %s\n",
+	           rule->origin, cmd);
+
+	if (!strcmp(cmd, "shm")) {
+		if (rule->type == RULE_V1_CLIENT) {
+			return write_to_client(rule, "error shm\n", 10, 0);
+		}
+		return client_cmd_shm(rule);
+	}
+	if (!strcmp(cmd, "query") || !strncmp(cmd, "query ", 6)) {
+#if ENABLE_MCEDB
+		if (rule->type == RULE_V2_CLIENT
+		 || rule->type == RULE_V3_CLIENT) {
+			return client_cmd_query(rule, cmd + 5);
+		}
+#endif
+		return write_to_client(rule, "error query\n", 12, 0);
+	}
+	if (!strcmp(cmd, "filter") || !strncmp(cmd, "filter ", 7)) {
+		if (rule->type == RULE_V2_CLIENT) {
+			return client_cmd_filter(rule, cmd + 6);
+		}
+		if (rule->type == RULE_V3_CLIENT) {
+			struct mce_v3_header hdr;
+			set_v3_header(&hdr, 0, MCE_V3_F_ERROR);
+			return write_to_client(rule, (const char *)&hdr,
+			                       sizeof(hdr), 0);
+		}
+		return write_to_client(rule, "error filter\n", 13, 0);
+	}
+	if (!strncmp(cmd, "resume ", 7)) {
+		if (rule->type == RULE_V2_CLIENT
+		 || rule->type == RULE_V3_CLIENT) {
+			return client_cmd_resume(rule, cmd + 7);
+		}
+		return write_to_client(rule, "error resume\n", 13, 0);
+	}
+
+	mced_log(LOG_WARNING, "unknown command from client %s\n",
+	         rule->origin);
+	return 0;
+}
+
+/* read whatever a client has sent, and run any complete commands */
+static int
+read_client(struct rule *rule)
+{
+	struct client_in *in = rule->in;
+
+	while (1) {
+		char *nl;
+		ssize_t r;
+
+		r = read(rule->action.fd, in->buf + in->len,
+		         sizeof(in->buf) - in->len - 1);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (r <= 0) {
+			return -1;
+		}
+		in->len += r;
+		in->buf[in->len] = '\0';
+
+		while ((nl = strchr(in->buf, '\n'))) {
+			size_t used = nl - in->buf + 1;
+			*nl = '\0';
+			if (nl > in->buf && nl[-1] == '\r') {
+				nl[-1] = '\0';
+			}
+			if (in->buf[0] && client_command(rule, in->buf) < 0) {
+				return -1;
+			}
+			in->len -= used;
+			memmove(in->buf, in->buf + used, in->len + 1);
+		}
+		if (in->len == sizeof(in->buf) - 1) {
+			mced_log(LOG_WARNING,
+			         "client %s sent an overlong command\n",
+			         rule->origin);
+			return -1;
+		}
+	}
+}
+
+/* the main loop saw activity on a client socket */
+static void
+client_event(struct mced_watcher *w, uint32_t events)
+{
+	struct rule *rule;
+
+	rule = (struct rule *)((char *)w - offsetof(struct rule, watch));
+	if (w->fd < 0) {
+		/* already dropped earlier in this batch */
+		return;
+	}
+
+	/* a command may have arrived just before the client hung up */
+	if ((events & EPOLLIN) && read_client(rule) < 0 && w->fd >= 0) {
+		drop_client(rule);
+	}
+	if (w->fd < 0) {
+		return;
+	}
+
+	if ((events & (EPOLLERR|EPOLLHUP|EPOLLRDHUP))
+	 || ((events & EPOLLOUT) && flush_client(rule) < 0)) {
+		drop_client(rule);
+		return;
+	}
+
+	if ((events & EPOLLOUT) && pump_client(rule) < 0 && w->fd >= 0) {
+		drop_client(rule);
+	}
+}
+
+void
+mced_dump_rule_stats(void)
+{
+	struct rule *p;
+
+	mced_log(LOG_INFO, "rules: indexed=%d mces=%llu fired=%llu\n",
+	         ncmd_rules, cmd_lookups, cmd_fired);
+
+	for (p = cmd_list.head; p; p = p->next) {
+		struct client_out *out = p->out;
+
+		if (p->batch) {
+			mced_log(LOG_INFO, "batch %s: pending=%u batches=%llu "
+			         "events=%llu\n", p->origin, p->batch->count,
+			         p->batch->batches, p->batch->events);
+		}
+		if (p->type != RULE_PIPE) {
+			continue;
+		}
+		mced_log(LOG_INFO,
+		         "pipe %s: pid=%d restarts=%llu queued=%zu "
+		         "high_water=%zu events=%llu dropped=%llu bytes=%llu\n",
+		         p->origin, (int)p->pipe->pid, p->pipe->restarts,
+		         out->queued, out->high_water, out->events,
+		         out->dropped, out->bytes);
+	}
+}
+
+void
+mced_dump_client_stats(void)
+{
+	struct rule *p;
+
+	for (p = client_list.head; p; p = p->next) {
+		struct client_out *out = p->out;
+		struct timeval blocked = out->blocked;
+
+		if (out->head) {
+			/* include the time we are blocked right now */
+			struct timeval now;
+			struct timeval delta;
+			gettimeofday(&now, NULL);
+			timersub(&now, &out->blocked_since, &delta);
+			timeradd(&blocked, &delta, &blocked);
+		}
+		mced_log(LOG_INFO,
+		         "client %s: queued=%zu high_water=%zu events=%llu "
+		         "dropped=%llu bytes=%llu blocked=%ld.%06lds\n",
+		         p->origin, out->queued, out->high_water,
+		         out->events, out->dropped, out->bytes,
+		         (long)blocked.tv_sec, (long)blocked.tv_usec);
+	}
+}
+
+_Static_assert(MCE_V1_MSG_MAX < CLIENT_MSG_MAX, "CLIENT_MSG_MAX is too small");
+
+static int
+do_v1_client_rule(struct rule *rule, struct mce *mce, struct client_msg *msg)
+{
+	if (!msg->len) {
+		msg->len = mced_format_v1(mce, msg->buf);
+	}
+
+	return write_to_client_prio(rule, msg->buf, msg->len, 1,
+	                            MCED_MCE_URGENT(mce));
+}
+
+static size_t
+format_v2_msg(const struct mce *mce, char *buf, size_t size)
+{
+	char line[MCE_V2_MSG_MAX + 1];
+	size_t n;
+
+	if (size > MCE_V2_MSG_MAX) {
+		return mced_format_v2(mce, buf);
+	}
+	/* it might not fit: truncate it, as snprintf() would */
+	n = mced_format_v2(mce, line);
+	if (n >= size) {
+		n = size ? size - 1 : 0;
+	}
+	if (size) {
+		memcpy(buf, line, n);
+		buf[n] = '\0';
+	}
+	return n;
+}
+
+static int
+do_v2_client_rule(struct rule *rule, struct mce *mce, struct client_msg *msg)
+{
+	if (!msg->len) {
+		msg->len = format_v2_msg(mce, msg->buf, sizeof(msg->buf));
+	}
+
+	return write_to_client_prio(rule, msg->buf, msg->len, 1,
+	                            MCED_MCE_URGENT(mce));
+}
+
+static void
+set_v3_header(struct mce_v3_header *hdr, unsigned count, unsigned flags)
+{
+	hdr->magic = htole32(MCE_V3_MAGIC);
+	hdr->version = htole16(MCE_V3_VERSION);
+	hdr->hdr_size = htole16(sizeof(*hdr));
+	hdr->rec_size = htole16(sizeof(struct mce_v3_record));
+	hdr->flags = htole16(flags);
+	hdr->count = htole32(count);
+}
+
+/* append an MCE to the pending v3 frame */
+static void
+add_to_v3_batch(const struct mce *mce)
+{
+	int urgent = MCED_MCE_URGENT(mce);
+
+	if (v3_batch_count == MCE_V3_BATCH_MAX
+	 || (v3_batch_count && urgent != v3_batch_urgent)) {
+		mced_flush_clients();
+	}
+	v3_batch_urgent = urgent;
+	mced_mce_to_v3(mce, &v3_batch.recs[v3_batch_count++]);
+}
+
+/*
+ * Send any batched MCEs to the v3 clients, one frame per client, and wake
+ * the shared ring's subscribers.  The main loop calls this when it has
+ * drained the ingest ring.
+ */
+void
+mced_flush_clients(void)
+{
+	struct rule *p;
+	size_t len;
+
+	mced_shm_wake();
+	if (!v3_batch_count) {
+		send_limit_gap();
+		return;
+	}
+
+	set_v3_header(&v3_batch.hdr, v3_batch_count, 0);
+	len = sizeof(v3_batch.hdr)
+	    + v3_batch_count * sizeof(struct mce_v3_record);
+
+	p = client_list.head;
+	while (p) {
+		/* the list can change underneath us */
+		struct rule *pnext = p->next;
+		if (p->type == RULE_V3_CLIENT && !client_is_busy(p)) {
+			write_to_client_prio(p, (const char *)&v3_batch, len,
+			                     v3_batch_count, v3_batch_urgent);
+		}
+		p = pnext;
 	}
 
-	return buf;
+	v3_batch_count = 0;
+	send_limit_gap();
 }
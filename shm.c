@@ -0,0 +1,176 @@
+/*
+ *  shm.c - shared-memory event ring for local subscribers
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "mced.h"
+
+/*
+ * The ring is only created when the first subscriber asks for it.  Every
+ * MCE is written into it once, no matter how many subscribers there are,
+ * and they are all woken with one FUTEX_WAKE per batch.
+ */
+static int shm_fd = -1;
+static struct mce_shm_header *shm_hdr;
+static char *shm_slots;
+static size_t shm_len;
+static uint32_t shm_mask;
+static int shm_pending;		/* published since the last wakeup */
+
+/* counters */
+static unsigned long long nwakeups;
+
+/* the slot size, rounded up to keep slots cache-line aligned */
+#define SHM_SLOT_SIZE \
+	((sizeof(struct mce_shm_slot) + 63) & ~(size_t)63)
+
+static int
+shm_create(void)
+{
+	uint32_t n;
+	size_t offset;
+
+	/* round up to a power of two, so we can mask instead of divide */
+	for (n = 1; n < (uint32_t)mced_shm_slots; n <<= 1) {
+		continue;
+	}
+	offset = (sizeof(struct mce_shm_header) + 4095) & ~(size_t)4095;
+	shm_len = offset + (size_t)n * SHM_SLOT_SIZE;
+
+	shm_fd = memfd_create("mced-events", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (shm_fd < 0) {
+		mced_perror(LOG_ERR, "ERR: memfd_create()");
+		return -1;
+	}
+	if (ftruncate(shm_fd, shm_len) < 0) {
+		mced_perror(LOG_ERR, "ERR: ftruncate()");
+		goto fail;
+	}
+	/* subscribers can't resize it under us */
+	fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+
+	shm_hdr = mmap(NULL, shm_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+	               shm_fd, 0);
+	if (shm_hdr == MAP_FAILED) {
+		mced_perror(LOG_ERR, "ERR: mmap()");
+		shm_hdr = NULL;
+		goto fail;
+	}
+
+	/* ftruncate() zeroed it, so every slot starts out empty */
+	shm_hdr->magic = MCE_SHM_MAGIC;
+	shm_hdr->version = MCE_SHM_VERSION;
+	shm_hdr->rec_version = MCE_V3_VERSION;
+	shm_hdr->rec_size = sizeof(struct mce_v3_record);
+	shm_hdr->slot_size = SHM_SLOT_SIZE;
+	shm_hdr->nslots = n;
+	shm_hdr->slots_offset = offset;
+	atomic_store_explicit(&shm_hdr->head, 0, memory_order_release);
+	atomic_store_explicit(&shm_hdr->futex, 0, memory_order_release);
+	shm_slots = (char *)shm_hdr + offset;
+	shm_mask = n - 1;
+
+	mced_log(LOG_INFO, "created shared event ring of %u slots\n", n);
+	return 0;
+
+ fail:
+	close(shm_fd);
+	shm_fd = -1;
+	return -1;
+}
+
+/*
+ * Get a read-only fd for the ring, creating the ring if needed.  The
+ * caller must close it.
+ */
+int
+mced_shm_get_fd(void)
+{
+	char path[64];
+	int fd;
+
+	if (shm_fd < 0 && shm_create() < 0) {
+		return -1;
+	}
+
+	/* a read-only open can only ever be mapped read-only */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", shm_fd);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		mced_perror(LOG_ERR, "ERR: can't reopen event ring");
+	}
+	return fd;
+}
+
+/* write an MCE into the ring, if there is one */
+void
+mced_shm_publish(const struct mce *mce)
+{
+	struct mce_shm_slot *slot;
+	uint64_t seq;
+
+	if (!shm_hdr) {
+		return;
+	}
+
+	seq = atomic_load_explicit(&shm_hdr->head, memory_order_relaxed);
+	slot = (struct mce_shm_slot *)(shm_slots
+	        + (size_t)(seq & shm_mask) * SHM_SLOT_SIZE);
+
+	/* readers that see 0, or a changed seq, know to retry or skip */
+	atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	mced_mce_to_v3(mce, &slot->rec);
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+	atomic_store_explicit(&shm_hdr->head, seq + 1, memory_order_release);
+	shm_pending = 1;
+}
+
+/* wake every subscriber, once per batch */
+void
+mced_shm_wake(void)
+{
+	if (!shm_pending) {
+		return;
+	}
+	shm_pending = 0;
+
+	atomic_fetch_add_explicit(&shm_hdr->futex, 1, memory_order_release);
+	syscall(SYS_futex, &shm_hdr->futex, FUTEX_WAKE, INT_MAX,
+	        NULL, NULL, 0);
+	nwakeups++;
+}
+
+void
+mced_dump_shm_stats(void)
+{
+	if (!shm_hdr) {
+		return;
+	}
+	mced_log(LOG_INFO,
+	         "shared ring: slots=%u published=%llu wakeups=%llu\n",
+	         shm_hdr->nslots,
+	         (unsigned long long)atomic_load(&shm_hdr->head),
+	         nwakeups);
+}
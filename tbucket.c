@@ -0,0 +1,101 @@
+/*
+ *  tbucket.c - token buckets, for rate limits which never sleep
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mced.h"
+
+/*
+ * Tokens are counted in nanoseconds of credit: each token costs
+ * 'interval', and the bucket holds at most 'depth' (interval * burst).
+ * Integer arithmetic means there is no drift, however long we run.
+ */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+mced_tbucket_init(struct mced_tbucket *tb, long long rate, long long burst)
+{
+	tb->interval = 0;
+	tb->passed = 0;
+	tb->limited = 0;
+	if (rate <= 0) {
+		/* no limit */
+		return;
+	}
+	if (burst < 1) {
+		burst = 1;
+	}
+	tb->interval = 1000000000ULL / rate;
+	if (tb->interval == 0) {
+		tb->interval = 1;
+	}
+	tb->depth = tb->interval * burst;
+	tb->credit = tb->depth;
+	tb->last = now_ns();
+}
+
+/* add the credit earned since we last looked */
+static void
+refill(struct mced_tbucket *tb)
+{
+	uint64_t now = now_ns();
+
+	tb->credit += now - tb->last;
+	if (tb->credit > tb->depth) {
+		tb->credit = tb->depth;
+	}
+	tb->last = now;
+}
+
+/* how many nsecs until a token is available (0 if one is now) */
+uint64_t
+mced_tbucket_wait(struct mced_tbucket *tb)
+{
+	if (!tb->interval) {
+		return 0;
+	}
+	refill(tb);
+	if (tb->credit >= tb->interval) {
+		return 0;
+	}
+	return tb->interval - tb->credit;
+}
+
+/* take a token, if there is one; returns 1 if so, or 0 if not */
+int
+mced_tbucket_take(struct mced_tbucket *tb)
+{
+	if (!tb->interval) {
+		tb->passed++;
+		return 1;
+	}
+	refill(tb);
+	if (tb->credit < tb->interval) {
+		tb->limited++;
+		return 0;
+	}
+	tb->credit -= tb->interval;
+	tb->passed++;
+	return 1;
+}
@@ -0,0 +1,195 @@
+/*
+ *  test_action.c - check every '%' expansion of a rule action
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "action.h"
+#include "old_fmt.h"
+
+/* what action.c needs from mced.c */
+int mced_log_events;
+
+int
+mced_log(int level __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+int
+mced_debug(int min_dbg_lvl __attribute__((unused)),
+           const char *fmt __attribute__((unused)), ...)
+{
+	return 0;
+}
+
+int
+mced_perror(int level __attribute__((unused)), const char *str)
+{
+	perror(str);
+	return 0;
+}
+
+/* every expansion documented in mced.8 */
+static const char expansions[] = "cSvApbsamyigGtTCIBqRFPNM";
+
+static int nfailed;
+
+/* compile and expand 'src', and compare it with 'want' */
+static void
+check(const char *src, const struct mce *m, const char *want)
+{
+	struct mced_action *action;
+	char *got;
+
+	action = mced_action_compile(src);
+	if (!action) {
+		printf("FAIL: can't compile \"%s\"\n", src);
+		nfailed++;
+		return;
+	}
+	got = mced_action_expand(action, m);
+	if (!got || strcmp(got, want)) {
+		printf("FAIL: \"%s\" expanded to \"%s\", not \"%s\"\n",
+		       src, got ? got : "(null)", want);
+		nfailed++;
+	}
+	free(got);
+	mced_action_free(action);
+}
+
+/* each expansion alone, and all of them in one action */
+static void
+check_mce(const struct mce *m)
+{
+	char src[3 * sizeof(expansions)];
+	char want[4096];
+	char one[256];
+	size_t len = 0;
+	const char *p;
+
+	src[0] = '\0';
+	want[0] = '\0';
+	for (p = expansions; *p; p++) {
+		char single[3] = { '%', *p, '\0' };
+
+		old_expansion(*p, m, one, sizeof(one));
+		check(single, m, one);
+
+		strcat(src, single);
+		strcat(src, " ");
+		len += snprintf(want + len, sizeof(want) - len, "%s ", one);
+	}
+	check(src, m, want);
+}
+
+int
+main(void)
+{
+	struct mce m;
+	char big[8192];
+	char want[8192];
+	int c;
+
+	/* every field different, and %S != %v */
+	memset(&m, 0, sizeof(m));
+	m.mci_status = 0x9c00000000010151ULL;
+	m.mci_address = 0x12345678abcULL;
+	m.mci_misc = 0x8c;
+	m.mci_synd = 0x5d;
+	m.mci_ipid = 0xb000000000ULL;
+	m.mcg_status = 0x5;
+	m.ppin = 0x1122334455667788ULL;
+	m.tsc = 0xdeadbeefULL;
+	m.time = 1700000000123456ULL;
+	m.ip = 0xffffffff81000000ULL;
+	m.boot = 7;
+	m.cpu = 42;
+	m.cpuid_eax = 0x50654;
+	m.init_apic_id = 0x2a;
+	m.socket = 3;
+	m.mcg_cap = 0x1000c14;
+	m.microcode = 0x2006e05;
+	m.cs = 0x10;
+	m.bank = 12;
+	m.vendor = VENDOR_AMD;
+	m.seq = 123456789;
+	check_mce(&m);
+	check("%S/%v", &m, "3/2");
+
+	/* a summary of repeats on more CPUs than it lists */
+	m.repeats = 999;
+	m.ncpus = 6;
+	m.cpus[0] = 1;
+	m.cpus[1] = 2;
+	m.cpus[2] = 30;
+	m.cpus[3] = 4000;
+	m.first_time = 1699999999000000ULL;
+	check_mce(&m);
+	m.ncpus = 2;
+	check_mce(&m);
+
+	/* the extremes of each field */
+	memset(&m, 0xff, sizeof(m));
+	m.repeats = 0;
+	check_mce(&m);
+	m.boot = INT32_MIN;
+	m.socket = INT32_MIN;
+	m.vendor = INT8_MIN;
+	m.repeats = UINT32_MAX;
+	check_mce(&m);
+	memset(&m, 0, sizeof(m));
+	check_mce(&m);
+
+	/* anything else after a '%' is literal, and so is a trailing '%' */
+	check("", &m, "");
+	check("%%", &m, "%");
+	check("100%% done", &m, "100% done");
+	check("trailing %", &m, "trailing %");
+	check("%", &m, "%");
+	for (c = 1; c < 256; c++) {
+		char src[3] = { '%', (char)c, '\0' };
+		char lit[2] = { (char)c, '\0' };
+
+		if (!mced_field_formatter(c, NULL)) {
+			check(src, &m, lit);
+		} else if (!strchr(expansions, c)) {
+			printf("FAIL: %%%c is not documented\n", c);
+			nfailed++;
+		}
+	}
+
+	/* there is no limit on the length */
+	memset(big, 'x', sizeof(big) - 4);
+	strcpy(big + sizeof(big) - 4, "%q");
+	memset(want, 'x', sizeof(want) - 4);
+	strcpy(want + sizeof(want) - 4, "0");
+	check(big, &m, want);
+
+	if (nfailed) {
+		printf("%d check%s failed\n", nfailed, (nfailed == 1) ? "" : "s");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
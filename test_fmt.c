@@ -0,0 +1,237 @@
+/*
+ *  test_fmt.c - check the MCE formatters against snprintf()
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "fmt.h"
+#include "old_fmt.h"
+
+/* the bytes past what a formatter says it wrote must be left alone */
+#define POISON	'#'
+
+static int nfailed;
+
+static void
+compare(const char *what, const char *got, int len, const char *want)
+{
+	int want_len = strlen(want);
+
+	if (len != want_len || memcmp(got, want, len) || got[len] != POISON) {
+		printf("FAIL: %s: got \"%.*s\" (%d), not \"%s\" (%d)\n",
+		       what, (len >= 0 && len < 512) ? len : 0, got, len,
+		       want, want_len);
+		nfailed++;
+	}
+}
+
+static void
+check_hex(uint64_t val)
+{
+	static const int widths[] = { 0, 1, 3, 4, 8, 15, 16 };
+	char got[64], want[64], what[64];
+	unsigned i;
+	int len;
+
+	for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+		memset(got, POISON, sizeof(got));
+		len = mced_fmt_hex(got, val, widths[i]);
+		snprintf(want, sizeof(want), "0x%0*llx", widths[i],
+		         (unsigned long long)val);
+		snprintf(what, sizeof(what), "hex(0x%llx, %d)",
+		         (unsigned long long)val, widths[i]);
+		compare(what, got, len, want);
+	}
+}
+
+static void
+check_udec(uint64_t val)
+{
+	char got[64], want[64], what[64];
+	int len;
+
+	memset(got, POISON, sizeof(got));
+	len = mced_fmt_udec(got, val);
+	snprintf(want, sizeof(want), "%llu", (unsigned long long)val);
+	snprintf(what, sizeof(what), "udec(%llu)", (unsigned long long)val);
+	compare(what, got, len, want);
+}
+
+static void
+check_dec(int64_t val)
+{
+	char got[64], want[64], what[64];
+	int len;
+
+	memset(got, POISON, sizeof(got));
+	len = mced_fmt_dec(got, val);
+	snprintf(want, sizeof(want), "%lld", (long long)val);
+	snprintf(what, sizeof(what), "dec(%lld)", (long long)val);
+	compare(what, got, len, want);
+}
+
+/* every value near a digit boundary, in both bases, and some others */
+static void
+check_numbers(void)
+{
+	uint64_t p10 = 1;
+	uint64_t r = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	check_hex(0);
+	check_udec(0);
+	check_dec(0);
+	for (i = 0; i < 64; i++) {
+		uint64_t p2 = 1ULL << i;
+
+		check_hex(p2);
+		check_hex(p2 - 1);
+		check_hex(p2 + 1);
+		check_udec(p2);
+		check_udec(p2 - 1);
+		check_dec(p2);
+		check_dec(-(int64_t)(p2 - 1));
+	}
+	for (i = 0; i < 20; i++) {
+		check_udec(p10);
+		check_udec(p10 - 1);
+		check_udec(p10 + 1);
+		check_dec(p10 - 1);
+		check_dec(-(int64_t)(p10 - 1));
+		check_dec(-(int64_t)p10);
+		if (i < 19) {
+			p10 *= 10;
+		}
+	}
+	check_hex(UINT64_MAX);
+	check_udec(UINT64_MAX);
+	check_udec(UINT32_MAX);
+	check_dec(INT64_MAX);
+	check_dec(INT64_MIN);
+	check_dec(INT_MAX);
+	check_dec(INT_MIN);
+	check_dec(-1);
+
+	/* and a few thousand arbitrary ones */
+	for (i = 0; i < 4096; i++) {
+		r ^= r << 13;
+		r ^= r >> 7;
+		r ^= r << 17;
+		check_hex(r >> (i % 64));
+		check_udec(r >> (i % 64));
+		check_dec((int64_t)r >> (i % 64));
+	}
+}
+
+static void
+check_lines(const char *what, const struct mce *mce)
+{
+	char got[MCE_V2_MSG_MAX + 2], want[2 * MCE_V2_MSG_MAX];
+	char name[64];
+	size_t len;
+
+	memset(got, POISON, sizeof(got));
+	len = mced_format_v1(mce, got);
+	old_v1(mce, want, sizeof(want));
+	snprintf(name, sizeof(name), "v1 line of %s", what);
+	if (len > MCE_V1_MSG_MAX || got[len] != '\0') {
+		printf("FAIL: %s: %zu bytes, or not terminated\n", name, len);
+		nfailed++;
+	}
+	got[len] = POISON;
+	compare(name, got, len, want);
+
+	memset(got, POISON, sizeof(got));
+	len = mced_format_v2(mce, got);
+	old_v2(mce, want, sizeof(want));
+	snprintf(name, sizeof(name), "v2 line of %s", what);
+	if (len > MCE_V2_MSG_MAX || got[len] != '\0') {
+		printf("FAIL: %s: %zu bytes, or not terminated\n", name, len);
+		nfailed++;
+	}
+	got[len] = POISON;
+	compare(name, got, len, want);
+}
+
+int
+main(void)
+{
+	struct mce m;
+	unsigned char *p;
+	uint32_t r = 2463534242U;
+	int i;
+	size_t j;
+
+	check_numbers();
+
+	memset(&m, 0, sizeof(m));
+	check_lines("a zeroed MCE", &m);
+
+	m.mci_status = 0x9c00000000010151ULL;
+	m.mci_address = 0x12345678abcULL;
+	m.mci_misc = 0x8c;
+	m.mcg_status = 0x5;
+	m.time = 1700000000123456ULL;
+	m.boot = -1;
+	m.cpu = 42;
+	m.socket = 3;
+	m.bank = 12;
+	m.vendor = VENDOR_AMD;
+	m.seq = 123456789;
+	check_lines("a typical MCE", &m);
+	m.repeats = 999;
+	m.ncpus = MCE_SUMMARY_CPUS + 2;
+	for (i = 0; i < MCE_SUMMARY_CPUS; i++) {
+		m.cpus[i] = i * 1000;
+	}
+	m.first_time = 1699999999000000ULL;
+	check_lines("a summary", &m);
+	m.ncpus = 1;
+	check_lines("a summary on one CPU", &m);
+
+	/* the longest lines there can be */
+	memset(&m, 0xff, sizeof(m));
+	m.boot = INT_MIN;
+	m.socket = INT_MIN;
+	m.vendor = INT8_MIN;
+	check_lines("an MCE of extremes", &m);
+	m.repeats = 0;
+	check_lines("an MCE of all ones", &m);
+
+	/* and random ones */
+	for (i = 0; i < 1000; i++) {
+		p = (unsigned char *)&m;
+		for (j = 0; j < sizeof(m); j++) {
+			r ^= r << 13;
+			r ^= r >> 17;
+			r ^= r << 5;
+			p[j] = r;
+		}
+		if (i & 1) {
+			m.ncpus %= MCE_SUMMARY_CPUS + 2;
+		}
+		check_lines("a random MCE", &m);
+	}
+
+	if (nfailed) {
+		printf("%d check%s failed\n", nfailed, (nfailed == 1) ? "" : "s");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+#!/bin/sh
+#
+# test_ingest.sh - drive mced's ingest thread through a fake mcelog device
+#
+# This needs mced built with ENABLE_FAKE_DEV_MCELOG=1, and with
+# CHECK_FOR_NON_POLL_KERNELS=0 so that the FIFO is waited on with poll(),
+# as /dev/mcelog is on any kernel since 2.6.31.
+#
+
+cd "$(dirname "$0")" || exit 1
+
+if ! grep -q -- '-DENABLE_FAKE_DEV_MCELOG=1' .make_flags 2>/dev/null \
+ || ! grep -q -- '-DCHECK_FOR_NON_POLL_KERNELS=0' .make_flags; then
+	echo "skipped: needs ENABLE_FAKE_DEV_MCELOG=1 CHECK_FOR_NON_POLL_KERNELS=0"
+	exit 0
+fi
+
+dir=$(mktemp -d) || exit 1
+mced_pid=
+holder_pid=
+
+cleanup()
+{
+	[ -n "$holder_pid" ] && kill "$holder_pid" 2>/dev/null
+	[ -n "$mced_pid" ] && kill "$mced_pid" 2>/dev/null
+	wait
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	sed 's/^/  | /' "$dir/log"
+	exit 1
+}
+
+# wait up to 5 secs for the log to have 'count' lines matching 'pattern'
+wait_for_log()
+{
+	pattern=$1
+	count=$2
+	tries=50
+
+	while [ "$(grep -c -- "$pattern" "$dir/log")" -lt "$count" ]; do
+		tries=$((tries - 1))
+		[ "$tries" -gt 0 ] || fail "mced never logged '$pattern'"
+		sleep 0.1
+	done
+}
+
+# ask mced for its stats, and wait for them
+nstats=0
+get_stats()
+{
+	nstats=$((nstats + 1))
+	kill -USR1 "$mced_pid"
+	wait_for_log "ingest ring:" "$nstats"
+	wait_for_log "ingest scheduler:" "$nstats"
+	wait_for_log "wakeups:" "$nstats"
+	ring=$(grep "ingest ring:" "$dir/log" | tail -n 1)
+	sched=$(grep "ingest scheduler:" "$dir/log" | tail -n 1)
+	wakeups=$(grep "wakeups:" "$dir/log" | tail -n 1)
+}
+
+# the value of 'name=' in the last stats
+stat()
+{
+	echo "$ring $sched $wakeups" | sed -n "s/.* $1=\([^ ]*\).*/\1/p"
+}
+
+# write 'count' fake MCEs to the device, and wait for them to be read
+nsent=0
+send_mces()
+{
+	head -c "$1" /dev/zero | ./mcelog_faker "$dir/dev" > /dev/null \
+		|| fail "mcelog_faker failed"
+	nsent=$((nsent + $1))
+	tries=50
+	get_stats
+	while [ "$(stat pushed)" -lt "$nsent" ]; do
+		tries=$((tries - 1))
+		[ "$tries" -gt 0 ] || fail "only $(stat pushed) of $nsent MCEs read"
+		sleep 0.1
+		get_stats
+	done
+}
+
+mkdir "$dir/conf"
+mkfifo "$dir/dev"
+set -- -f -d -c "$dir/conf" -D "$dir/dev" -s "$dir/sock" -p "$dir/pid"
+if grep -q -- '-DENABLE_MCEDB=1' .make_flags; then
+	mkdir "$dir/db"
+	set -- "$@" -B "$dir/db"
+fi
+./mced "$@" > "$dir/log" 2>&1 &
+mced_pid=$!
+# hold the FIFO open for writing, so that it never reads as closed
+sleep 1000 > "$dir/dev" &
+holder_pid=$!
+wait_for_log "waiting for events" 1
+
+#
+# With poll(), the ingest thread must arm no timer at all, so when there
+# are no MCEs it never wakes up.
+#
+get_stats
+[ "$(stat interval)" = "none" ] || fail "a timer is armed: $sched"
+idle=$(stat ingest)
+sleep 1
+get_stats
+[ "$(stat ingest)" = "$idle" ] || fail "woke up while idle: $wakeups"
+[ "$(stat idle_wakeups)" = "0" ] || fail "woke up for nothing: $sched"
+
+# and it still wakes up for MCEs, and goes back to sleep after them
+send_mces 5
+[ "$(stat ingest)" -gt "$idle" ] || fail "no wakeup for MCEs: $wakeups"
+[ "$(stat interval)" = "none" ] || fail "a timer was armed: $sched"
+busy=$(stat ingest)
+sleep 1
+get_stats
+[ "$(stat ingest)" = "$busy" ] || fail "woke up after MCEs: $wakeups"
+[ "$(stat idle_wakeups)" = "0" ] || fail "woke up for nothing: $sched"
+grep -q "DBG: poll timeout" "$dir/log" && fail "the timer went off"
+
+#
+# A drain reads the log once, unless the read filled the buffer: a burst
+# smaller than the kernel's log takes one read() each time it wakes up.
+#
+[ "$(stat loglen)" = "32" ] || fail "the fake log is not the kernel's size: $sched"
+for burst in 1 5 31; do
+	send_mces "$burst"
+	reads=$(($(stat reads) + $(stat empty_reads)))
+	[ "$reads" = "$(stat drains)" ] \
+		|| fail "$reads reads for $(stat drains) drains: $sched"
+done
+
+# and a flood bigger than the log is read in full
+send_mces 100
+[ "$(stat pushed)" = "$nsent" ] || fail "read $(stat pushed) of $nsent MCEs"
+
+exit 0
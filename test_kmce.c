@@ -0,0 +1,260 @@
+/*
+ *  test_kmce.c - feed kernel records of every size through their layouts
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mced.h"
+#include "kmce.h"
+
+/* the time a batch was read, for records without one */
+#define NOW	1700000000123456ULL
+
+/*
+ * X(member, kmce_member, since, missing): 'member' of struct mce comes from
+ * 'kmce_member' in records of at least 'since' bytes, and is 'missing' in
+ * smaller ones.  The time and the CPU are checked on their own.
+ */
+#define KMCE_FIELDS(X) \
+	X(mci_status,	status,		72,	0) \
+	X(mci_misc,	misc,		72,	0) \
+	X(mci_address,	addr,		72,	0) \
+	X(mcg_status,	mcgstatus,	72,	0) \
+	X(ip,		rip,		72,	0) \
+	X(tsc,		tsc,		72,	0) \
+	X(cs,		cs,		72,	0) \
+	X(bank,		bank,		72,	0) \
+	X(vendor,	cpuvendor,	88,	VENDOR_UNKNOWN) \
+	X(cpuid_eax,	cpuid,		88,	0) \
+	X(socket,	socketid,	88,	-1) \
+	X(init_apic_id,	apicid,		88,	(uint32_t)-1U) \
+	X(mcg_cap,	mcgcap,		88,	0) \
+	X(mci_synd,	synd,		96,	0) \
+	X(mci_ipid,	ipid,		104,	0) \
+	X(ppin,		ppin,		112,	0) \
+	X(microcode,	microcode,	120,	0)
+
+static int nfailed;
+
+/*
+ * A page with a record at its very end, and an inaccessible page after
+ * it, so a converter which reads past its record crashes.
+ */
+static unsigned char *
+record_page(size_t *page_size)
+{
+	unsigned char *page;
+
+	*page_size = sysconf(_SC_PAGESIZE);
+	page = mmap(NULL, 2 * *page_size, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+	if (mprotect(page + *page_size, *page_size, PROT_NONE) < 0) {
+		perror("mprotect()");
+		exit(EXIT_FAILURE);
+	}
+	return page;
+}
+
+/* convert the first bytes of 'k' with a layout, and check the result */
+static void
+check_record(const struct kmce_layout *layout, const struct kernel_mce *k,
+             unsigned char *page, size_t page_size)
+{
+	unsigned char *rec = page + page_size - layout->len;
+	struct mce m;
+	uint64_t want_time;
+	unsigned want_cpu;
+
+	memcpy(rec, k, layout->len);
+	/* so that anything the converter does not set shows */
+	memset(&m, 0xa5, sizeof(m));
+	layout->convert((const struct kernel_mce *)rec, NOW, &m);
+
+#define CHECK_FIELD(member, kmce_member, since, missing) \
+	if (m.member != ((layout->len >= since) ? \
+	                 (__typeof__(m.member))k->kmce_member : \
+	                 (__typeof__(m.member))(missing))) { \
+		printf("FAIL: %zu bytes: " #member " is 0x%llx\n", \
+		       layout->len, (unsigned long long)m.member); \
+		nfailed++; \
+	}
+	KMCE_FIELDS(CHECK_FIELD)
+#undef CHECK_FIELD
+
+	want_time = (layout->len >= 88 && k->time) ? k->time * 1000000ULL : NOW;
+	if (m.time != want_time) {
+		printf("FAIL: %zu bytes: time is %llu, not %llu\n",
+		       layout->len, (unsigned long long)m.time,
+		       (unsigned long long)want_time);
+		nfailed++;
+	}
+	want_cpu = (layout->len >= 88) ? k->extcpu : k->cpu;
+	if (m.cpu != want_cpu) {
+		printf("FAIL: %zu bytes: cpu is %u, not %u\n",
+		       layout->len, m.cpu, want_cpu);
+		nfailed++;
+	}
+
+	/* nothing the kernel does not report may be left over */
+	if (m.boot || m.seq || m.repeats || m.ncpus || m.first_time
+	 || m.cpus[0] || m.cpus[MCE_SUMMARY_CPUS - 1]) {
+		printf("FAIL: %zu bytes: fields the kernel has no part in "
+		       "were not cleared\n", layout->len);
+		nfailed++;
+	}
+}
+
+static void
+check_sizes(void)
+{
+	static const struct {
+		size_t record_len;
+		size_t layout_len;	/* 0 if there is none */
+	} sizes[] = {
+		{ 0, 0 }, { 64, 0 }, { 71, 0 }, { 72, 72 }, { 80, 72 },
+		{ 88, 88 }, { 92, 0 }, { 96, 96 }, { 104, 104 }, { 112, 112 },
+		{ 120, 120 }, { 124, 0 }, { 128, 128 }, { 136, 128 },
+		{ 256, 128 },
+	};
+	const struct kmce_layout *layout;
+	unsigned i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		layout = mced_kmce_layout(sizes[i].record_len);
+		if ((layout ? layout->len : 0) != sizes[i].layout_len) {
+			printf("FAIL: %zu byte records are read as %zu\n",
+			       sizes[i].record_len, layout ? layout->len : 0);
+			nfailed++;
+		}
+	}
+	if (kmce_layouts[kmce_nlayouts - 1].len != sizeof(struct kernel_mce)) {
+		printf("FAIL: the newest layout is not struct kernel_mce\n");
+		nfailed++;
+	}
+}
+
+/* the most records batches are checked with */
+#define MAX_BATCH	40
+
+/*
+ * Fill batches of every size from random records, biggest first so each
+ * batch is left over from a bigger one, and check the columns and the
+ * classes against what the converter makes of each record.
+ */
+static void
+check_batches(const struct kmce_layout *layout, uint32_t *r)
+{
+	static const uint8_t classes[] = {
+		KMCE_VAL, KMCE_OVER, KMCE_UC, KMCE_ADDRV, KMCE_PCC,
+		KMCE_UC | KMCE_PCC,
+	};
+	const uint8_t bits = KMCE_VAL | KMCE_OVER | KMCE_UC | KMCE_ADDRV
+	                   | KMCE_PCC;
+	uint8_t raw[MAX_BATCH * sizeof(struct kernel_mce)];
+	struct kmce_batch b;
+	struct mce m;
+	size_t j;
+	int n, i, c;
+
+	if (kmce_batch_alloc(&b, MAX_BATCH) < 0) {
+		printf("FAIL: can't allocate a batch\n");
+		nfailed++;
+		return;
+	}
+	for (n = MAX_BATCH; n > 0; n--) {
+		for (j = 0; j < n * layout->len; j++) {
+			*r ^= *r << 13;
+			*r ^= *r >> 17;
+			*r ^= *r << 5;
+			raw[j] = *r;
+		}
+		kmce_batch_fill(&b, raw, n, layout->len, layout, NOW);
+
+		for (i = 0; i < n; i++) {
+			layout->convert((const struct kernel_mce *)
+			                &raw[i * layout->len], NOW, &m);
+			if (b.status[i] != m.mci_status
+			 || b.addr[i] != m.mci_address
+			 || b.misc[i] != m.mci_misc
+			 || b.bank[i] != m.bank || b.cpu[i] != m.cpu
+			 || b.class[i] != ((m.mci_status >> 56) & bits)) {
+				printf("FAIL: %zu byte record %d of %d has the "
+				       "wrong columns\n", layout->len, i, n);
+				nfailed++;
+			}
+		}
+		for (c = 0; c < (int)sizeof(classes); c++) {
+			int want = 0;
+
+			for (i = 0; i < n; i++) {
+				want += (b.class[i] & classes[c]) != 0;
+			}
+			if (kmce_batch_count(&b, classes[c]) != want) {
+				printf("FAIL: a batch of %d counts %d of class "
+				       "0x%02x, not %d\n", n,
+				       kmce_batch_count(&b, classes[c]),
+				       classes[c], want);
+				nfailed++;
+			}
+		}
+	}
+	kmce_batch_free(&b);
+}
+
+int
+main(void)
+{
+	struct kernel_mce k;
+	unsigned char *page, *p;
+	size_t page_size, j;
+	uint32_t r = 2463534242U;
+	int i, round;
+
+	check_sizes();
+
+	page = record_page(&page_size);
+	for (round = 0; round < 100; round++) {
+		/* random bytes, and once with no time of its own */
+		p = (unsigned char *)&k;
+		for (j = 0; j < sizeof(k); j++) {
+			r ^= r << 13;
+			r ^= r >> 17;
+			r ^= r << 5;
+			p[j] = r;
+		}
+		if (round == 0) {
+			k.time = 0;
+		}
+		for (i = 0; i < kmce_nlayouts; i++) {
+			check_record(&kmce_layouts[i], &k, page, page_size);
+		}
+	}
+	for (i = 0; i < kmce_nlayouts; i++) {
+		check_batches(&kmce_layouts[i], &r);
+	}
+
+	if (nfailed) {
+		printf("%d check%s failed\n", nfailed, (nfailed == 1) ? "" : "s");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
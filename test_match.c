@@ -0,0 +1,276 @@
+/*
+ *  test_match.c - check the rule index against a scan of every rule
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mced.h"
+#include "match.h"
+
+/* what match.c needs from mced.c */
+int
+mced_log(int level __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+int
+mced_debug(int min_dbg_lvl __attribute__((unused)),
+           const char *fmt __attribute__((unused)), ...)
+{
+	return 0;
+}
+
+int
+mced_perror(int level __attribute__((unused)), const char *str)
+{
+	perror(str);
+	return 0;
+}
+
+/* the match keys of each rule, as its file would give them */
+static const char *const rules[][9] = {
+	/* 0 */  { NULL },
+	/* 1 */  { "bank", "0-7", NULL },
+	/* 2 */  { "bank", "4-11", NULL },
+	/* 3 */  { "bank", "2,6,200-255", NULL },
+	/* 4 */  { "vendor", "intel", NULL },
+	/* 5 */  { "vendor", "amd,unknown", "bank", "4-11", NULL },
+	/* 6 */  { "uncorrected", "yes", NULL },
+	/* 7 */  { "uncorrected", "no", "bank", "0-3", NULL },
+	/* 8 */  { "severity", "fatal", NULL },
+	/* 9 */  { "status_mask", "0x8000000000000000", NULL },
+	/* 10 */ { "status_mask", "0xffff", "status_value", "0x0151", NULL },
+	/* 11 */ { "status_mask", "0xffff", "status_value", "0x0135", NULL },
+	/* 12 */ { "status_mask", "0xffff", "status_value", "0", NULL },
+	/* 13 */ { "status_mask", "0xffff", "status_value", "0x0151",
+	           "uncorrected", "yes", NULL },
+	/* 14 */ { "status_mask", "0x0400000000000000", "status_value", "0",
+	           "severity", "uncorrected", NULL },
+	/* 15 */ { "cpu", "0-3,64", "socket", "1", NULL },
+	/* 16 */ { "socket", "-1", "bank", "6", NULL },
+	/* 17 */ { "uncorrected", "yes", "vendor", "intel",
+	           "bank", "200-255", NULL },
+};
+#define NRULES	(int)(sizeof(rules) / sizeof(rules[0]))
+
+#define VAL	MCI_STATUS_VAL
+#define OVER	MCI_STATUS_OVER
+#define UC	MCI_STATUS_UC
+#define ADDRV	MCI_STATUS_ADDRV
+#define PCC	MCI_STATUS_PCC
+
+/* MCEs which should hit exactly these rules, worked out by hand */
+static const struct {
+	uint64_t status;
+	uint8_t bank;
+	int8_t vendor;
+	uint32_t cpu;
+	int32_t socket;
+	int hits[NRULES + 1];	/* ends with -1 */
+} cases[] = {
+	{ VAL | 0x0151, 6, VENDOR_INTEL, 2, 1,
+	  { 0, 1, 2, 3, 4, 9, 10, 15, -1 } },
+	{ VAL | UC | PCC | 0x0151, 6, VENDOR_AMD, 64, -1,
+	  { 0, 1, 2, 3, 5, 6, 8, 9, 10, 13, 14, 16, -1 } },
+	{ VAL | UC | ADDRV | 0x0135, 200, VENDOR_INTEL, 5, 0,
+	  { 0, 3, 4, 6, 9, 11, 17, -1 } },
+	{ OVER, 3, VENDOR_UNKNOWN, 3, 1,
+	  { 0, 1, 7, 12, 15, -1 } },
+	{ UC | 0x0151, 12, VENDOR_CYRIX, 9, 2,
+	  { 0, 6, 10, 13, 14, -1 } },
+};
+#define NCASES	(int)(sizeof(cases) / sizeof(cases[0]))
+
+/* every mix of these, against the scan */
+static const uint64_t statuses[] = {
+	0, VAL | 0x0151, VAL | UC | 0x0151, VAL | UC | PCC | 0x0135,
+	VAL | OVER, UC | ADDRV | 0x0151, VAL | UC | ADDRV | 0x0135,
+	VAL | UC | PCC, ~0ULL,
+};
+static const uint8_t banks[] = { 0, 2, 3, 4, 6, 7, 8, 11, 12, 199, 200, 255 };
+static const int8_t vendors[] = { VENDOR_UNKNOWN, VENDOR_INTEL, VENDOR_AMD };
+static const struct {
+	uint32_t cpu;
+	int32_t socket;
+} places[] = { { 0, 1 }, { 64, 1 }, { 5, -1 }, { 65, 0 } };
+#define N(a)	(int)(sizeof(a) / sizeof(a[0]))
+
+static int nfailed;
+
+static void
+make_match(struct mced_match *m, int rule)
+{
+	const char *const *kv;
+
+	mced_match_init(m);
+	for (kv = rules[rule]; kv[0]; kv += 2) {
+		if (mced_match_set(m, kv[0], kv[1]) != 0) {
+			printf("FAIL: rule %d: bad %s = %s\n", rule, kv[0], kv[1]);
+			nfailed++;
+		}
+	}
+	if (mced_match_finish(m) < 0) {
+		printf("FAIL: rule %d can never match\n", rule);
+		nfailed++;
+	}
+}
+
+static void
+print_hits(const char *what, const int *hits, int n)
+{
+	int i;
+
+	printf("  %s:", what);
+	for (i = 0; i < n; i++) {
+		printf(" %d", hits[i]);
+	}
+	printf("\n");
+}
+
+/* the index must find what a scan of every match finds, in order */
+static void
+check(struct mced_match_index *idx, const struct mced_match *const *matches,
+      int n, const struct mce *mce, const int *want, int nwant)
+{
+	int hits[n];
+	int scan[n];
+	int nhits;
+	int nscan = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (mced_match_mce(matches[i], mce)) {
+			scan[nscan++] = i;
+		}
+	}
+	if (!want) {
+		want = scan;
+		nwant = nscan;
+	} else if (nscan != nwant || memcmp(scan, want, nwant * sizeof(int))) {
+		printf("FAIL: a scan for status 0x%016llx bank %u is wrong\n",
+		       (unsigned long long)mce->mci_status, mce->bank);
+		print_hits("want", want, nwant);
+		print_hits("scan", scan, nscan);
+		nfailed++;
+	}
+
+	nhits = mced_match_index_find(idx, mce, hits);
+	if (nhits != nwant || memcmp(hits, want, nwant * sizeof(int))) {
+		printf("FAIL: the index for status 0x%016llx bank %u vendor "
+		       "%d cpu %u socket %d is wrong\n",
+		       (unsigned long long)mce->mci_status, mce->bank,
+		       mce->vendor, mce->cpu, mce->socket);
+		print_hits("want", want, nwant);
+		print_hits("index", hits, nhits);
+		nfailed++;
+	}
+}
+
+/* the rules 'copies' times over, so the bitsets span several words */
+static void
+check_rules(int copies)
+{
+	int n = NRULES * copies;
+	struct mced_match m[n];
+	const struct mced_match *matches[n];
+	struct mced_match_index *idx;
+	struct mce mce;
+	int i, s, b, v, p;
+
+	for (i = 0; i < n; i++) {
+		make_match(&m[i], i % NRULES);
+		matches[i] = &m[i];
+	}
+	idx = mced_match_index_build(matches, n);
+	if (!idx) {
+		printf("FAIL: can't build an index of %d rules\n", n);
+		nfailed++;
+		return;
+	}
+
+	memset(&mce, 0, sizeof(mce));
+	if (copies == 1) {
+		for (i = 0; i < NCASES; i++) {
+			int nwant;
+
+			mce.mci_status = cases[i].status;
+			mce.bank = cases[i].bank;
+			mce.vendor = cases[i].vendor;
+			mce.cpu = cases[i].cpu;
+			mce.socket = cases[i].socket;
+			for (nwant = 0; cases[i].hits[nwant] >= 0; nwant++)
+				;
+			check(idx, matches, n, &mce, cases[i].hits, nwant);
+		}
+	}
+	for (s = 0; s < N(statuses); s++) {
+		for (b = 0; b < N(banks); b++) {
+			for (v = 0; v < N(vendors); v++) {
+				for (p = 0; p < N(places); p++) {
+					mce.mci_status = statuses[s];
+					mce.bank = banks[b];
+					mce.vendor = vendors[v];
+					mce.cpu = places[p].cpu;
+					mce.socket = places[p].socket;
+					check(idx, matches, n, &mce, NULL, 0);
+				}
+			}
+		}
+	}
+
+	mced_match_index_free(idx);
+	for (i = 0; i < n; i++) {
+		mced_match_free(&m[i]);
+	}
+}
+
+int
+main(void)
+{
+	struct mced_match_index *idx;
+	struct mce mce;
+	int hits[1];
+
+	check_rules(1);
+	check_rules(5);
+
+	/* no rules at all */
+	idx = mced_match_index_build(NULL, 0);
+	if (!idx) {
+		printf("FAIL: can't build an empty index\n");
+		nfailed++;
+	} else {
+		memset(&mce, 0, sizeof(mce));
+		if (mced_match_index_find(idx, &mce, hits) != 0) {
+			printf("FAIL: an empty index found a rule\n");
+			nfailed++;
+		}
+		mced_match_index_free(idx);
+	}
+
+	if (nfailed) {
+		printf("%d check%s failed\n", nfailed, (nfailed == 1) ? "" : "s");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,503 @@
+/*
+ *  test_mcedb.c - crash recovery and queries of the MCE store
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mced.h"
+#include "fields.h"
+#include "mcedb.h"
+
+/* what mcedb.c needs from mced.c */
+int
+mced_log(int level __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+int
+mced_debug(int min_dbg_lvl __attribute__((unused)),
+           const char *fmt __attribute__((unused)), ...)
+{
+	return 0;
+}
+
+int
+mced_perror(int level __attribute__((unused)), const char *str)
+{
+	perror(str);
+	return 0;
+}
+
+static int nfailed;
+
+#define FAIL(...) do { \
+	printf("FAIL: " __VA_ARGS__); \
+	nfailed++; \
+} while (0)
+
+/* the MCE appended as record 'i', all its fields made from 'i' */
+static void
+make_mce(uint64_t i, struct mce *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->mci_status = MCI_STATUS_VAL | (i & 0xffff);
+	m->mci_address = i * 0x1000;
+	m->time = 1700000000000000ULL + i * 1000;
+	m->cpu = i % 97;
+	m->socket = i % 4;
+	m->bank = i % 29;
+	m->seq = i;
+}
+
+/* is the record at 'i' the one make_mce() made? */
+static int
+record_ok(struct mce_database *db, uint64_t i)
+{
+	struct mce_v3_record got;
+	struct mce_v3_record want;
+	struct mce m;
+
+	if (mcedb_read(db, i, &got) < 0) {
+		return 0;
+	}
+	make_mce(i, &m);
+	mced_mce_to_v3(&m, &want);
+	return !memcmp(&got, &want, sizeof(got));
+}
+
+static int
+append(struct mce_database *db, uint64_t first, uint64_t n)
+{
+	struct mce m;
+	uint64_t i;
+
+	for (i = first; i < first + n; i++) {
+		make_mce(i, &m);
+		if (mcedb_append(db, &m) < 0) {
+			FAIL("can't append record %llu\n",
+			     (unsigned long long)i);
+			return -1;
+		}
+	}
+	if (mcedb_commit(db) < 0) {
+		FAIL("can't commit records %llu-%llu\n",
+		     (unsigned long long)first,
+		     (unsigned long long)(first + n - 1));
+		return -1;
+	}
+	return 0;
+}
+
+/* the log must hold records [0, end), made by make_mce(), and no more */
+static void
+check_log(struct mce_database *db, uint64_t end, const char *when)
+{
+	struct mce_v3_record rec;
+	uint64_t i;
+	uint64_t bad = 0;
+
+	if ((uint64_t)mcedb_end(db) != end) {
+		FAIL("%s: the log ends at %lld, not %llu\n", when,
+		     mcedb_end(db), (unsigned long long)end);
+	}
+	for (i = 0; i < end; i++) {
+		if (!record_ok(db, i) && !bad++) {
+			FAIL("%s: record %llu is wrong\n", when,
+			     (unsigned long long)i);
+		}
+	}
+	if (mcedb_read(db, end, &rec) == 0) {
+		FAIL("%s: there is a record past the end\n", when);
+	}
+}
+
+static char *
+seg_file(const char *dir, uint64_t first, const char *suffix)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/seg-%016llx%s", dir,
+	         (unsigned long long)first, suffix);
+	return path;
+}
+
+static off_t
+record_offset(uint64_t slot)
+{
+	return MCEDB_HDR_SIZE + slot * sizeof(struct mcedb_record);
+}
+
+/*
+ * Append records, overflowing the first segment, then break one record in
+ * the middle of the second and leave a half-made segment behind, as a
+ * crash could.  The log must end just before the broken record, and what
+ * was after it must be gone for good.
+ */
+static void
+test_recovery(const char *dir)
+{
+	struct mce_database *db;
+	const uint64_t seg2 = MCEDB_SEG_RECORDS;
+	const uint64_t total = MCEDB_SEG_RECORDS + 150;
+	const uint64_t bad = MCEDB_SEG_RECORDS + 75;
+	struct mcedb_record rec;
+	struct mcedb_record zero;
+	uint64_t slot;
+	int fd;
+
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't create a database in %s\n", dir);
+		return;
+	}
+	check_log(db, 0, "new");
+	if (append(db, 0, total - 50) < 0 || append(db, total - 50, 50) < 0) {
+		mcedb_close(db);
+		return;
+	}
+	check_log(db, total, "appended");
+	mcedb_close(db);
+	if (access(seg_file(dir, seg2, ""), F_OK) < 0) {
+		FAIL("no second segment after %llu records\n",
+		     (unsigned long long)total);
+	}
+
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't reopen the database\n");
+		return;
+	}
+	check_log(db, total, "reopened");
+	mcedb_close(db);
+
+	/* break the CRC of one record, and leave a stale segment */
+	fd = open(seg_file(dir, seg2, ""), O_RDWR);
+	if (fd < 0 || pread(fd, &rec, sizeof(rec), record_offset(bad - seg2))
+	              != sizeof(rec)) {
+		FAIL("can't read record %llu\n", (unsigned long long)bad);
+		return;
+	}
+	rec.crc ^= htole32(1);
+	if (pwrite(fd, &rec, sizeof(rec), record_offset(bad - seg2))
+	    != sizeof(rec)) {
+		FAIL("can't break record %llu\n", (unsigned long long)bad);
+	}
+	close(fd);
+	fd = open(seg_file(dir, 2 * seg2, ".tmp"), O_WRONLY|O_CREAT, 0644);
+	if (fd < 0 || write(fd, "junk", 4) != 4) {
+		FAIL("can't make a stale segment\n");
+	}
+	close(fd);
+
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't open the database after a crash\n");
+		return;
+	}
+	check_log(db, bad, "recovered");
+	if (access(seg_file(dir, 2 * seg2, ".tmp"), F_OK) == 0) {
+		FAIL("the stale segment was left behind\n");
+	}
+
+	/* the records after the broken one were cleared on disk */
+	fd = open(seg_file(dir, seg2, ""), O_RDONLY);
+	memset(&zero, 0, sizeof(zero));
+	for (slot = bad - seg2; slot < MCEDB_SEG_RECORDS; slot++) {
+		if (pread(fd, &rec, sizeof(rec), record_offset(slot))
+		    != sizeof(rec) || memcmp(&rec, &zero, sizeof(rec))) {
+			FAIL("record %llu was not cleared\n",
+			     (unsigned long long)(seg2 + slot));
+			break;
+		}
+	}
+	close(fd);
+
+	/*
+	 * The log goes on from the broken record, and the old records
+	 * after it can not come back when the new ones are read.
+	 */
+	if (append(db, bad, 1) == 0) {
+		check_log(db, bad + 1, "appended after recovery");
+	}
+	mcedb_close(db);
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't reopen the recovered database\n");
+		return;
+	}
+	check_log(db, bad + 1, "reopened after recovery");
+	mcedb_close(db);
+}
+
+/*
+ * The query store holds more records than one mcedb_query_next() may look
+ * at, spread over every key, with some keys beyond what the posting lists
+ * index, and some times out of order.
+ */
+#define QUERY_RECORDS	70000
+#define QUERY_T0	1700000000000000ULL
+
+static void
+make_query_mce(uint64_t i, struct mce *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->seq = i;
+	m->time = QUERY_T0 + i * 10;
+	if (i % 101 == 0) {
+		/* much earlier, so its block's times cover the whole log */
+		m->time = QUERY_T0 + (QUERY_RECORDS - i) * 10;
+	}
+	m->cpu = i % 61;
+	if (i % 997 == 0) {
+		m->cpu = 65536 + i % 5;
+	}
+	m->socket = (i % 17 == 0) ? -1 : (int32_t)(i % 3);
+	if (i % 1009 == 0) {
+		m->socket = 70000;
+	}
+	m->bank = i % 23;
+	m->mci_status = MCI_STATUS_VAL | (i & 0xff);
+	if (i % 7 == 0) {
+		m->mci_status |= MCI_STATUS_UC;
+	}
+	if (i % 11 == 0) {
+		m->mci_status |= MCI_STATUS_PCC;
+	}
+}
+
+/* what mcedb.c's record_matches() says, for the scan */
+static int
+scan_matches(const struct mcedb_query *q, const struct mce_v3_record *rec)
+{
+	uint64_t t = le64toh(rec->time);
+
+	return t >= q->since && t <= q->until
+	    && (q->cpu == MCEDB_ANY || q->cpu == le32toh(rec->cpu))
+	    && (q->socket == MCEDB_ANY
+	     || q->socket == (int32_t)le32toh(rec->socket))
+	    && (q->bank == MCEDB_ANY || q->bank == rec->bank)
+	    && (le64toh(rec->mci_status) & q->status_mask)
+	       == q->status_value;
+}
+
+/*
+ * Run a query 'max' records at a time, and check it finds what a scan of
+ * the first 'end' records finds.  Returns how often it came back empty
+ * before it was done.
+ */
+static int
+check_query(struct mce_database *db, struct mcedb_cursor *c,
+            const struct mcedb_query *q, long long end, int max,
+            const char *what)
+{
+	struct mce_v3_record *want;
+	struct mce_v3_record *got;
+	long long nwant = 0;
+	long long ngot = 0;
+	long long i;
+	int calls = 0;
+	int empty = 0;
+
+	want = malloc(end * sizeof(*want));
+	got = malloc((end + max) * sizeof(*got));
+	if (!want || !got) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < end; i++) {
+		if (mcedb_read(db, i, &want[nwant]) < 0) {
+			FAIL("%s: can't read record %lld\n", what, i);
+			continue;
+		}
+		if (scan_matches(q, &want[nwant])) {
+			nwant++;
+		}
+	}
+
+	while (!mcedb_query_done(c)) {
+		int n = mcedb_query_next(c, got + ngot, max);
+
+		if (n < 0 || n > max || ngot + n > end) {
+			FAIL("%s: mcedb_query_next() returned %d\n", what, n);
+			break;
+		}
+		if (n == 0 && !mcedb_query_done(c)) {
+			empty++;
+		}
+		ngot += n;
+		/* every call looks at one record at least */
+		if (++calls > end + 1) {
+			FAIL("%s: the query never finished\n", what);
+			break;
+		}
+	}
+
+	if (ngot != nwant) {
+		FAIL("%s: the query found %lld records, the scan %lld\n",
+		     what, ngot, nwant);
+	} else if (memcmp(got, want, nwant * sizeof(*want))) {
+		FAIL("%s: the query found other records than the scan\n",
+		     what);
+	}
+	free(want);
+	free(got);
+	return empty;
+}
+
+static void
+test_queries(const char *dir)
+{
+	struct mce_database *db;
+	struct mcedb_cursor *c;
+	struct mcedb_query q;
+	struct mce m;
+	long long end;
+	uint64_t i;
+	int empty;
+
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't create a database in %s\n", dir);
+		return;
+	}
+	for (i = 0; i < QUERY_RECORDS; i++) {
+		make_query_mce(i, &m);
+		if (mcedb_append(db, &m) < 0) {
+			FAIL("can't append record %llu\n",
+			     (unsigned long long)i);
+			mcedb_close(db);
+			return;
+		}
+	}
+	mcedb_commit(db);
+	mcedb_close(db);
+
+	/* the indexes are built at startup, so query what was reopened */
+	db = mcedb_open(dir);
+	if (!db) {
+		FAIL("can't reopen the database\n");
+		return;
+	}
+	end = mcedb_end(db);
+
+#define QUERY(what, max, ...) do { \
+	empty = 0; \
+	mcedb_query_init(&q); \
+	__VA_ARGS__; \
+	c = mcedb_query(db, &q); \
+	if (!c) { \
+		FAIL("%s: can't start the query\n", what); \
+		break; \
+	} \
+	empty = check_query(db, c, &q, end, max, what); \
+	mcedb_query_free(c); \
+} while (0)
+
+	QUERY("everything", 1000, );
+	QUERY("everything, 7 at a time", 7, );
+	QUERY("a cpu", 7, q.cpu = 5);
+	QUERY("a cpu and bank", 7, q.cpu = 5; q.bank = 5);
+	QUERY("a socket in a time window", 7, q.socket = 2;
+	      q.since = QUERY_T0 + 20000 * 10; q.until = QUERY_T0 + 30000 * 10);
+	QUERY("a bank, uncorrected", 7, q.bank = 7;
+	      q.status_mask = MCI_STATUS_UC; q.status_value = MCI_STATUS_UC);
+	QUERY("everything but a status", 7, q.cpu = 60; q.socket = 0;
+	      q.bank = 22; q.status_mask = MCI_STATUS_VAL|MCI_STATUS_PCC;
+	      q.status_value = MCI_STATUS_VAL);
+	QUERY("a time window", 7,
+	      q.since = QUERY_T0 + 40000 * 10; q.until = QUERY_T0 + 40500 * 10);
+	QUERY("a cpu beyond the list limit", 7, q.cpu = 65537);
+	QUERY("a socket beyond the list limit", 7, q.socket = 70000);
+	QUERY("a cpu never seen", 7, q.cpu = 1234);
+	QUERY("an empty time window", 7, q.since = QUERY_T0 + 10;
+	      q.until = QUERY_T0);
+
+	/* a scan of every record for nothing has to come up for air */
+	QUERY("no status matches", 7, q.status_mask = ~0ULL;
+	      q.status_value = 1);
+	if (empty == 0) {
+		FAIL("a query of %d records never returned before it was "
+		     "done\n", QUERY_RECORDS);
+	}
+	QUERY("no status matches, in a cpu list", 7, q.cpu = 3;
+	      q.status_mask = ~0ULL; q.status_value = 1);
+
+	/* records appended after a query started are not part of it */
+	mcedb_query_init(&q);
+	q.bank = 4;
+	c = mcedb_query(db, &q);
+	for (i = QUERY_RECORDS; i < QUERY_RECORDS + 100; i++) {
+		make_query_mce(i, &m);
+		mcedb_append(db, &m);
+	}
+	if (c) {
+		check_query(db, c, &q, end, 7, "appended to while running");
+		mcedb_query_free(c);
+	}
+#undef QUERY
+
+	mcedb_close(db);
+}
+
+static void
+remove_db(const char *dir)
+{
+	char cmd[4200];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if (system(cmd) != 0) {
+		printf("can't remove %s\n", dir);
+	}
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/test_mcedb.XXXXXX";
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp()");
+		return EXIT_FAILURE;
+	}
+
+	test_recovery(dir);
+	remove_db(dir);
+
+	if (!mkdtemp(strcpy(dir, "/tmp/test_mcedb.XXXXXX"))) {
+		perror("mkdtemp()");
+		return EXIT_FAILURE;
+	}
+	test_queries(dir);
+	remove_db(dir);
+
+	if (nfailed) {
+		printf("%d check%s failed\n", nfailed, (nfailed == 1) ? "" : "s");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
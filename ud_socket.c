@@ -115,3 +115,79 @@ ud_get_peercred(int fd, struct ucred *cred)
 	getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &len);
 	return 0;
 }
+
+/* send 'len' bytes of 'buf' with a file descriptor attached */
+int
+ud_send_fd(int sock, int fd, const void *buf, size_t len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	return (r < 0) ? -1 : (int)r;
+}
+
+/*
+ * Receive up to 'len' bytes into 'buf'.  If a file descriptor came with
+ * them, it is stored in '*fd', otherwise '*fd' is set to -1.
+ */
+int
+ud_recv_fd(int sock, void *buf, size_t len, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	do {
+		r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		return -1;
+	}
+
+	*fd = -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+		 && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	return (int)r;
+}
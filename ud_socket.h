@@ -12,5 +12,7 @@ int ud_create_socket(const char *name);
 int ud_accept(int sock, struct ucred *cred);
 int ud_connect(const char *name);
 int ud_get_peercred(int fd, struct ucred *cred);
+int ud_send_fd(int sock, int fd, const void *buf, size_t len);
+int ud_recv_fd(int sock, void *buf, size_t len, int *fd);
 
 #endif